@@ -1,35 +1,15 @@
 #include "AcornADFS.h"
+#include "AcornADFSdisc.h"
+#include "AcornTrace.h"
+#include "WorkPool.h"
 
+#include <alloca.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#define FSMAP_MAX_ENT 82
-#define DIR_HDR_SIZE  0x05
-#define DIR_ENT_SIZE  0x1A
-#define DIR_FTR_SIZE  0x35
-
-static inline uint32_t adfs_get32(const unsigned char *base) {
-    return base[0] | (base[1] << 8) | (base[2] << 16) | (base[3] << 24);
-}
-
-static inline uint32_t adfs_get24(const unsigned char *base) {
-    return base[0] | (base[1] << 8) | (base[2] << 16);
-}
-
-static inline void adfs_put32(unsigned char *base, uint32_t value) {
-    base[0] = value & 0xff;
-    base[1] = (value >> 8) & 0xff;
-    base[2] = (value >> 16) & 0xff;
-    base[3] = (value >> 24) & 0xff;
-}
-
-static inline void adfs_put24(unsigned char *base, uint32_t value) {
-    base[0] = value & 0xff;
-    base[1] = (value >> 8) & 0xff;
-    base[2] = (value >> 16) & 0xff;
-}
-
-static uint8_t checksum(uint8_t *base) {
+uint8_t AcornADFS::checksum(uint8_t *base) {
     int i = 255, c = 0;
     unsigned sum = 255;
     while (--i >= 0) {
@@ -43,82 +23,464 @@ static uint8_t checksum(uint8_t *base) {
     return sum;
 }
 
+static int ent_name(const unsigned char *ent, char *name) {
+    int i, ch;
+
+    for (i = 0; i < ADFS_MAX_NAME; i++) {
+        ch = ent[i] & 0x7f;
+        if (ch == 0 || ch == 0x0d)
+            break;
+        name[i] = ch;
+    }
+    name[i] = '\0';
+    return i;
+}
+
+static void ent_decode(const unsigned char *ent, afs_object *obj) {
+    ent_name(ent, obj->name);
+    obj->user_read  = ((ent[0] & 0x80) == 0x80);
+    obj->user_write = ((ent[1] & 0x80) == 0x80);
+    obj->locked     = ((ent[2] & 0x80) == 0x80);
+    obj->is_dir     = ((ent[3] & 0x80) == 0x80);
+    obj->user_exec  = ((ent[4] & 0x80) == 0x80);
+    obj->pub_read   = ((ent[5] & 0x80) == 0x80);
+    obj->pub_write  = ((ent[6] & 0x80) == 0x80);
+    obj->pub_exec   = ((ent[7] & 0x80) == 0x80);
+    obj->pub_exec   = ((ent[8] & 0x80) == 0x80);
+    obj->priv       = ((ent[9] & 0x80) == 0x80);
+    obj->load_addr  = adfs_get32(ent + 0x0a);
+    obj->exec_addr  = adfs_get32(ent + 0x0e);
+    obj->length     = adfs_get32(ent + 0x12);
+    obj->sector     = adfs_get24(ent + 0x16);
+    obj->data       = NULL;
+}
+
+static int dir_valid(const unsigned char *hdr, unsigned length) {
+    const unsigned char *ftr = hdr + length - DIR_FTR_SIZE;
+
+    return hdr[1] == 'H' && hdr[2] == 'u' && hdr[3] == 'g' && hdr[4] == 'o'
+        && ftr[47] == hdr[0] && ftr[48] == 'H' && ftr[49] == 'u' && ftr[50] == 'g' && ftr[51] == 'o';
+}
+
 AcornADFS::AcornADFS(DiskImgIO *dio) {
+    pthread_rwlockattr_t attr;
+    int i;
+
     discio = dio;
     fsmap = NULL;
+    catalog = NULL;
+    deferred = map_dirty = 0;
+    memset(dircache, 0, sizeof(dircache));
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // a steady stream of readers must not starve a save.
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&map_lock, NULL);
+    for (i = 0; i < ADFS_DIRCACHE; i++)
+        pthread_mutex_init(dir_locks + i, NULL);
+}
+
+AcornADFS::~AcornADFS() {
+    int i;
+
+    flush();
+    if (fsmap)
+        discio->dio_free(fsmap);
+    if (catalog)
+        delete catalog;
+    dir_flush();
+    for (i = 0; i < ADFS_DIRCACHE; i++)
+        pthread_mutex_destroy(dir_locks + i);
+    pthread_mutex_destroy(&map_lock);
+    pthread_rwlock_destroy(&lock);
 }
 
 void AcornADFS::obj_free(afs_object *obj) {
-    if (obj->data != NULL)
+    if (obj->data != NULL) {
         discio->dio_free(obj->data);
+        obj->data = NULL;
+    }
 }
 
+/*
+ * Lookups, loads and saves take the instance lock shared.  Below that
+ * each directory is guarded by one of a set of mutexes striped by
+ * sector, which also covers the directory cache bucket of the same
+ * index, and the free space map has a mutex of its own.  Only format,
+ * check and installing a catalog take the instance lock exclusive.
+ */
+
 afs_status AcornADFS::load(afs_object *obj) {
+    afs_status status = AFS_OK;
+    AFS_SPAN("load", discio->name(), obj->name, -1, obj->length);
+
+    if (obj->length == 0) {
+        obj->data = NULL;
+        return AFS_OK;
+    }
+    pthread_rwlock_rdlock(&lock);
     if ((obj->data = discio->read(obj->sector, obj->length)) == NULL)
+        status = AFS_READ_ERR;
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+/*
+ * Load many files with as few seeks as possible: the objects are
+ * visited in ascending sector order and files no more than
+ * EXTRACT_GAP_MAX sectors apart on the disc are fetched with one read
+ * of up to EXTRACT_RUN_MAX bytes.  fn is called with each object
+ * loaded, in disc order, and owns the data from then on, releasing it
+ * with obj_free(); index is its position in objs.
+ */
+
+#define EXTRACT_RUN_MAX (256 * 1024)
+#define EXTRACT_GAP_MAX 8
+
+static int extract_cmp(const void *a, const void *b, void *arg) {
+    afs_object *objs = (afs_object *)arg;
+    unsigned sa = objs[*(const unsigned *)a].sector, sb = objs[*(const unsigned *)b].sector;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+afs_status AcornADFS::extract(afs_object *objs, unsigned count, afs_extract_fn fn, void *ctx) {
+    afs_status status = AFS_OK;
+    unsigned *order, i, j, k, start, end, obj_end, bytes;
+    unsigned char *run;
+    afs_object *obj;
+    AFS_SPAN("extract", discio->name(), NULL, 0, count);
+
+    if (count == 0)
+        return AFS_OK;
+    if ((order = (unsigned *)malloc(count * sizeof(unsigned))) == NULL)
+        return AFS_NO_MEMORY;
+    for (i = 0; i < count; i++)
+        order[i] = i;
+    qsort_r(order, count, sizeof(unsigned), extract_cmp, objs);
+    for (i = 0; status == AFS_OK && i < count; i = j) {
+        obj = objs + order[i];
+        if (obj->length == 0) {
+            obj->data = NULL;
+            status = fn(ctx, order[i], obj);
+            j = i + 1;
+            continue;
+        }
+        start = obj->sector;
+        end = start + discio->sectors(obj->length);
+        for (j = i + 1; j < count; j++) {
+            obj = objs + order[j];
+            if (obj->length == 0 || obj->sector > end + EXTRACT_GAP_MAX)
+                break;
+            obj_end = obj->sector + discio->sectors(obj->length);
+            if (obj_end > end && (obj_end - start) * 256 > EXTRACT_RUN_MAX)
+                break;
+            if (obj_end > end)
+                end = obj_end;
+        }
+        bytes = (end - start) * 256;
+        if (j == i + 1)
+            bytes = objs[order[i]].length;
+        pthread_rwlock_rdlock(&lock);
+        run = discio->read(start, bytes);
+        pthread_rwlock_unlock(&lock);
+        if (run == NULL) {
+            status = AFS_READ_ERR;
+            break;
+        }
+        if (j == i + 1) {
+            objs[order[i]].data = run;
+            status = fn(ctx, order[i], objs + order[i]);
+            continue;
+        }
+        for (k = i; status == AFS_OK && k < j; k++) {
+            obj = objs + order[k];
+            if ((obj->data = discio->dio_alloc(obj->length)) == NULL)
+                status = AFS_NO_MEMORY;
+            else {
+                memcpy(obj->data, run + (obj->sector - start) * 256, obj->length);
+                status = fn(ctx, order[k], obj);
+            }
+        }
+        discio->dio_free(run);
+    }
+    free(order);
+    return status;
+}
+
+/*
+ * Directories are cached per instance, keyed by sector, with their
+ * entries decoded and a hashed index on the names, so each directory
+ * is read and parsed once however many lookups go through it.  Each
+ * bucket keeps its directories most recently used first and holds at
+ * most ADFS_DIRCACHE_WAYS of them, less any dirty ones waiting for a
+ * deferred flush.
+ */
+
+struct adfs_dir {
+    adfs_dir      *next;
+    uint32_t      sector;
+    uint32_t      length;
+    unsigned char *data;
+    afs_object    *ents;
+    unsigned      count;
+    unsigned      *index;
+    unsigned      mask;
+    int           dirty;
+};
+
+static unsigned name_hash(const char *name, int len) {
+    unsigned hash = 2166136261u;
+
+    while (len-- > 0)
+        hash = (hash ^ (*name++ & 0xdf)) * 16777619u;
+    return hash;
+}
+
+static int name_match(const char *ent_name, const char *name, int len) {
+    int i;
+
+    for (i = 0; i < len; i++)
+        if (ent_name[i] == '\0' || ((ent_name[i] ^ name[i]) & 0xdf) != 0)
+            return 0;
+    return ent_name[len] == '\0';
+}
+
+/*
+ * (Re)build the decoded entries and the name index of a directory
+ * from its raw data.
+ */
+
+static int dir_index(adfs_dir *dir) {
+    unsigned char *ent, *ftr;
+    unsigned i, slot, size;
+    afs_object *obj;
+
+    free(dir->ents);
+    free(dir->index);
+    dir->ents = NULL;
+    dir->index = NULL;
+    dir->count = 0;
+    if ((dir->ents = (afs_object *)malloc(DIR_MAX_ENT * sizeof(afs_object))) == NULL)
+        return 0;
+    ftr = dir->data + dir->length - DIR_FTR_SIZE;
+    for (ent = dir->data + DIR_HDR_SIZE; ent < ftr && *ent; ent += DIR_ENT_SIZE)
+        ent_decode(ent, dir->ents + dir->count++);
+    for (size = 16; size < dir->count * 2; size *= 2)
+        ;
+    if ((dir->index = (unsigned *)calloc(size, sizeof(unsigned))) == NULL)
+        return 0;
+    dir->mask = size - 1;
+    for (i = 0; i < dir->count; i++) {
+        obj = dir->ents + i;
+        slot = name_hash(obj->name, strlen(obj->name)) & dir->mask;
+        while (dir->index[slot])
+            slot = (slot + 1) & dir->mask;
+        dir->index[slot] = i + 1;
+    }
+    return 1;
+}
+
+static void dir_free(adfs_dir *dir) {
+    free(dir->data);
+    free(dir->ents);
+    free(dir->index);
+    free(dir);
+}
+
+void AcornADFS::dir_drop(uint32_t sector) {
+    adfs_dir **prev, *dir;
+
+    prev = dircache + sector % ADFS_DIRCACHE;
+    while ((dir = *prev)) {
+        if (dir->sector == sector) {
+            *prev = dir->next;
+            if (dir->dirty)
+                discio->write(dir->sector, dir->length, dir->data);
+            dir_free(dir);
+        }
+        else
+            prev = &dir->next;
+    }
+}
+
+void AcornADFS::dir_flush() {
+    adfs_dir *dir;
+    int i;
+
+    for (i = 0; i < ADFS_DIRCACHE; i++) {
+        while ((dir = dircache[i])) {
+            dircache[i] = dir->next;
+            dir_free(dir);
+        }
+    }
+}
+
+/*
+ * Fetch a directory through the cache.  The caller holds the stripe
+ * lock for obj->sector.
+ */
+
+afs_status AcornADFS::dir_get(afs_object *obj, adfs_dir **dir_ptr) {
+    adfs_dir *dir, *old, **bucket, **prev, **victim;
+    unsigned count;
+
+    if (!obj->is_dir)
+        return AFS_NOT_A_DIR;
+    bucket = dircache + obj->sector % ADFS_DIRCACHE;
+    for (prev = bucket; (dir = *prev); prev = &dir->next) {
+        if (dir->sector == obj->sector && dir->length == obj->length) {
+            *prev = dir->next;
+            dir->next = *bucket;
+            *bucket = dir;
+            *dir_ptr = dir;
+            return AFS_OK;
+        }
+    }
+    dir_drop(obj->sector);
+    if ((dir = (adfs_dir *)calloc(1, sizeof(adfs_dir))) == NULL)
+        return AFS_NO_MEMORY;
+    dir->sector = obj->sector;
+    dir->length = obj->length;
+    if (obj->length < DIR_HDR_SIZE + DIR_FTR_SIZE || (dir->data = discio->read(obj->sector, obj->length)) == NULL) {
+        free(dir);
         return AFS_READ_ERR;
+    }
+    if (!dir_valid(dir->data, dir->length) || !dir_index(dir)) {
+        dir_free(dir);
+        return AFS_BROKEN_DIR;
+    }
+    // the least recently used clean directory makes way for this one;
+    // the one used just before it always survives, as callers such as
+    // remove hold on to it.
+    victim = NULL;
+    for (count = 0, prev = bucket; *prev; prev = &(*prev)->next)
+        if (++count >= 2 && !(*prev)->dirty)
+            victim = prev;
+    if (count >= ADFS_DIRCACHE_WAYS && victim) {
+        old = *victim;
+        *victim = old->next;
+        dir_free(old);
+    }
+    dir->next = *bucket;
+    *bucket = dir;
+    *dir_ptr = dir;
     return AFS_OK;
 }
 
+pthread_mutex_t *AcornADFS::dir_lock(uint32_t sector) {
+    pthread_mutex_t *mutex = dir_locks + sector % ADFS_DIRCACHE;
+
+    pthread_mutex_lock(mutex);
+    return mutex;
+}
+
+/*
+ * Look a name up in a directory.  On success child is filled in and
+ * ent_ptr is left pointing at the raw entry, or
+ * when the name is not found at the slot where it would be inserted
+ * (NULL if the directory is full).  ent_ptr is only meaningful while
+ * the directory's stripe lock is held.
+ */
+
 afs_status AcornADFS::search(afs_object *parent, afs_object *child, const char *name, int name_len, unsigned char **ent_ptr) {
+    AFS_SPAN("search", discio->name(), name, name_len, 0);
+    pthread_mutex_t *mutex = dir_lock(parent->sector);
     afs_status status;
-    unsigned char *hdr, *ent, *ftr;
-    int i, c, found;
 
+    status = search_locked(parent, child, name, name_len, ent_ptr);
+    pthread_mutex_unlock(mutex);
+    return status;
+}
+
+afs_status AcornADFS::search_locked(afs_object *parent, afs_object *child, const char *name, int name_len, unsigned char **ent_ptr) {
+    afs_status status;
+    afs_object *obj;
+    adfs_dir *dir;
+    char key[ADFS_MAX_NAME+1];
+    unsigned slot, idx, lo, hi, mid;
+
+    *ent_ptr = NULL;
     if (name_len > ADFS_MAX_NAME)
         return AFS_NAME_TOO_LONG;
-    if (!parent->is_dir)
-        return AFS_NOT_A_DIR;
-    if ((status = load(parent)) == AFS_OK) {
-        hdr = parent->data;
-        if (hdr[1] == 'H' && hdr[2] == 'u' && hdr[3] == 'g' && hdr[4] == 'o') {
-            ftr = hdr + parent->length - DIR_FTR_SIZE;
-            if (ftr[47] == hdr[0] && ftr[48] == 'H' && ftr[49] == 'u' && ftr[50] == 'g' && ftr[51] == 'o') {
-                for (ent = hdr + DIR_HDR_SIZE; ent < ftr; ent += DIR_ENT_SIZE) {
-                    if (*ent == 0) {
-                        *ent_ptr = ent;
-                        return AFS_NOT_FOUND;
-                    }
-                    found = 1;
-                    for (i = 0; i < name_len; i++) {
-                        c = (name[i] & 0xdf) - (ent[i] & 0x5f);
-                        if (c < 0) {
-                            *ent_ptr = ent;
-                            return AFS_NOT_FOUND;
-                        }
-                        if (c > 0) {
-                            found = 0;
-                            break;
-                        }
-                    }
-                    if (found) {
-                        for (i = 0; i < name_len; i++)
-                            child->name[i] = (ent[i] & 0x7f);
-                        child->name[i]    = '\0';
-                        child->user_read  = ((ent[0] & 0x80) == 0x80);
-                        child->user_write = ((ent[1] & 0x80) == 0x80);
-                        child->locked     = ((ent[2] & 0x80) == 0x80);
-                        child->is_dir     = ((ent[3] & 0x80) == 0x80);
-                        child->user_exec  = ((ent[4] & 0x80) == 0x80);
-                        child->pub_read   = ((ent[5] & 0x80) == 0x80);
-                        child->pub_write  = ((ent[6] & 0x80) == 0x80);
-                        child->pub_exec   = ((ent[7] & 0x80) == 0x80);
-                        child->pub_exec   = ((ent[8] & 0x80) == 0x80);
-                        child->priv       = ((ent[9] & 0x80) == 0x80);
-                        child->load_addr  = adfs_get32(ent + 0x0a);
-                        child->exec_addr  = adfs_get32(ent + 0x0e);
-                        child->length     = adfs_get32(ent + 0x12);
-                        child->sector     = adfs_get24(ent + 0x16);
-                        *ent_ptr = ent;
-                        return AFS_OK;
-                    }
-                }
-                *ent_ptr = NULL;
-                return AFS_NOT_FOUND;
-            }
+    if ((status = dir_get(parent, &dir)) != AFS_OK)
+        return status;
+    slot = name_hash(name, name_len) & dir->mask;
+    while ((idx = dir->index[slot])) {
+        obj = dir->ents + idx - 1;
+        if (name_match(obj->name, name, name_len)) {
+            *child = *obj;
+            *ent_ptr = dir->data + DIR_HDR_SIZE + (idx - 1) * DIR_ENT_SIZE;
+            return AFS_OK;
+        }
+        slot = (slot + 1) & dir->mask;
+    }
+    if (dir->count < DIR_MAX_ENT) {
+        memcpy(key, name, name_len);
+        key[name_len] = '\0';
+        lo = 0;
+        hi = dir->count;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (adfs_namecmp(dir->ents[mid].name, key) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
-        status = AFS_BROKEN_DIR;
-        obj_free(parent);
+        *ent_ptr = dir->data + DIR_HDR_SIZE + lo * DIR_ENT_SIZE;
     }
+    return AFS_NOT_FOUND;
+}
+
+afs_status AcornADFS::list(afs_object *dir_obj, afs_object **ents, unsigned *count) {
+    pthread_mutex_t *mutex;
+    afs_status status;
+    afs_object *objs;
+    adfs_dir *dir;
+    AFS_SPAN("list", discio->name(), dir_obj->name, -1, dir_obj->length);
+
+    pthread_rwlock_rdlock(&lock);
+    mutex = dir_lock(dir_obj->sector);
+    if ((status = dir_get(dir_obj, &dir)) == AFS_OK) {
+        if ((objs = (afs_object *)malloc((dir->count ? dir->count : 1) * sizeof(afs_object))) == NULL)
+            status = AFS_NO_MEMORY;
+        else {
+            memcpy(objs, dir->ents, dir->count * sizeof(afs_object));
+            *ents  = objs;
+            *count = dir->count;
+        }
+    }
+    pthread_mutex_unlock(mutex);
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+/*
+ * Identify the current state of a directory: its master sequence
+ * number and a hash of its raw contents, which also catches changes
+ * made without stepping the sequence number or after it has wrapped.
+ */
+
+afs_status AcornADFS::stamp(afs_object *dir_obj, unsigned *seq, uint32_t *hash) {
+    pthread_mutex_t *mutex;
+    afs_status status;
+    adfs_dir *dir;
+    unsigned i;
+    uint32_t h = 2166136261u;
+
+    pthread_rwlock_rdlock(&lock);
+    mutex = dir_lock(dir_obj->sector);
+    if ((status = dir_get(dir_obj, &dir)) == AFS_OK) {
+        for (i = 0; i < dir->length; i++)
+            h = (h ^ dir->data[i]) * 16777619u;
+        *seq = dir->data[0];
+        *hash = h;
+    }
+    pthread_mutex_unlock(mutex);
+    pthread_rwlock_unlock(&lock);
     return status;
 }
 
@@ -130,6 +492,16 @@ static void make_root(afs_object *obj) {
 }
 
 afs_status AcornADFS::find(const char *adfs_name, afs_object *obj) {
+    afs_status status;
+    AFS_SPAN("find", discio->name(), adfs_name, -1, 0);
+
+    pthread_rwlock_rdlock(&lock);
+    status = find_locked(adfs_name, obj);
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+afs_status AcornADFS::find_locked(const char *adfs_name, afs_object *obj) {
     afs_status status;
     const char  *ptr;
     afs_object *parent, *child, *temp, a, b;
@@ -142,26 +514,26 @@ afs_status AcornADFS::find(const char *adfs_name, afs_object *obj) {
         } else if (adfs_name[1] == '.')
             adfs_name += 2;
     }
+    if (catalog)
+        return catalog->find(adfs_name, obj);
     make_root(&a);
     parent = &a;
     child  = &b;
     while ((ptr = strchr(adfs_name, '.'))) {
-        if ((status = search(parent, child, adfs_name, ptr - adfs_name, &ent)) != AFS_OK) {
-            obj_free(parent);
+        if ((status = search(parent, child, adfs_name, ptr - adfs_name, &ent)) != AFS_OK)
             return status;
-        }
         temp = parent;
         parent = child;
         child = temp;
         adfs_name = ptr + 1;
     }
-    status = search(parent, obj, adfs_name, strlen(adfs_name), &ent);
-    obj_free(parent);
-    return status;
+    return search(parent, obj, adfs_name, strlen(adfs_name), &ent);
 }
 
 afs_status AcornADFS::load_fsmap() {
     afs_status status = AFS_OK;
+    AFS_SPAN("load_fsmap", discio->name(), NULL, 0, fsmap ? 0 : 512);
+
     if (!fsmap) {
         if ((fsmap = discio->read(0, 512)) == NULL)
             status = AFS_READ_ERR;
@@ -178,10 +550,15 @@ afs_status AcornADFS::load_fsmap() {
 
 afs_status AcornADFS::save_fsmap() {
     int err;
+    AFS_SPAN("save_fsmap", discio->name(), NULL, 0, deferred ? 0 : 512);
 
     if (fsmap) {
         fsmap[0x0ff] = checksum(fsmap);
         fsmap[0x1ff] = checksum(fsmap + 0x100);
+        if (deferred) {
+            map_dirty = 1;
+            return AFS_OK;
+        }
         if ((err = discio->write(0, 512, fsmap)) != 0)
             return AFS_WRITE_ERR;
         return AFS_OK;
@@ -189,37 +566,592 @@ afs_status AcornADFS::save_fsmap() {
     return AFS_BUG;
 }
 
+/*
+ * Take the instance lock shared for an update.  A catalog would go
+ * stale so it is retired first, which needs the lock exclusive.
+ */
+
+void AcornADFS::lock_update() {
+    pthread_rwlock_rdlock(&lock);
+    while (catalog) {
+        pthread_rwlock_unlock(&lock);
+        pthread_rwlock_wrlock(&lock);
+        if (catalog) {
+            delete catalog;
+            catalog = NULL;
+        }
+        pthread_rwlock_unlock(&lock);
+        pthread_rwlock_rdlock(&lock);
+    }
+}
+
+/*
+ * Take the instance lock exclusive for an update that touches more
+ * than one directory, so no stripe locks are needed, again retiring
+ * any catalog.
+ */
+
+void AcornADFS::lock_exclusive() {
+    pthread_rwlock_wrlock(&lock);
+    if (catalog) {
+        delete catalog;
+        catalog = NULL;
+    }
+}
+
 afs_status AcornADFS::save(afs_object *obj, const char *dest_dir) {
+    afs_status status;
+    AFS_SPAN("save", discio->name(), dest_dir, -1, obj->length);
+
+    lock_update();
+    status = save_locked(obj, dest_dir);
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+/*
+ * Saves into different directories only meet on the map mutex, which
+ * is held just long enough to take space out of the map and commit it.
+ * If the save then fails the space is handed back, so a crash can leak
+ * sectors but never hand the same ones out twice.  Saving over a
+ * directory is refused: the old space would otherwise have to be
+ * freed while holding two directory locks.  Saving over a file goes
+ * through map_replace() so the old space can be reused.
+ */
+
+afs_status AcornADFS::save_locked(afs_object *obj, const char *dest_dir) {
     afs_status status;
     afs_object parent, child;
+    pthread_mutex_t *mutex;
     unsigned char *ent;
+    adfs_dir *dir;
+    int replace;
+
+    if ((status = find_locked(dest_dir, &parent)) != AFS_OK)
+        return status;
+    if (!parent.is_dir)
+        return AFS_NOT_A_DIR;
+    mutex = dir_lock(parent.sector);
+    if ((status = dir_get(&parent, &dir)) == AFS_OK) {
+        status = search_locked(&parent, &child, obj->name, strlen(obj->name), &ent);
+        replace = status == AFS_OK;
+        if (replace && child.is_dir)
+            status = AFS_IS_DIR;
+        else if (status == AFS_NOT_FOUND)
+            status = ent ? AFS_OK : AFS_DIR_FULL;
+        if (status == AFS_OK && replace)
+            status = map_replace(obj, &child, dir, ent);
+        else if (status == AFS_OK && (status = map_commit(obj, 0)) == AFS_OK) {
+            if (obj->length > 0 && write_data(obj) != 0)
+                status = AFS_WRITE_ERR;
+            else {
+                dir_makeslot(dir, ent);
+                if ((status = dir_update(dir, obj, ent)) != AFS_OK)
+                    dir_drop(parent.sector);
+            }
+            if (status != AFS_OK)
+                map_commit(obj, 1);
+        }
+    }
+    pthread_mutex_unlock(mutex);
+    return status;
+}
+
+int AcornADFS::write_data(afs_object *obj) {
+    AFS_SPAN("write", discio->name(), obj->name, -1, obj->length);
+
+    return discio->write(obj->sector, obj->length, obj->data);
+}
+
+/*
+ * Allocate space for obj or free the space it holds, and write the
+ * free space map straight back.
+ */
+
+afs_status AcornADFS::map_commit(afs_object *obj, int release) {
+    afs_status status;
+
+    pthread_mutex_lock(&map_lock);
+    if ((status = load_fsmap()) == AFS_OK) {
+        status = release ? map_free(obj) : map_alloc(obj);
+        if (status == AFS_OK)
+            status = save_fsmap();
+        if (status != AFS_OK && !map_dirty) {
+            discio->dio_free(fsmap);
+            fsmap = NULL;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    return status;
+}
+
+/*
+ * Replace the file old, whose entry is ent in dir, with obj.  If the
+ * old space is big enough obj is written over it and any tail is
+ * freed; otherwise the old space is freed first so a replace on a
+ * nearly full disc can still find room.  The map mutex is held until
+ * the directory is written, so if anything fails the map is put back
+ * as it was without another save having taken the old space.
+ */
+
+afs_status AcornADFS::map_replace(afs_object *obj, afs_object *old, adfs_dir *dir, unsigned char *ent) {
+    unsigned char saved[512];
+    uint32_t old_size, obj_size, sector = dir->sector;
+    afs_object tail;
+    afs_status status;
+
+    pthread_mutex_lock(&map_lock);
+    if ((status = load_fsmap()) == AFS_OK) {
+        memcpy(saved, fsmap, 512);
+        old_size = old->length ? discio->sectors(old->length) : 0;
+        obj_size = obj->length ? discio->sectors(obj->length) : 0;
+        if (obj_size > 0 && old_size >= obj_size) {
+            obj->sector = old->sector;
+            if (old_size > obj_size) {
+                tail = *old;
+                tail.sector = old->sector + obj_size;
+                tail.length = (old_size - obj_size) * 256;
+                status = map_free(&tail);
+            }
+        } else if ((status = map_free(old)) == AFS_OK)
+            status = map_alloc(obj);
+        if (status == AFS_OK)
+            status = save_fsmap();
+        if (status == AFS_OK && obj->length > 0 && write_data(obj) != 0)
+            status = AFS_WRITE_ERR;
+        if (status == AFS_OK && (status = dir_update(dir, obj, ent)) != AFS_OK)
+            dir_drop(sector);
+        if (status != AFS_OK) {
+            memcpy(fsmap, saved, 512);
+            save_fsmap();
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    return status;
+}
+
+/*
+ * While deferred, directory and map updates are kept in memory and
+ * only written by flush(), so a run of saves writes each directory
+ * and the map once.  File data is always written straight away.
+ */
+
+afs_status AcornADFS::set_deferred(int on) {
+    pthread_rwlock_wrlock(&lock);
+    deferred = on;
+    pthread_rwlock_unlock(&lock);
+    return on ? AFS_OK : flush();
+}
+
+afs_status AcornADFS::flush() {
+    afs_status status = AFS_OK;
+    adfs_dir *dir;
+    int i;
+
+    pthread_rwlock_wrlock(&lock);
+    for (i = 0; i < ADFS_DIRCACHE; i++) {
+        for (dir = dircache[i]; dir; dir = dir->next) {
+            if (dir->dirty) {
+                if (discio->write(dir->sector, dir->length, dir->data) != 0)
+                    status = AFS_WRITE_ERR;
+                else
+                    dir->dirty = 0;
+            }
+        }
+    }
+    if (map_dirty && status == AFS_OK) {
+        if (discio->write(0, 512, fsmap) != 0)
+            status = AFS_WRITE_ERR;
+        else
+            map_dirty = 0;
+    }
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+/*
+ * Resolve paths through the catalog sidecar cat_name while it matches
+ * the image, building a fresh one first if create is set.  Returns
+ * AFS_NOT_FOUND when there is no usable catalog.
+ */
+
+afs_status AcornADFS::use_catalog(const char *cat_name, int create) {
+    unsigned char map[512];
+    AcornCatalog *cat;
+    afs_status status;
+    struct stat st;
+
+    pthread_rwlock_wrlock(&lock);
+    if (catalog) {
+        delete catalog;
+        catalog = NULL;
+    }
+    pthread_rwlock_unlock(&lock);
+    if ((status = map_snapshot(map)) != AFS_OK)
+        return status;
+    if (discio->stat(&st) != 0)
+        return AFS_HOST_ERROR;
+    if ((cat = AcornCatalog::open(cat_name, &st, map)) == NULL && create) {
+        if (AcornCatalog::create(this, cat_name, &st, map) != 0)
+            return AFS_HOST_ERROR;
+        cat = AcornCatalog::open(cat_name, &st, map);
+    }
+    if (cat == NULL)
+        return AFS_NOT_FOUND;
+    pthread_rwlock_wrlock(&lock);
+    if (catalog)
+        delete catalog;
+    catalog = cat;
+    pthread_rwlock_unlock(&lock);
+    return AFS_OK;
+}
 
-    if ((status = find(dest_dir, &parent)) == AFS_OK) {
-        if (!parent.is_dir)
+/*
+ * Copy the free space map as it was last committed.  The working copy
+ * in fsmap is only changed under the map mutex.
+ */
+
+afs_status AcornADFS::map_snapshot(unsigned char *map) {
+    afs_status status = AFS_OK;
+    unsigned char *disc_map;
+
+    pthread_mutex_lock(&map_lock);
+    if (fsmap)
+        memcpy(map, fsmap, 512);
+    else if ((disc_map = discio->read(0, 512)) == NULL)
+        status = AFS_READ_ERR;
+    else {
+        if (checksum(disc_map) != disc_map[0xff] || checksum(disc_map + 0x100) != disc_map[0x1ff])
+            status = AFS_BAD_FSMAP;
+        else
+            memcpy(map, disc_map, 512);
+        discio->dio_free(disc_map);
+    }
+    pthread_mutex_unlock(&map_lock);
+    return status;
+}
+
+void AcornADFS::dir_init(unsigned char *hdr, const char *name, uint32_t parent) {
+    unsigned char *ftr = hdr + DIR_SIZE - DIR_FTR_SIZE;
+    int len = strlen(name);
+
+    memset(hdr, 0, DIR_SIZE);
+    memcpy(hdr + 1, "Hugo", 4);
+    memset(ftr + 1, 0x0d, ADFS_MAX_NAME);
+    memcpy(ftr + 1, name, len);
+    adfs_put24(ftr + 11, parent);
+    memset(ftr + 14, 0x0d, 19);
+    memcpy(ftr + 14, name, len);
+    memcpy(ftr + 48, "Hugo", 4);
+}
+
+/*
+ * Write an empty filesystem of the given number of sectors: the free
+ * space map, an empty root directory and a final zeroed sector so the
+ * image file is the full size.
+ */
+
+afs_status AcornADFS::format(unsigned sectors) {
+    unsigned char *map, *root;
+    afs_status status = AFS_WRITE_ERR;
+
+    if (sectors < 8)
+        return AFS_NO_SPACE;
+    if ((map = (unsigned char *)calloc(1, 512 + 1280)) == NULL)
+        return AFS_NO_MEMORY;
+    pthread_rwlock_wrlock(&lock);
+    root = map + 512;
+    adfs_put24(map, 7);
+    adfs_put24(map + 0x100, sectors - 7);
+    adfs_put24(map + 0xfc, sectors);
+    map[0x1fe] = 3;
+    map[0x0ff] = checksum(map);
+    map[0x1ff] = checksum(map + 0x100);
+    if (discio->write(sectors - 1, 256, root) == 0) {
+        dir_init(root, "$", 2);
+        if (discio->write(2, 1280, root) == 0 && discio->write(0, 512, map) == 0)
+            status = AFS_OK;
+    }
+    free(map);
+    if (fsmap) {
+        discio->dio_free(fsmap);
+        fsmap = NULL;
+    }
+    map_dirty = 0;
+    dir_flush();
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+afs_status AcornADFS::mkdir(const char *name, const char *dest_dir) {
+    afs_status status;
+    afs_object parent, obj;
+    char *path;
+
+    if (strlen(name) > ADFS_MAX_NAME)
+        return AFS_NAME_TOO_LONG;
+    path = (char *)alloca(strlen(dest_dir) + strlen(name) + 2);
+    sprintf(path, "%s.%s", dest_dir, name);
+    lock_update();
+    if ((status = find_locked(path, &obj)) == AFS_OK)
+        status = obj.is_dir ? AFS_OK : AFS_NOT_A_DIR;
+    else if (status == AFS_NOT_FOUND) {
+        if ((status = find_locked(dest_dir, &parent)) == AFS_OK && !parent.is_dir)
             status = AFS_NOT_A_DIR;
-        else if ((status = load_fsmap()) == AFS_OK) {
-            if ((status = search(&parent, &child, obj->name, strlen(obj->name), &ent)) == AFS_OK) {
-                if ((status = map_free(&child)) == AFS_OK)
-                    if ((status = alloc_write(obj)) == AFS_OK)
-                        status = dir_update(&parent, obj, ent);
-            } else if (status == AFS_NOT_FOUND) {
-                if (ent == NULL)
+        else if (status == AFS_OK) {
+            memset(&obj, 0, sizeof(obj));
+            strcpy(obj.name, name);
+            obj.is_dir = obj.locked = obj.user_read = 1;
+            obj.length = 1280;
+            if ((obj.data = (unsigned char *)malloc(obj.length)) == NULL)
+                status = AFS_NO_MEMORY;
+            else {
+                dir_init(obj.data, name, parent.sector);
+                if ((status = save_locked(&obj, dest_dir)) == AFS_IS_DIR)
+                    status = AFS_OK; // made by a concurrent mkdir.
+                free(obj.data);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+/*
+ * Split an ADFS path into a malloced parent path and the leaf name,
+ * which points into the original.
+ */
+
+static afs_status split_name(const char *adfs_name, char **dir_name, const char **leaf) {
+    const char *dot;
+
+    if ((dot = strrchr(adfs_name, '.')) == NULL) {
+        if (strcmp(adfs_name, "$") == 0)
+            return AFS_BAD_COMMAND;
+        *dir_name = strdup("$");
+        *leaf = adfs_name;
+    }
+    else {
+        *dir_name = strndup(adfs_name, dot - adfs_name);
+        *leaf = dot + 1;
+    }
+    if (*dir_name == NULL)
+        return AFS_NO_MEMORY;
+    return **leaf ? AFS_OK : AFS_BAD_COMMAND;
+}
+
+/*
+ * Set the name and parent held in a directory's footer.  The title is
+ * renamed too if it was the old name.
+ */
+
+static void ftr_rename(unsigned char *ftr, const char *old_name, const char *new_name, uint32_t parent) {
+    char title[20];
+    int i;
+
+    for (i = 0; i < 19 && ftr[14 + i] != 0x0d && ftr[14 + i] != 0; i++)
+        title[i] = ftr[14 + i];
+    title[i] = '\0';
+    memset(ftr + 1, 0x0d, ADFS_MAX_NAME);
+    memcpy(ftr + 1, new_name, strlen(new_name));
+    adfs_put24(ftr + 11, parent);
+    if (strcasecmp(title, old_name) == 0) {
+        memset(ftr + 14, 0x0d, 19);
+        memcpy(ftr + 14, new_name, strlen(new_name));
+    }
+}
+
+/*
+ * Fail if the directory at sector is ancestor or lies below it, by
+ * following parent links up to the root.
+ */
+
+afs_status AcornADFS::dir_within(uint32_t sector, uint32_t ancestor) {
+    afs_object obj;
+    afs_status status;
+    adfs_dir *dir;
+    int depth;
+
+    memset(&obj, 0, sizeof(obj));
+    obj.is_dir = 1;
+    obj.length = DIR_SIZE;
+    for (depth = 0; sector != 2 && depth < 256; depth++) {
+        if (sector == ancestor)
+            return AFS_BAD_COMMAND;
+        obj.sector = sector;
+        if ((status = dir_get(&obj, &dir)) != AFS_OK)
+            return status;
+        sector = adfs_get24(dir->data + dir->length - DIR_FTR_SIZE + 11);
+    }
+    return sector == 2 ? AFS_OK : AFS_BROKEN_DIR;
+}
+
+/*
+ * Rename or move an object by editing directory entries only: the
+ * entry goes into its new directory, in sorted position, before it is
+ * taken out of the old one, so a crash in between leaves two entries
+ * rather than none.  A directory also gets its footer name and parent
+ * link updated.  File data is never touched, and locked objects are
+ * refused as they are by remove.
+ */
+
+afs_status AcornADFS::rename(const char *from, const char *to) {
+    afs_object sparent, dparent, child, other, moved;
+    adfs_dir *sdir, *ddir, *sub;
+    unsigned char *sent, *dent;
+    char *sdir_name = NULL, *ddir_name = NULL;
+    const char *sleaf, *dleaf;
+    afs_status status;
+
+    if ((status = split_name(from, &sdir_name, &sleaf)) == AFS_OK && (status = split_name(to, &ddir_name, &dleaf)) == AFS_OK) {
+        if (strlen(dleaf) > ADFS_MAX_NAME)
+            status = AFS_NAME_TOO_LONG;
+        else if (strpbrk(dleaf, ".$:*#") != NULL)
+            status = AFS_BAD_COMMAND;
+    }
+    if (status != AFS_OK) {
+        free(sdir_name);
+        free(ddir_name);
+        return status;
+    }
+    lock_exclusive();
+    if ((status = find_locked(sdir_name, &sparent)) == AFS_OK && (status = dir_get(&sparent, &sdir)) == AFS_OK
+        && (status = search_locked(&sparent, &child, sleaf, strlen(sleaf), &sent)) == AFS_OK
+        && (status = find_locked(ddir_name, &dparent)) == AFS_OK && (status = dir_get(&dparent, &ddir)) == AFS_OK) {
+        if (child.is_dir && dparent.sector != sparent.sector)
+            status = dir_within(dparent.sector, child.sector);
+        if (status == AFS_OK && (status = dir_get(&sparent, &sdir)) == AFS_OK
+            && (status = search_locked(&sparent, &child, sleaf, strlen(sleaf), &sent)) == AFS_OK
+            && (status = dir_get(&dparent, &ddir)) == AFS_OK) {
+            status = search_locked(&dparent, &other, dleaf, strlen(dleaf), &dent);
+            // only a change of case of the same entry may find itself;
+            // sectors are no guide as every empty file has sector 0.
+            if (child.locked)
+                status = AFS_LOCKED;
+            else if (status == AFS_OK && dent != sent)
+                status = AFS_EXISTS;
+            else if (status == AFS_OK || status == AFS_NOT_FOUND) {
+                moved = child;
+                memset(moved.name, 0, sizeof(moved.name));
+                strcpy(moved.name, dleaf);
+                if (ddir == sdir) {
+                    dir_unlink(sdir, sent);
+                    if (!dir_index(sdir))
+                        status = AFS_NO_MEMORY;
+                    else {
+                        search_locked(&dparent, &other, dleaf, strlen(dleaf), &dent);
+                        dir_makeslot(sdir, dent);
+                        status = dir_update(sdir, &moved, dent);
+                    }
+                    if (status != AFS_OK)
+                        dir_drop(sdir->sector);
+                }
+                else if (dent == NULL)
                     status = AFS_DIR_FULL;
                 else {
-                    if ((status = alloc_write(obj)) == AFS_OK) {
-                        dir_makeslot(&parent, ent);
-                        status = dir_update(&parent, obj, ent);
+                    dir_makeslot(ddir, dent);
+                    if ((status = dir_update(ddir, &moved, dent)) != AFS_OK)
+                        dir_drop(ddir->sector);
+                    else {
+                        dir_unlink(sdir, sent);
+                        if ((status = dir_commit(sdir)) != AFS_OK)
+                            dir_drop(sdir->sector);
                     }
                 }
+                if (status == AFS_OK && child.is_dir && (status = dir_get(&child, &sub)) == AFS_OK) {
+                    ftr_rename(sub->data + sub->length - DIR_FTR_SIZE, child.name, dleaf, dparent.sector);
+                    if ((status = dir_commit(sub)) != AFS_OK)
+                        dir_drop(sub->sector);
+                }
             }
-            if (status == AFS_OK)
-                status = save_fsmap();
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+    free(sdir_name);
+    free(ddir_name);
+    return status;
+}
+
+/*
+ * Delete a file or an empty directory, handing its space back to the
+ * map.  Locked objects are refused unless force is set.
+ */
+
+afs_status AcornADFS::remove(const char *adfs_name, int force) {
+    afs_object parent, child;
+    adfs_dir *dir, *sub;
+    unsigned char *ent;
+    const char *leaf;
+    char *dir_name = NULL;
+    afs_status status;
+
+    if ((status = split_name(adfs_name, &dir_name, &leaf)) != AFS_OK) {
+        free(dir_name);
+        return status;
+    }
+    lock_exclusive();
+    if ((status = find_locked(dir_name, &parent)) == AFS_OK
+        && (status = search_locked(&parent, &child, leaf, strlen(leaf), &ent)) == AFS_OK) {
+        if (child.locked && !force)
+            status = AFS_LOCKED;
+        else if (child.is_dir && (status = dir_get(&child, &sub)) == AFS_OK && sub->count > 0)
+            status = AFS_NOT_EMPTY;
+        if (status == AFS_OK && (status = dir_get(&parent, &dir)) == AFS_OK) {
+            dir_unlink(dir, ent);
+            if ((status = dir_commit(dir)) != AFS_OK)
+                dir_drop(parent.sector);
             else {
-                discio->dio_free(fsmap);
-                fsmap = NULL;
+                if (child.is_dir)
+                    dir_drop(child.sector);
+                status = map_commit(&child, 1);
             }
         }
     }
+    pthread_rwlock_unlock(&lock);
+    free(dir_name);
+    return status;
+}
+
+/*
+ * Set the access and lock bits of an object from attr, leaving its
+ * name, addresses and space as they are.
+ */
+
+afs_status AcornADFS::set_access(const char *adfs_name, const afs_object *attr) {
+    afs_object parent, child;
+    pthread_mutex_t *mutex;
+    unsigned char *ent;
+    const char *leaf;
+    char *dir_name = NULL;
+    afs_status status;
+    adfs_dir *dir;
+
+    if ((status = split_name(adfs_name, &dir_name, &leaf)) != AFS_OK) {
+        free(dir_name);
+        return status;
+    }
+    lock_update();
+    if ((status = find_locked(dir_name, &parent)) == AFS_OK && !parent.is_dir)
+        status = AFS_NOT_A_DIR;
+    else if (status == AFS_OK) {
+        mutex = dir_lock(parent.sector);
+        if ((status = dir_get(&parent, &dir)) == AFS_OK
+            && (status = search_locked(&parent, &child, leaf, strlen(leaf), &ent)) == AFS_OK) {
+            child.user_read  = attr->user_read;
+            child.user_write = attr->user_write;
+            child.user_exec  = attr->user_exec;
+            child.locked     = attr->locked;
+            child.pub_read   = attr->pub_read;
+            child.pub_write  = attr->pub_write;
+            child.pub_exec   = attr->pub_exec;
+            child.priv       = attr->priv;
+            if ((status = dir_update(dir, &child, ent)) != AFS_OK)
+                dir_drop(parent.sector);
+        }
+        pthread_mutex_unlock(mutex);
+    }
+    pthread_rwlock_unlock(&lock);
+    free(dir_name);
     return status;
 }
 
@@ -228,39 +1160,67 @@ afs_status AcornADFS::map_free(afs_object *obj) {
     int end = fsmap[0x1fe];
     int ent, bytes;
     uint32_t posn, size, obj_size;
+    AFS_SPAN("map_free", discio->name(), obj->name, -1, obj->length);
 
+    if (obj->length == 0)
+        return AFS_OK;
     obj_size = discio->sectors(obj->length);
-    for (ent = 0; ent < end; ent += 3) {
-        posn = adfs_get24(fsmap + ent);
-        size = adfs_get24(sizes + ent);
-        if ((posn + size) == obj->sector) { // coallesce
+    for (ent = 0; ent < end; ent += 3)
+        if (adfs_get24(fsmap + ent) > obj->sector)
+            break;
+    if (ent > 0) {
+        posn = adfs_get24(fsmap + ent - 3);
+        size = adfs_get24(sizes + ent - 3);
+        if ((posn + size) == obj->sector) { // coallesce with the space before.
             size += obj_size;
-            adfs_put24(sizes + ent, size);
+            if (ent < end && adfs_get24(fsmap + ent) == posn + size) {
+                size += adfs_get24(sizes + ent);
+                bytes = end - ent - 3;
+                memmove(fsmap + ent, fsmap + ent + 3, bytes);
+                memmove(sizes + ent, sizes + ent + 3, bytes);
+                fsmap[0x1fe] -= 3;
+            }
+            adfs_put24(sizes + ent - 3, size);
             return AFS_OK;
         }
-        if (posn > obj->sector) {
-            if (end >= 82)
-                return AFS_MAP_FULL;
-            bytes = (end - ent) * 3;
-            memmove(fsmap + ent + 3, fsmap + ent, bytes);
-            memmove(sizes + ent + 3, sizes + ent, bytes);
-            break;
-        }
     }
-    if (end >= 82)
+    if (ent < end && adfs_get24(fsmap + ent) == obj->sector + obj_size) { // and after.
+        adfs_put24(fsmap + ent, obj->sector);
+        adfs_put24(sizes + ent, adfs_get24(sizes + ent) + obj_size);
+        return AFS_OK;
+    }
+    if (end >= FSMAP_MAX_ENT * 3)
         return AFS_MAP_FULL;
+    bytes = end - ent;
+    memmove(fsmap + ent + 3, fsmap + ent, bytes);
+    memmove(sizes + ent + 3, sizes + ent, bytes);
     adfs_put24(fsmap + ent, obj->sector);
     adfs_put24(sizes + ent, obj_size);
-    fsmap[0x1fe]++;
+    fsmap[0x1fe] += 3;
     return AFS_OK;
 }
 
 afs_status AcornADFS::alloc_write(afs_object *obj) {
+    afs_status status;
+    AFS_SPAN("alloc_write", discio->name(), obj->name, -1, obj->length);
+
+    if ((status = map_alloc(obj)) == AFS_OK && obj->length > 0)
+        if (discio->write(obj->sector, obj->length, obj->data) != 0)
+            status = AFS_WRITE_ERR;
+    return status;
+}
+
+afs_status AcornADFS::map_alloc(afs_object *obj) {
     unsigned char *sizes = fsmap + 0x100;
     int end = fsmap[0x1fe];
-    int ent, bytes, err;
+    int ent, bytes;
     uint32_t posn, size, obj_size;
+    AFS_SPAN("map_alloc", discio->name(), obj->name, -1, obj->length);
 
+    if (obj->length == 0) {
+        obj->sector = 0;
+        return AFS_OK;
+    }
     obj_size = discio->sectors(obj->length);
     for (ent = 0; ent < end; ent += 3) {
         size = adfs_get24(sizes + ent);
@@ -268,52 +1228,459 @@ afs_status AcornADFS::alloc_write(afs_object *obj) {
             posn = adfs_get24(fsmap + ent);
             obj->sector = posn;
             if (size == obj_size) { // uses exact space so kill entry.
-                bytes = (end - ent) * 3;
+                bytes = end - ent - 3;
                 memmove(fsmap + ent, fsmap + ent + 3, bytes);
                 memmove(sizes + ent, sizes + ent + 3, bytes);
-                fsmap[0x1fe]--;
+                fsmap[0x1fe] -= 3;
             } else {
                 adfs_put24(fsmap + ent, posn + obj_size);
                 adfs_put24(sizes + ent, size - obj_size);
             }
-            if ((err = discio->write(posn, obj->length, obj->data)) == 0)
-                return AFS_OK;
-            return AFS_WRITE_ERR;
+            return AFS_OK;
         }
     }
     return AFS_NO_SPACE;
 }
 
-afs_status AcornADFS::dir_update(afs_object *parent, afs_object *child, unsigned char *ent) {
-    int i, ch, err;
+void AcornADFS::ent_encode(unsigned char *ent, const afs_object *obj) {
+    int i, ch;
 
-    for (i = 0; i < ADFS_MAX_NAME; i++) {
-        ch = child->name[i];
+    for (i = 0, ch = 1; i < ADFS_MAX_NAME; i++) {
+        if (ch)
+            ch = obj->name[i];
         ent[i] = ch & 0x7f;
-        if (ch == 0)
-            break;
     }
-    if (child->user_read)  ent[0] |= 0x80;
-    if (child->user_write) ent[1] |= 0x80;
-    if (child->locked)     ent[2] |= 0x80;
-    if (child->is_dir)     ent[3] |= 0x80;
-    if (child->user_exec)  ent[4] |= 0x80;
-    if (child->pub_read)   ent[5] |= 0x80;
-    if (child->pub_write)  ent[6] |= 0x80;
-    if (child->pub_exec)   ent[7] |= 0x80;
-    if (child->pub_exec)   ent[8] |= 0x80;
-    if (child->priv)       ent[9] |= 0x80;
-    adfs_put24(ent + 0x0a, child->load_addr);
-    adfs_put24(ent + 0x0e, child->exec_addr);
-    adfs_put24(ent + 0x12, child->length);
-    adfs_put24(ent + 0x16, child->sector);
-    if ((err = discio->write(parent->sector, parent->length, parent->data)) == 0)
+    if (obj->user_read)  ent[0] |= 0x80;
+    if (obj->user_write) ent[1] |= 0x80;
+    if (obj->locked)     ent[2] |= 0x80;
+    if (obj->is_dir)     ent[3] |= 0x80;
+    if (obj->user_exec)  ent[4] |= 0x80;
+    if (obj->pub_read)   ent[5] |= 0x80;
+    if (obj->pub_write)  ent[6] |= 0x80;
+    if (obj->pub_exec)   ent[7] |= 0x80;
+    if (obj->pub_exec)   ent[8] |= 0x80;
+    if (obj->priv)       ent[9] |= 0x80;
+    adfs_put32(ent + 0x0a, obj->load_addr);
+    adfs_put32(ent + 0x0e, obj->exec_addr);
+    adfs_put32(ent + 0x12, obj->length);
+    adfs_put24(ent + 0x16, obj->sector);
+}
+
+afs_status AcornADFS::dir_update(adfs_dir *dir, afs_object *child, unsigned char *ent) {
+    AFS_SPAN("dir_update", discio->name(), child->name, -1, deferred ? 0 : dir->length);
+
+    ent_encode(ent, child);
+    return dir_commit(dir);
+}
+
+/*
+ * Re-index a directory after its raw data has been changed and write
+ * it back, or just mark it dirty while deferred.  The master sequence
+ * number, kept in BCD at both ends, is stepped on every change.
+ */
+
+static uint8_t seq_next(uint8_t seq) {
+    if ((seq & 0x0f) < 9)
+        return seq + 1;
+    if ((seq >> 4) < 9)
+        return (seq & 0xf0) + 0x10;
+    return 0;
+}
+
+afs_status AcornADFS::dir_commit(adfs_dir *dir) {
+    int err;
+
+    dir->data[0] = seq_next(dir->data[0]);
+    dir->data[dir->length - DIR_FTR_SIZE + 47] = dir->data[0];
+    if (deferred)
+        dir->dirty = 1;
+    if (!dir_index(dir)) {
+        dir_drop(dir->sector);
+        return AFS_NO_MEMORY;
+    }
+    if (deferred)
+        return AFS_OK;
+    if ((err = discio->write(dir->sector, dir->length, dir->data)) == 0)
         return AFS_OK;
     return AFS_WRITE_ERR;
 }
 
-void AcornADFS::dir_makeslot(afs_object *parent, unsigned char *ent) {
-    unsigned char *ftr = parent->data + parent->length - DIR_FTR_SIZE;
+void AcornADFS::dir_makeslot(adfs_dir *dir, unsigned char *ent) {
+    unsigned char *ftr = dir->data + dir->length - DIR_FTR_SIZE;
     unsigned bytes = ftr - ent - DIR_ENT_SIZE;
     memmove(ent + DIR_ENT_SIZE, ent, bytes);
 }
+
+/*
+ * Close up the gap left by removing an entry; the slot after the new
+ * last entry becomes the zero terminator.
+ */
+
+void AcornADFS::dir_unlink(adfs_dir *dir, unsigned char *ent) {
+    unsigned char *ftr = dir->data + dir->length - DIR_FTR_SIZE;
+    unsigned char *last = dir->data + DIR_HDR_SIZE + (dir->count - 1) * DIR_ENT_SIZE;
+
+    memmove(ent, ent + DIR_ENT_SIZE, last - ent);
+    memset(last, 0, ftr - last < DIR_ENT_SIZE ? ftr - last : DIR_ENT_SIZE);
+}
+
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+    char     *owner;
+} adfs_extent;
+
+typedef struct {
+    adfs_extent *exts;
+    unsigned    used;
+    unsigned    size;
+} adfs_extset;
+
+typedef struct {
+    uint32_t sector;
+    uint32_t length;
+    uint32_t parent;
+    char     *path;
+} adfs_chkdir;
+
+/*
+ * What checking one directory found: its messages, the extents its
+ * entries claim and the subdirectories still to be visited.
+ */
+
+typedef struct {
+    char        *text;
+    size_t      text_len;
+    unsigned    bad;
+    afs_status  status;
+    adfs_extset set;
+    adfs_chkdir *subs;
+    unsigned    nsubs;
+    unsigned    ssize;
+} adfs_chkres;
+
+typedef struct {
+    DiskImgIO   *dio;
+    adfs_chkdir *dirs;
+    adfs_chkres *res;
+    uint32_t    total;
+} adfs_chkctx;
+
+static char *path_join(const char *dir, const char *name) {
+    char *path;
+
+    if ((path = (char *)malloc(strlen(dir) + strlen(name) + 2)))
+        sprintf(path, "%s.%s", dir, name);
+    return path;
+}
+
+static int ext_add(adfs_extset *set, uint32_t start, uint32_t count, const char *owner) {
+    adfs_extent *exts;
+
+    if (set->used >= set->size) {
+        set->size = set->size ? set->size * 2 : 64;
+        if ((exts = (adfs_extent *)realloc(set->exts, set->size * sizeof(adfs_extent))) == NULL)
+            return 0;
+        set->exts = exts;
+    }
+    exts = set->exts + set->used;
+    if ((exts->owner = strdup(owner)) == NULL)
+        return 0;
+    exts->start = start;
+    exts->count = count;
+    set->used++;
+    return 1;
+}
+
+static int ext_cmp(const void *a, const void *b) {
+    const adfs_extent *ea = (const adfs_extent *)a;
+    const adfs_extent *eb = (const adfs_extent *)b;
+
+    if (ea->start != eb->start)
+        return ea->start < eb->start ? -1 : 1;
+    if (ea->count != eb->count)
+        return ea->count < eb->count ? -1 : 1;
+    return 0;
+}
+
+static int sub_add(adfs_chkres *res, uint32_t sector, uint32_t length, uint32_t parent, char *path) {
+    adfs_chkdir *subs;
+
+    if (res->nsubs >= res->ssize) {
+        res->ssize = res->ssize ? res->ssize * 2 : 16;
+        if ((subs = (adfs_chkdir *)realloc(res->subs, res->ssize * sizeof(adfs_chkdir))) == NULL)
+            return 0;
+        res->subs = subs;
+    }
+    subs = res->subs + res->nsubs++;
+    subs->sector = sector;
+    subs->length = length;
+    subs->parent = parent;
+    subs->path = path;
+    return 1;
+}
+
+/*
+ * Validate one directory.  Runs on a WorkPool thread, so it only reads
+ * the image and writes to its own result.
+ */
+
+static void check_dir(void *ctx, unsigned worker, unsigned item) {
+    adfs_chkctx *cc = (adfs_chkctx *)ctx;
+    adfs_chkdir *dir = cc->dirs + item;
+    adfs_chkres *res = cc->res + item;
+    unsigned char *hdr, *ftr, *ent;
+    char name[ADFS_MAX_NAME+1], prev[ADFS_MAX_NAME+1], *path;
+    uint32_t posn, size, count;
+    int isdir;
+    FILE *fp;
+
+    if ((fp = open_memstream(&res->text, &res->text_len)) == NULL) {
+        res->status = AFS_NO_MEMORY;
+        return;
+    }
+    if ((hdr = cc->dio->read(dir->sector, dir->length)) == NULL) {
+        fprintf(fp, "%s: unable to read directory at sector 0x%06X\n", dir->path, dir->sector);
+        res->bad++;
+        fclose(fp);
+        return;
+    }
+    ftr = hdr + dir->length - DIR_FTR_SIZE;
+    if (hdr[1] != 'H' || hdr[2] != 'u' || hdr[3] != 'g' || hdr[4] != 'o') {
+        fprintf(fp, "%s: directory header is not 'Hugo'\n", dir->path);
+        res->bad++;
+    }
+    else if (ftr[48] != 'H' || ftr[49] != 'u' || ftr[50] != 'g' || ftr[51] != 'o') {
+        fprintf(fp, "%s: directory footer is not 'Hugo'\n", dir->path);
+        res->bad++;
+    }
+    else {
+        if (ftr[47] != hdr[0]) {
+            fprintf(fp, "%s: master sequence mismatch (header %02X, footer %02X)\n", dir->path, hdr[0], ftr[47]);
+            res->bad++;
+        }
+        if ((posn = adfs_get24(ftr + 11)) != dir->parent) {
+            fprintf(fp, "%s: parent link is 0x%06X, expected 0x%06X\n", dir->path, posn, dir->parent);
+            res->bad++;
+        }
+        prev[0] = '\0';
+        for (ent = hdr + DIR_HDR_SIZE; res->status == AFS_OK && ent < ftr && *ent; ent += DIR_ENT_SIZE) {
+            ent_name(ent, name);
+            if ((path = path_join(dir->path, name)) == NULL) {
+                res->status = AFS_NO_MEMORY;
+                break;
+            }
+            if (adfs_namecmp(prev, name) >= 0) {
+                fprintf(fp, "%s: entry out of order\n", path);
+                res->bad++;
+            }
+            strcpy(prev, name);
+            isdir = (ent[3] & 0x80) == 0x80;
+            size  = adfs_get32(ent + 0x12);
+            posn  = adfs_get24(ent + 0x16);
+            count = size ? cc->dio->sectors(size) : 0;
+            if (count > 0 && !ext_add(&res->set, posn, count, path))
+                res->status = AFS_NO_MEMORY;
+            else if (isdir) {
+                if (size != 1280) {
+                    fprintf(fp, "%s: directory length is 0x%X\n", path, size);
+                    res->bad++;
+                }
+                else if (cc->total != 0 && posn + count > cc->total)
+                    ; // reported with the extents.
+                else if (!sub_add(res, posn, size, dir->sector, path))
+                    res->status = AFS_NO_MEMORY;
+                else
+                    path = NULL;
+            }
+            free(path);
+        }
+        if (ent >= ftr) {
+            fprintf(fp, "%s: directory has no end marker\n", dir->path);
+            res->bad++;
+        }
+    }
+    cc->dio->dio_free(hdr);
+    fclose(fp);
+}
+
+/*
+ * Check the whole filesystem in a single pass: the free space map is
+ * read once, the directory tree is walked breadth-first and every
+ * extent claimed by the map, a directory or a file is collected into
+ * one table.  Sorting that table then exposes overlaps, leaked sectors
+ * and extents beyond the end of the disc without any further I/O.
+ * The directories of each level of the tree are validated in parallel
+ * and their findings merged in order, so the report does not depend on
+ * the number of threads.
+ */
+
+afs_status AcornADFS::check(FILE *fp, unsigned *problems) {
+    afs_status status;
+
+    pthread_rwlock_wrlock(&lock);
+    status = check_locked(fp, problems);
+    pthread_rwlock_unlock(&lock);
+    return status;
+}
+
+afs_status AcornADFS::check_locked(FILE *fp, unsigned *problems) {
+    unsigned char *map;
+    adfs_extset set = { NULL, 0, 0 };
+    adfs_chkdir *dirs = NULL, *nd = NULL, *sub;
+    adfs_chkres *res;
+    adfs_chkctx cc;
+    unsigned ndirs = 0, dsize = 0, cur, level, i, j, k, bad = 0;
+    uint32_t total, posn, size, next;
+    afs_status status = AFS_OK;
+    WorkPool *pool;
+    long ncpu;
+    int end, owner;
+
+    if ((map = discio->read(0, 512)) == NULL)
+        return AFS_READ_ERR;
+    if (checksum(map) != map[0xff]) {
+        fputs("free space map: bad checksum in sector 0\n", fp);
+        bad++;
+    }
+    if (checksum(map + 0x100) != map[0x1ff]) {
+        fputs("free space map: bad checksum in sector 1\n", fp);
+        bad++;
+    }
+    total = adfs_get24(map + 0xfc);
+    if (total == 0) {
+        fputs("free space map: disc size is zero\n", fp);
+        bad++;
+    }
+    end = map[0x1fe];
+    if ((end % 3) != 0 || end > FSMAP_MAX_ENT * 3) {
+        fprintf(fp, "free space map: bad end of list pointer 0x%02X\n", end);
+        bad++;
+        end = 0;
+    }
+    if (!ext_add(&set, 0, 2, "free space map") || !ext_add(&set, 2, 5, "$"))
+        status = AFS_NO_MEMORY;
+    for (i = 0; status == AFS_OK && (int)i < end; i += 3) {
+        posn = adfs_get24(map + i);
+        size = adfs_get24(map + 0x100 + i);
+        if (size == 0) {
+            fprintf(fp, "free space map: entry %u is empty\n", i / 3);
+            bad++;
+        }
+        else if (!ext_add(&set, posn, size, "free space"))
+            status = AFS_NO_MEMORY;
+    }
+    discio->dio_free(map);
+
+    if (status == AFS_OK) {
+        if ((dirs = (adfs_chkdir *)malloc(16 * sizeof(adfs_chkdir)))) {
+            dsize = 16;
+            dirs->sector = 2;
+            dirs->length = 1280;
+            dirs->parent = 2;
+            if ((dirs->path = strdup("$")))
+                ndirs = 1;
+        }
+        if (ndirs == 0)
+            status = AFS_NO_MEMORY;
+    }
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        ncpu = 1;
+    for (cur = 0; status == AFS_OK && cur < ndirs; cur = level) {
+        level = ndirs;
+        cc.dio = discio;
+        cc.dirs = dirs + cur;
+        cc.total = total;
+        if ((cc.res = (adfs_chkres *)calloc(level - cur, sizeof(adfs_chkres))) == NULL) {
+            status = AFS_NO_MEMORY;
+            break;
+        }
+        pool = new WorkPool(level - cur < (unsigned)ncpu ? level - cur : ncpu);
+        if (level - cur == 1 || pool->run(level - cur, check_dir, &cc) != 0)
+            for (i = 0; i < level - cur; i++)
+                check_dir(&cc, 0, i);
+        delete pool;
+        for (j = 0; j < level - cur; j++) {
+            res = cc.res + j;
+            if (res->text_len > 0)
+                fwrite(res->text, res->text_len, 1, fp);
+            bad += res->bad;
+            if (res->status != AFS_OK && status == AFS_OK)
+                status = res->status;
+            for (i = 0; i < res->set.used; i++) {
+                if (status == AFS_OK && !ext_add(&set, res->set.exts[i].start, res->set.exts[i].count, res->set.exts[i].owner))
+                    status = AFS_NO_MEMORY;
+                free(res->set.exts[i].owner);
+            }
+            for (k = 0; k < res->nsubs; k++) {
+                sub = res->subs + k;
+                for (i = 0; i < ndirs; i++)
+                    if (dirs[i].sector == sub->sector)
+                        break;
+                if (i < ndirs) {
+                    fprintf(fp, "%s: directory already visited as %s\n", sub->path, dirs[i].path);
+                    bad++;
+                }
+                else if (status == AFS_OK) {
+                    if (ndirs >= dsize) {
+                        if ((nd = (adfs_chkdir *)realloc(dirs, dsize * 2 * sizeof(adfs_chkdir))) == NULL)
+                            status = AFS_NO_MEMORY;
+                        else {
+                            dirs = nd;
+                            dsize *= 2;
+                        }
+                    }
+                    if (status == AFS_OK) {
+                        dirs[ndirs++] = *sub;
+                        continue;
+                    }
+                }
+                free(sub->path);
+            }
+            free(res->text);
+            free(res->set.exts);
+            free(res->subs);
+        }
+        free(cc.res);
+    }
+
+    if (status == AFS_OK) {
+        qsort(set.exts, set.used, sizeof(adfs_extent), ext_cmp);
+        next = 0;
+        owner = -1;
+        for (i = 0; i < set.used; i++) {
+            posn = set.exts[i].start;
+            size = set.exts[i].count;
+            if (total != 0 && posn + size > total) {
+                fprintf(fp, "%s: sectors 0x%06X-0x%06X beyond end of disc (0x%06X)\n", set.exts[i].owner, posn, posn + size - 1, total);
+                bad++;
+            }
+            if (posn > next) {
+                fprintf(fp, "sectors 0x%06X-0x%06X neither allocated nor free\n", next, posn - 1);
+                bad++;
+            }
+            else if (posn < next) {
+                fprintf(fp, "%s: sectors 0x%06X-0x%06X overlap %s\n", set.exts[i].owner, posn,
+                        (posn + size < next ? posn + size : next) - 1, set.exts[owner].owner);
+                bad++;
+            }
+            if (posn + size > next) {
+                next = posn + size;
+                owner = i;
+            }
+        }
+        if (next < total) {
+            fprintf(fp, "sectors 0x%06X-0x%06X neither allocated nor free\n", next, total - 1);
+            bad++;
+        }
+    }
+
+    for (i = 0; i < set.used; i++)
+        free(set.exts[i].owner);
+    free(set.exts);
+    for (i = 0; i < ndirs; i++)
+        free(dirs[i].path);
+    free(dirs);
+    *problems = bad;
+    return status;
+}
@@ -1,33 +1,83 @@
 #ifndef ACORN_ADFS_INC
 #define ACORN_ADFS_INC
 
+#include "AcornCatalog.h"
 #include "AcornFS.h"
 #include "DiskImgIO.h"
 
+#include <pthread.h>
+
 #define ADFS_MAX_NAME 10
+#define ADFS_DIRCACHE 64
+#define ADFS_DIRCACHE_WAYS 4
+
+typedef struct adfs_dir adfs_dir;
+
+typedef afs_status (*afs_extract_fn)(void *ctx, unsigned index, afs_object *obj);
 
 class AcornADFS: public AcornFS {
     public:
         AcornADFS(DiskImgIO *dio);
+        ~AcornADFS();
         static const char *afs_error(afs_status status);
         afs_status find(const char *adfs_name, afs_object *obj);
         afs_status load(afs_object *obj);
+        afs_status extract(afs_object *objs, unsigned count, afs_extract_fn fn, void *ctx);
+        afs_status list(afs_object *dir, afs_object **ents, unsigned *count);
+        afs_status stamp(afs_object *dir, unsigned *seq, uint32_t *hash);
         afs_status save(afs_object *obj, const char *dest_dir);
+        afs_status check(FILE *fp, unsigned *problems);
+        afs_status use_catalog(const char *cat_name, int create);
+        afs_status format(unsigned sectors);
+        afs_status mkdir(const char *name, const char *dest_dir);
+        afs_status rename(const char *from, const char *to);
+        afs_status remove(const char *adfs_name, int force);
+        afs_status set_access(const char *adfs_name, const afs_object *attr);
+        afs_status set_deferred(int on);
+        afs_status flush();
+        static uint8_t checksum(uint8_t *base);
+        static void dir_init(unsigned char *hdr, const char *name, uint32_t parent);
+        static void ent_encode(unsigned char *ent, const afs_object *obj);
         void obj_free(afs_object *obj);
         static afs_status parse_attr(afs_object *obj, FILE *fp);
         static void print_attr(afs_object *obj, FILE *fp);
         static int host_load(afs_object *obj, const char *host_name);
         static int host_save(afs_object *obj, const char *host_name);
-    private:
+    protected:
+        afs_status find_locked(const char *adfs_name, afs_object *obj);
+        afs_status save_locked(afs_object *obj, const char *dest_dir);
+        afs_status check_locked(FILE *fp, unsigned *problems);
+        afs_status map_snapshot(unsigned char *map);
+        afs_status map_commit(afs_object *obj, int release);
+        afs_status map_replace(afs_object *obj, afs_object *old, adfs_dir *dir, unsigned char *ent);
+        void lock_update();
+        void lock_exclusive();
+        afs_status search_locked(afs_object *parent, afs_object *child, const char *name, int name_len, unsigned char **next_ent);
         afs_status search(afs_object *parent, afs_object *child, const char *name, int name_len, unsigned char **next_ent);
         afs_status load_fsmap();
         afs_status save_fsmap();
         afs_status map_free(afs_object *obj);
+        afs_status map_alloc(afs_object *obj);
         afs_status alloc_write(afs_object *obj);
-        afs_status dir_update(afs_object *parent, afs_object *child, unsigned char *ent);
-        void dir_makeslot(afs_object *parent, unsigned char *ent);
+        int write_data(afs_object *obj);
+        pthread_mutex_t *dir_lock(uint32_t sector);
+        afs_status dir_get(afs_object *obj, adfs_dir **dir_ptr);
+        afs_status dir_update(adfs_dir *dir, afs_object *child, unsigned char *ent);
+        afs_status dir_commit(adfs_dir *dir);
+        void dir_unlink(adfs_dir *dir, unsigned char *ent);
+        afs_status dir_within(uint32_t sector, uint32_t ancestor);
+        void dir_makeslot(adfs_dir *dir, unsigned char *ent);
+        void dir_drop(uint32_t sector);
+        void dir_flush();
         DiskImgIO *discio;
         unsigned char *fsmap;
+        AcornCatalog *catalog;
+        adfs_dir *dircache[ADFS_DIRCACHE];
+        int deferred;
+        int map_dirty;
+        pthread_rwlock_t lock;
+        pthread_mutex_t map_lock;
+        pthread_mutex_t dir_locks[ADFS_DIRCACHE];
 };
 
 #endif
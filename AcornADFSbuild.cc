@@ -0,0 +1,413 @@
+#include "AcornADFSbuild.h"
+#include "AcornADFS.h"
+#include "AcornADFSdisc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct build_node {
+    afs_object obj;
+    char       *host_name;
+    build_node *parent;
+    build_node **kids;
+    unsigned   nkids;
+    unsigned   size;
+};
+
+static build_node *node_new(build_node *parent, const char *name, int is_dir) {
+    build_node *node, **kids;
+
+    if (parent && parent->nkids >= parent->size) {
+        parent->size = parent->size ? parent->size * 2 : 8;
+        if ((kids = (build_node **)realloc(parent->kids, parent->size * sizeof(build_node *))) == NULL)
+            return NULL;
+        parent->kids = kids;
+    }
+    if ((node = (build_node *)calloc(1, sizeof(build_node))) == NULL)
+        return NULL;
+    strncpy(node->obj.name, name, ACORN_FS_MAX_NAME - 1);
+    node->obj.is_dir = is_dir;
+    node->obj.user_read = 1;
+    if (is_dir) {
+        node->obj.locked = 1;
+        node->obj.length = DIR_SIZE;
+    }
+    else
+        node->obj.user_write = 1;
+    node->parent = parent;
+    if (parent)
+        parent->kids[parent->nkids++] = node;
+    return node;
+}
+
+static void node_free(build_node *node) {
+    unsigned i;
+
+    for (i = 0; i < node->nkids; i++)
+        node_free(node->kids[i]);
+    free(node->kids);
+    free(node->host_name);
+    free(node);
+}
+
+static build_node *node_child(build_node *dir, const char *name) {
+    unsigned i;
+
+    for (i = 0; i < dir->nkids; i++)
+        if (adfs_namecmp(dir->kids[i]->obj.name, name) == 0)
+            return dir->kids[i];
+    return NULL;
+}
+
+/*
+ * ADFS names may not contain wildcards, path separators or other
+ * characters with a special meaning to the filing system.
+ */
+
+static int name_legal(const char *name) {
+    const unsigned char *ptr;
+
+    if (*name == '\0' || strlen(name) > ADFS_MAX_NAME || strpbrk(name, ".$:*#&@^%\\|\""))
+        return 0;
+    for (ptr = (const unsigned char *)name; *ptr; ptr++)
+        if (*ptr <= ' ' || *ptr == 0x7f)
+            return 0;
+    return 1;
+}
+
+/* Another node in dir with the same name as node, if any. */
+
+static build_node *node_clash(build_node *dir, build_node *node) {
+    unsigned i;
+
+    for (i = 0; i < dir->nkids; i++)
+        if (dir->kids[i] != node && adfs_namecmp(dir->kids[i]->obj.name, node->obj.name) == 0)
+            return dir->kids[i];
+    return NULL;
+}
+
+/*
+ * Fill in a file node from the host: the length always comes from the
+ * file itself and the attributes from the tree's manifest, extended
+ * attributes or a .inf sidecar if present, as does the name if
+ * inf_name is set (extended attributes carry no name).
+ */
+
+static afs_status node_host(build_node *node, const char *host_name, off_t size, int inf_name, InfManifest *attrs) {
+    afs_object attr;
+    char *inf;
+    FILE *fp;
+    int found;
+
+    if (size > 0xffffffffLL)
+        return AFS_NO_SPACE;
+    if ((node->host_name = strdup(host_name)) == NULL)
+        return AFS_NO_MEMORY;
+    if ((inf = (char *)malloc(strlen(host_name) + 5)) == NULL)
+        return AFS_NO_MEMORY;
+    sprintf(inf, "%s.inf", host_name);
+    memset(&attr, 0, sizeof(attr));
+    if (!(found = attrs && attrs->lookup(host_name, &attr))) {
+        if ((found = AcornFS::host_getxattr(&attr, host_name)))
+            strcpy(attr.name, node->obj.name);
+    }
+    if (!found && (fp = fopen(inf, "rt"))) {
+        found = AcornFS::parse_attr(&attr, fp) == AFS_OK;
+        fclose(fp);
+    }
+    if (found && !attr.is_dir) {
+        if (inf_name && attr.name[0] && strlen(attr.name) <= ADFS_MAX_NAME)
+            strcpy(node->obj.name, attr.name);
+        attr.data = NULL;
+        memcpy(attr.name, node->obj.name, ACORN_FS_MAX_NAME);
+        node->obj = attr;
+    }
+    free(inf);
+    node->obj.length = size;
+    return AFS_OK;
+}
+
+AcornADFSbuild::AcornADFSbuild() {
+    root = node_new(NULL, "$", 1);
+    attrs = NULL;
+}
+
+AcornADFSbuild::~AcornADFSbuild() {
+    if (root)
+        node_free(root);
+}
+
+afs_status AcornADFSbuild::scan_dir(build_node *dir, const char *host_dir) {
+    afs_status status = AFS_OK;
+    char name[ACORN_FS_MAX_NAME], *path, *ptr;
+    struct dirent *de;
+    struct stat st;
+    build_node *node;
+    size_t len;
+    DIR *dp;
+
+    if ((dp = opendir(host_dir)) == NULL)
+        return AFS_HOST_ERROR;
+    while (status == AFS_OK && (de = readdir(dp))) {
+        len = strlen(de->d_name);
+        if (de->d_name[0] == '.' || (len > 4 && strcmp(de->d_name + len - 4, ".inf") == 0))
+            continue;
+        if (len > ADFS_MAX_NAME) {
+            status = AFS_NAME_TOO_LONG;
+            break;
+        }
+        if (asprintf(&path, "%s/%s", host_dir, de->d_name) < 0) {
+            status = AFS_NO_MEMORY;
+            break;
+        }
+        strcpy(name, de->d_name);
+        for (ptr = name; *ptr; ptr++)
+            if (*ptr == '.')
+                *ptr = '/';
+        if (stat(path, &st) != 0)
+            status = AFS_HOST_ERROR;
+        else if (S_ISDIR(st.st_mode)) {
+            if (!name_legal(name))
+                status = AFS_BAD_COMMAND;
+            else if (node_child(dir, name))
+                status = AFS_EXISTS;
+            else if ((node = node_new(dir, name, 1)) == NULL)
+                status = AFS_NO_MEMORY;
+            else
+                status = scan_dir(node, path);
+        }
+        else if (S_ISREG(st.st_mode)) {
+            /* the name checks follow any rename from the .inf file */
+            if ((node = node_new(dir, name, 0)) == NULL)
+                status = AFS_NO_MEMORY;
+            else if ((status = node_host(node, path, st.st_size, 1, attrs)) == AFS_OK) {
+                if (!name_legal(node->obj.name))
+                    status = AFS_BAD_COMMAND;
+                else if (node_clash(dir, node))
+                    status = AFS_EXISTS;
+            }
+        }
+        free(path);
+    }
+    closedir(dp);
+    return status;
+}
+
+afs_status AcornADFSbuild::add_tree(const char *host_dir) {
+    afs_status status;
+
+    if (root == NULL)
+        return AFS_NO_MEMORY;
+    attrs = new InfManifest(host_dir);
+    if (attrs->load() != 0) {
+        delete attrs;
+        attrs = NULL;
+    }
+    status = scan_dir(root, host_dir);
+    delete attrs;
+    attrs = NULL;
+    return status;
+}
+
+afs_status AcornADFSbuild::add_file(const char *adfs_name, const char *host_name) {
+    char name[ADFS_MAX_NAME+1];
+    const char *ptr;
+    build_node *dir = root, *node;
+    struct stat st;
+    size_t len;
+
+    if (root == NULL)
+        return AFS_NO_MEMORY;
+    if (adfs_name[0] == '$' && adfs_name[1] == '.')
+        adfs_name += 2;
+    for (;;) {
+        ptr = strchr(adfs_name, '.');
+        len = ptr ? (size_t)(ptr - adfs_name) : strlen(adfs_name);
+        if (len == 0)
+            return AFS_BAD_COMMAND;
+        if (len > ADFS_MAX_NAME)
+            return AFS_NAME_TOO_LONG;
+        memcpy(name, adfs_name, len);
+        name[len] = '\0';
+        if (!name_legal(name))
+            return AFS_BAD_COMMAND;
+        node = node_child(dir, name);
+        if (ptr == NULL)
+            break;
+        if (node == NULL) {
+            if ((node = node_new(dir, name, 1)) == NULL)
+                return AFS_NO_MEMORY;
+        }
+        else if (!node->obj.is_dir)
+            return AFS_NOT_A_DIR;
+        dir = node;
+        adfs_name = ptr + 1;
+    }
+    if (stat(host_name, &st) != 0 || !S_ISREG(st.st_mode))
+        return AFS_HOST_ERROR;
+    if (node == NULL) {
+        if ((node = node_new(dir, name, 0)) == NULL)
+            return AFS_NO_MEMORY;
+    }
+    else if (node->obj.is_dir)
+        return AFS_NOT_A_DIR;
+    else {
+        free(node->host_name);
+        node->host_name = NULL;
+    }
+    return node_host(node, host_name, st.st_size, 0, NULL);
+}
+
+/*
+ * A manifest has one file per line: the ADFS path and the host file
+ * to take its contents from, separated by white space.  Directories
+ * are created as needed; blank lines and lines starting with # are
+ * ignored.
+ */
+
+afs_status AcornADFSbuild::add_manifest(const char *manifest) {
+    afs_status status = AFS_OK;
+    char *line = NULL, *adfs_name, *host_name, *save;
+    size_t len = 0;
+    FILE *fp;
+
+    if ((fp = fopen(manifest, "rt")) == NULL)
+        return AFS_HOST_ERROR;
+    while (status == AFS_OK && getline(&line, &len, fp) >= 0) {
+        if ((adfs_name = strtok_r(line, " \t\r\n", &save)) == NULL || *adfs_name == '#')
+            continue;
+        if ((host_name = strtok_r(NULL, "\r\n", &save)) == NULL)
+            status = AFS_BAD_COMMAND;
+        else {
+            host_name += strspn(host_name, " \t");
+            status = add_file(adfs_name, host_name);
+        }
+    }
+    free(line);
+    fclose(fp);
+    return status;
+}
+
+static int node_cmp(const void *a, const void *b) {
+    return adfs_namecmp((*(build_node * const *)a)->obj.name, (*(build_node * const *)b)->obj.name);
+}
+
+static afs_status layout(build_node *dir, uint32_t *next) {
+    build_node *node;
+    afs_status status;
+    unsigned i;
+
+    if (dir->nkids > DIR_MAX_ENT)
+        return AFS_DIR_FULL;
+    qsort(dir->kids, dir->nkids, sizeof(build_node *), node_cmp);
+    for (i = 0; i < dir->nkids; i++) {
+        node = dir->kids[i];
+        if (!node->obj.is_dir) {
+            node->obj.sector = *next;
+            *next += (node->obj.length + 255) / 256;
+        }
+    }
+    for (i = 0; i < dir->nkids; i++) {
+        node = dir->kids[i];
+        if (node->obj.is_dir) {
+            node->obj.sector = *next;
+            *next += DIR_SECTORS;
+            if ((status = layout(node, next)) != AFS_OK)
+                return status;
+        }
+    }
+    return AFS_OK;
+}
+
+static afs_status emit_file(DiskImgIO *dio, build_node *node, unsigned char *buf) {
+    FILE *fp;
+    unsigned bytes = ((node->obj.length + 255) / 256) * 256;
+
+    if (bytes == 0)
+        return AFS_OK;
+    if ((fp = fopen(node->host_name, "rb")) == NULL)
+        return AFS_HOST_ERROR;
+    memset(buf + node->obj.length, 0, bytes - node->obj.length);
+    if (fread(buf, node->obj.length, 1, fp) != 1) {
+        fclose(fp);
+        return AFS_HOST_ERROR;
+    }
+    fclose(fp);
+    if (dio->write(node->obj.sector, bytes, buf) != 0)
+        return AFS_WRITE_ERR;
+    return AFS_OK;
+}
+
+static afs_status emit(DiskImgIO *dio, build_node *dir, unsigned char *buf) {
+    afs_status status;
+    unsigned char *ent;
+    build_node *node;
+    unsigned i;
+
+    AcornADFS::dir_init(buf, dir->obj.name, dir->parent ? dir->parent->obj.sector : 2);
+    for (i = 0, ent = buf + DIR_HDR_SIZE; i < dir->nkids; i++, ent += DIR_ENT_SIZE)
+        AcornADFS::ent_encode(ent, &dir->kids[i]->obj);
+    if (dio->write(dir->obj.sector, DIR_SIZE, buf) != 0)
+        return AFS_WRITE_ERR;
+    for (i = 0; i < dir->nkids; i++) {
+        node = dir->kids[i];
+        if (!node->obj.is_dir && (status = emit_file(dio, node, buf)) != AFS_OK)
+            return status;
+    }
+    for (i = 0; i < dir->nkids; i++) {
+        node = dir->kids[i];
+        if (node->obj.is_dir && (status = emit(dio, node, buf)) != AFS_OK)
+            return status;
+    }
+    return AFS_OK;
+}
+
+static unsigned max_length(build_node *dir) {
+    unsigned i, len, max = DIR_SIZE;
+
+    for (i = 0; i < dir->nkids; i++) {
+        len = dir->kids[i]->obj.is_dir ? max_length(dir->kids[i]) : dir->kids[i]->obj.length;
+        if (len > max)
+            max = len;
+    }
+    return max;
+}
+
+afs_status AcornADFSbuild::write(DiskImgIO *dio, unsigned sectors) {
+    unsigned char map[512], *buf;
+    afs_status status;
+    uint32_t next = 7;
+
+    if (root == NULL)
+        return AFS_NO_MEMORY;
+    root->obj.sector = 2;
+    if ((status = layout(root, &next)) != AFS_OK)
+        return status;
+    if (next > sectors || sectors > 0xffffff)
+        return AFS_NO_SPACE;
+
+    memset(map, 0, sizeof(map));
+    if (next < sectors) {
+        adfs_put24(map, next);
+        adfs_put24(map + 0x100, sectors - next);
+        map[0x1fe] = 3;
+    }
+    adfs_put24(map + 0xfc, sectors);
+    map[0x0ff] = AcornADFS::checksum(map);
+    map[0x1ff] = AcornADFS::checksum(map + 0x100);
+    if (dio->write(0, 512, map) != 0)
+        return AFS_WRITE_ERR;
+
+    if ((buf = (unsigned char *)malloc(((max_length(root) + 255) / 256) * 256)) == NULL)
+        return AFS_NO_MEMORY;
+    if ((status = emit(dio, root, buf)) == AFS_OK && next < sectors) {
+        memset(buf, 0, 256);
+        if (dio->write(sectors - 1, 256, buf) != 0)
+            status = AFS_WRITE_ERR;
+    }
+    free(buf);
+    return status;
+}
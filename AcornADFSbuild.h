@@ -0,0 +1,33 @@
+#ifndef ACORN_ADFS_BUILD_INC
+#define ACORN_ADFS_BUILD_INC
+
+#include "AcornFS.h"
+#include "DiskImgIO.h"
+#include "InfManifest.h"
+
+typedef struct build_node build_node;
+
+/*
+ * Builds a complete old map ADFS image in one pass.  The tree to be
+ * written is collected first, from a host directory or a manifest,
+ * then the layout is decided up front: each directory is followed by
+ * its files and then its subdirectories, all contiguous, leaving one
+ * free space map entry for the rest of the disc.  The image is then
+ * written in ascending sector order.
+ */
+
+class AcornADFSbuild {
+    public:
+        AcornADFSbuild();
+        ~AcornADFSbuild();
+        afs_status add_tree(const char *host_dir);
+        afs_status add_manifest(const char *manifest);
+        afs_status write(DiskImgIO *dio, unsigned sectors);
+    private:
+        afs_status add_file(const char *adfs_name, const char *host_name);
+        afs_status scan_dir(build_node *dir, const char *host_dir);
+        build_node *root;
+        InfManifest *attrs;
+};
+
+#endif
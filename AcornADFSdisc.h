@@ -0,0 +1,51 @@
+#ifndef ACORN_ADFS_DISC_INC
+#define ACORN_ADFS_DISC_INC
+
+#include <stdint.h>
+
+/*
+ * On-disc layout of old map ADFS: the free space map in sectors 0-1
+ * and "Hugo" directories of 47 entries.
+ */
+
+#define FSMAP_MAX_ENT 82
+#define DIR_SIZE      0x500
+#define DIR_SECTORS   5
+#define DIR_MAX_ENT   47
+#define DIR_HDR_SIZE  0x05
+#define DIR_ENT_SIZE  0x1A
+#define DIR_FTR_SIZE  0x35
+
+static inline uint32_t adfs_get32(const unsigned char *base) {
+    return base[0] | (base[1] << 8) | (base[2] << 16) | (base[3] << 24);
+}
+
+static inline uint32_t adfs_get24(const unsigned char *base) {
+    return base[0] | (base[1] << 8) | (base[2] << 16);
+}
+
+static inline void adfs_put32(unsigned char *base, uint32_t value) {
+    base[0] = value & 0xff;
+    base[1] = (value >> 8) & 0xff;
+    base[2] = (value >> 16) & 0xff;
+    base[3] = (value >> 24) & 0xff;
+}
+
+static inline void adfs_put24(unsigned char *base, uint32_t value) {
+    base[0] = value & 0xff;
+    base[1] = (value >> 8) & 0xff;
+    base[2] = (value >> 16) & 0xff;
+}
+
+// Compare names the way ADFS orders directory entries.
+static inline int adfs_namecmp(const char *a, const char *b) {
+    int c;
+
+    while ((c = (*a & 0xdf) - (*b & 0xdf)) == 0 && *a) {
+        a++;
+        b++;
+    }
+    return c;
+}
+
+#endif
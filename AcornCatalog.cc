@@ -0,0 +1,309 @@
+#include "AcornCatalog.h"
+#include "AcornADFS.h"
+
+#include <alloca.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CAT_ATTR_UREAD  0x001
+#define CAT_ATTR_UWRITE 0x002
+#define CAT_ATTR_LOCKED 0x004
+#define CAT_ATTR_DIR    0x008
+#define CAT_ATTR_UEXEC  0x010
+#define CAT_ATTR_PREAD  0x020
+#define CAT_ATTR_PWRITE 0x040
+#define CAT_ATTR_PEXEC  0x080
+#define CAT_ATTR_PRIV   0x100
+
+static const char cat_magic[8] = { 'A', 'D', 'F', 'S', 'C', 'A', 'T', '1' };
+
+/*
+ * The file is laid out as a header, the entries sorted by path and a
+ * table of NUL-terminated paths.  Fields are in host byte order as the
+ * catalog is a local cache rather than an interchange format.
+ */
+
+struct cat_header {
+    char          magic[8];
+    uint64_t      img_size;
+    int64_t       img_mtime;
+    uint32_t      img_mtime_ns;
+    uint32_t      count;
+    uint32_t      names;
+    uint32_t      names_size;
+    unsigned char fsmap[CATALOG_MAP_SIZE];
+};
+
+struct cat_entry {
+    uint32_t path;
+    uint32_t attr;
+    uint32_t load_addr;
+    uint32_t exec_addr;
+    uint32_t length;
+    uint32_t sector;
+};
+
+typedef struct {
+    cat_entry *ents;
+    unsigned  used;
+    unsigned  size;
+    char      *names;
+    uint32_t  nused;
+    uint32_t  nsize;
+} cat_builder;
+
+static int path_cmp(const char *a, const char *b) {
+    int ca, cb;
+
+    do {
+        ca = toupper((unsigned char)*a++);
+        cb = toupper((unsigned char)*b++);
+    } while (ca == cb && ca);
+    return ca - cb;
+}
+
+// As path_cmp but a is the first len bytes of a longer path.
+static int path_ncmp(const char *a, size_t len, const char *b) {
+    int ca, cb;
+
+    do {
+        ca = len-- > 0 ? toupper((unsigned char)*a++) : 0;
+        cb = toupper((unsigned char)*b++);
+    } while (ca == cb && ca);
+    return ca - cb;
+}
+
+static const char *strip_root(const char *adfs_name) {
+    if (adfs_name[0] == '$') {
+        if (adfs_name[1] == '\0')
+            return adfs_name + 1;
+        if (adfs_name[1] == '.')
+            return adfs_name + 2;
+    }
+    return adfs_name;
+}
+
+static afs_status cat_add(void *ctx, const char *path, afs_object *obj) {
+    cat_builder *cb = (cat_builder *)ctx;
+    cat_entry *ent;
+    char *names;
+    size_t len;
+
+    path = strip_root(path);
+    len = strlen(path) + 1;
+    if (cb->used >= cb->size) {
+        cb->size = cb->size ? cb->size * 2 : 256;
+        if ((ent = (cat_entry *)realloc(cb->ents, cb->size * sizeof(cat_entry))) == NULL)
+            return AFS_NO_MEMORY;
+        cb->ents = ent;
+    }
+    while (cb->nused + len > cb->nsize) {
+        cb->nsize = cb->nsize ? cb->nsize * 2 : 4096;
+        if ((names = (char *)realloc(cb->names, cb->nsize)) == NULL)
+            return AFS_NO_MEMORY;
+        cb->names = names;
+    }
+    ent = cb->ents + cb->used++;
+    ent->path = cb->nused;
+    memcpy(cb->names + cb->nused, path, len);
+    cb->nused += len;
+    ent->attr = (obj->user_read  ? CAT_ATTR_UREAD  : 0)
+              | (obj->user_write ? CAT_ATTR_UWRITE : 0)
+              | (obj->locked     ? CAT_ATTR_LOCKED : 0)
+              | (obj->is_dir     ? CAT_ATTR_DIR    : 0)
+              | (obj->user_exec  ? CAT_ATTR_UEXEC  : 0)
+              | (obj->pub_read   ? CAT_ATTR_PREAD  : 0)
+              | (obj->pub_write  ? CAT_ATTR_PWRITE : 0)
+              | (obj->pub_exec   ? CAT_ATTR_PEXEC  : 0)
+              | (obj->priv       ? CAT_ATTR_PRIV   : 0);
+    ent->load_addr = obj->load_addr;
+    ent->exec_addr = obj->exec_addr;
+    ent->length    = obj->length;
+    ent->sector    = obj->sector;
+    return AFS_OK;
+}
+
+static int ent_cmp(const void *a, const void *b, void *arg) {
+    const char *names = (const char *)arg;
+
+    return path_cmp(names + ((const cat_entry *)a)->path, names + ((const cat_entry *)b)->path);
+}
+
+/*
+ * Build a catalog for fs by walking the whole tree.  The file is
+ * written under a temporary name and renamed into place so readers
+ * never see a partial catalog.  Returns 0 or an errno value.
+ */
+
+int AcornCatalog::create(AcornFS *fs, const char *cat_name, const struct stat *img, const unsigned char *fsmap) {
+    cat_builder cb = { NULL, 0, 0, NULL, 0, 0 };
+    cat_header hdr;
+    afs_status status;
+    char *tmp;
+    FILE *fp;
+    int fd, err = 0;
+
+    if ((status = fs->walk("$", cat_add, &cb)) != AFS_OK)
+        err = (status == AFS_NO_MEMORY) ? ENOMEM : EIO;
+    else {
+        qsort_r(cb.ents, cb.used, sizeof(cat_entry), ent_cmp, cb.names);
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, cat_magic, sizeof(cat_magic));
+        hdr.img_size     = img->st_size;
+        hdr.img_mtime    = img->st_mtim.tv_sec;
+        hdr.img_mtime_ns = img->st_mtim.tv_nsec;
+        hdr.count        = cb.used;
+        hdr.names        = sizeof(hdr) + cb.used * sizeof(cat_entry);
+        hdr.names_size   = cb.nused;
+        memcpy(hdr.fsmap, fsmap, CATALOG_MAP_SIZE);
+        tmp = (char *)alloca(strlen(cat_name) + 8);
+        sprintf(tmp, "%s.XXXXXX", cat_name);
+        if ((fd = mkstemp(tmp)) < 0)
+            err = errno;
+        else if ((fp = fdopen(fd, "wb")) == NULL) {
+            err = errno;
+            ::close(fd);
+            unlink(tmp);
+        } else {
+            fchmod(fd, 0644);
+            if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+                || (cb.used > 0 && fwrite(cb.ents, sizeof(cat_entry), cb.used, fp) != cb.used)
+                || (cb.nused > 0 && fwrite(cb.names, cb.nused, 1, fp) != 1))
+                err = errno;
+            if (fclose(fp) != 0 && err == 0)
+                err = errno;
+            if (err == 0 && rename(tmp, cat_name) != 0)
+                err = errno;
+            if (err)
+                unlink(tmp);
+        }
+    }
+    free(cb.ents);
+    free(cb.names);
+    return err;
+}
+
+/*
+ * Map an existing catalog, returning NULL if it is missing, malformed
+ * or does not match the image it claims to describe.
+ */
+
+AcornCatalog *AcornCatalog::open(const char *cat_name, const struct stat *img, const unsigned char *fsmap) {
+    struct stat st;
+    cat_header *hdr;
+    void *base;
+    int fd;
+
+    if ((fd = ::open(cat_name, O_RDONLY)) < 0)
+        return NULL;
+    base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cat_header))
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    hdr = (cat_header *)base;
+    if (memcmp(hdr->magic, cat_magic, sizeof(cat_magic)) == 0
+        && hdr->names == sizeof(cat_header) + (uint64_t)hdr->count * sizeof(cat_entry)
+        && (uint64_t)hdr->names + hdr->names_size == (uint64_t)st.st_size
+        && (hdr->names_size == 0 || ((const char *)base)[st.st_size - 1] == '\0')
+        && hdr->img_size == (uint64_t)img->st_size
+        && hdr->img_mtime == img->st_mtim.tv_sec
+        && hdr->img_mtime_ns == (uint32_t)img->st_mtim.tv_nsec
+        && memcmp(hdr->fsmap, fsmap, CATALOG_MAP_SIZE) == 0)
+        return new AcornCatalog(base, st.st_size);
+    munmap(base, st.st_size);
+    return NULL;
+}
+
+AcornCatalog::AcornCatalog(void *base, size_t size) {
+    this->base = base;
+    this->size = size;
+    hdr   = (cat_header *)base;
+    ents  = (cat_entry *)(hdr + 1);
+    names = (const char *)base + hdr->names;
+}
+
+AcornCatalog::~AcornCatalog() {
+    munmap(base, size);
+}
+
+unsigned AcornCatalog::count() {
+    return hdr->count;
+}
+
+afs_status AcornCatalog::lookup(const char *path, size_t len, cat_entry **ent_ptr) {
+    unsigned lo, hi, mid;
+    cat_entry *ent;
+    int c;
+
+    lo = 0;
+    hi = hdr->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        ent = ents + mid;
+        if (ent->path >= hdr->names_size)
+            return AFS_BROKEN_DIR;
+        if ((c = path_ncmp(path, len, names + ent->path)) == 0) {
+            *ent_ptr = ent;
+            return AFS_OK;
+        }
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return AFS_NOT_FOUND;
+}
+
+/*
+ * A miss is reported as a walk down the directories would report it:
+ * the first over-long component is AFS_NAME_TOO_LONG unless a
+ * directory before it is already missing.
+ */
+
+afs_status AcornCatalog::find(const char *adfs_name, afs_object *obj) {
+    const char *path, *leaf, *ptr, *end;
+    afs_status status;
+    cat_entry *ent;
+
+    adfs_name = strip_root(adfs_name);
+    if ((status = lookup(adfs_name, strlen(adfs_name), &ent)) == AFS_OK) {
+        path = names + ent->path;
+        memset(obj, 0, sizeof(afs_object));
+        leaf = strrchr(path, '.');
+        leaf = leaf ? leaf + 1 : path;
+        strncpy(obj->name, leaf, ACORN_FS_MAX_NAME - 1);
+        obj->user_read  = (ent->attr & CAT_ATTR_UREAD)  != 0;
+        obj->user_write = (ent->attr & CAT_ATTR_UWRITE) != 0;
+        obj->locked     = (ent->attr & CAT_ATTR_LOCKED) != 0;
+        obj->is_dir     = (ent->attr & CAT_ATTR_DIR)    != 0;
+        obj->user_exec  = (ent->attr & CAT_ATTR_UEXEC)  != 0;
+        obj->pub_read   = (ent->attr & CAT_ATTR_PREAD)  != 0;
+        obj->pub_write  = (ent->attr & CAT_ATTR_PWRITE) != 0;
+        obj->pub_exec   = (ent->attr & CAT_ATTR_PEXEC)  != 0;
+        obj->priv       = (ent->attr & CAT_ATTR_PRIV)   != 0;
+        obj->load_addr  = ent->load_addr;
+        obj->exec_addr  = ent->exec_addr;
+        obj->length     = ent->length;
+        obj->sector     = ent->sector;
+        return AFS_OK;
+    }
+    if (status != AFS_NOT_FOUND)
+        return status;
+    for (ptr = adfs_name; ; ptr = end + 1) {
+        if ((end = strchr(ptr, '.')) == NULL)
+            end = ptr + strlen(ptr);
+        if (end - ptr > ADFS_MAX_NAME)
+            return AFS_NAME_TOO_LONG;
+        if (*end == '\0')
+            return AFS_NOT_FOUND;
+        if ((status = lookup(adfs_name, end - adfs_name, &ent)) != AFS_OK)
+            return status;
+    }
+}
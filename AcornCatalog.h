@@ -0,0 +1,38 @@
+#ifndef ACORN_CATALOG_INC
+#define ACORN_CATALOG_INC
+
+#include "AcornFS.h"
+
+#include <sys/stat.h>
+
+#define CATALOG_MAP_SIZE 512
+
+typedef struct cat_header cat_header;
+typedef struct cat_entry  cat_entry;
+
+/*
+ * A catalog is a sidecar file holding the flattened directory tree of
+ * a read-only image as a sorted, memory-mapped table so a path can be
+ * resolved with one binary search and no image I/O.  It is only used
+ * while the image size, mtime and free space map match those recorded
+ * when it was built.
+ */
+
+class AcornCatalog {
+    public:
+        static AcornCatalog *open(const char *cat_name, const struct stat *img, const unsigned char *fsmap);
+        static int create(AcornFS *fs, const char *cat_name, const struct stat *img, const unsigned char *fsmap);
+        ~AcornCatalog();
+        afs_status find(const char *adfs_name, afs_object *obj);
+        unsigned count();
+    private:
+        AcornCatalog(void *base, size_t size);
+        afs_status lookup(const char *path, size_t len, cat_entry **ent_ptr);
+        void       *base;
+        size_t     size;
+        cat_header *hdr;
+        cat_entry  *ents;
+        const char *names;
+};
+
+#endif
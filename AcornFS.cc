@@ -1,10 +1,12 @@
 #include "AcornFS.h"
+#include "InfManifest.h"
 
 #include <alloca.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/xattr.h>
 
 static const char *afs_errors[] = {
     "No error",
@@ -20,9 +22,14 @@ static const char *afs_errors[] = {
     "Free space map full",
     "Bad free space map",
     "Not enough space",
+    "No memory",
     "Bad attribute string",
     "Internal inconsitency",
-    "Not implemented"
+    "Not implemented",
+    "Is a directory",
+    "Already exists",
+    "Locked",
+    "Directory not empty"
 };
 
 const char *AcornFS::afs_error(afs_status status) {
@@ -44,14 +51,13 @@ afs_status AcornFS::parse_attr(afs_object *obj, FILE *fp) {
     int ch;
 
     memset(obj, 0, sizeof(*obj));
-    if (fscanf(fp, "%12s %x %x %x", obj->name, &obj->load_addr, &obj->exec_addr, &obj->length) == 4) {
+    if (fscanf(fp, "%11s %x %x %x", obj->name, &obj->load_addr, &obj->exec_addr, &obj->length) == 4) {
         ch = get_nonsp(fp);
         if (ch == 'L') {
             obj->locked = 1;
             ch = get_nonsp(fp);
         }
         obj->is_dir     = (ch == 'D');
-        obj->is_dir     = (get_nonsp(fp) == 'D');
         obj->user_read  = (get_nonsp(fp) == 'R');
         obj->user_write = (get_nonsp(fp) == 'W');
         obj->user_exec  = (get_nonsp(fp) == 'E');
@@ -64,15 +70,90 @@ afs_status AcornFS::parse_attr(afs_object *obj, FILE *fp) {
     return AFS_BAD_ATTR;
 }
 
-int AcornFS::host_load(afs_object *obj, const char *host_name) {
+/*
+ * Attributes may also be kept in extended attributes on the data file
+ * itself: user.acorn.load and user.acorn.exec as eight hex digits and
+ * user.acorn.attr as the access letters of a .inf line, without the
+ * D.  host_save uses them when host_xattr is set.
+ */
+
+int AcornFS::host_xattr = 0;
+
+#define XATTR_LOAD "user.acorn.load"
+#define XATTR_EXEC "user.acorn.exec"
+#define XATTR_ATTR "user.acorn.attr"
+
+int AcornFS::host_getxattr(afs_object *obj, const char *host_name) {
+    char load[9], exec[9], attr[10];
+    ssize_t len;
+    int i;
+
+    if (getxattr(host_name, XATTR_LOAD, load, 8) != 8 || getxattr(host_name, XATTR_EXEC, exec, 8) != 8)
+        return 0;
+    load[8] = exec[8] = '\0';
+    obj->load_addr = strtoul(load, NULL, 16);
+    obj->exec_addr = strtoul(exec, NULL, 16);
+    if ((len = getxattr(host_name, XATTR_ATTR, attr, sizeof(attr) - 1)) >= 7) {
+        attr[len] = '\0';
+        i = 0;
+        if ((obj->locked = attr[i] == 'L'))
+            i++;
+        obj->user_read  = attr[i++] == 'R';
+        obj->user_write = attr[i++] == 'W';
+        obj->user_exec  = attr[i++] == 'E';
+        obj->pub_read   = attr[i++] == 'R';
+        obj->pub_write  = attr[i++] == 'W';
+        obj->pub_exec   = attr[i++] == 'E';
+        obj->priv       = attr[i] == 'P';
+    }
+    return 1;
+}
+
+static int xattr_set(int fd, afs_object *obj) {
+    char load[9], exec[9], attr[10], *ap = attr;
+
+    sprintf(load, "%08X", obj->load_addr);
+    sprintf(exec, "%08X", obj->exec_addr);
+    if (obj->locked)
+        *ap++ = 'L';
+    *ap++ = obj->user_read  ? 'R' : '-';
+    *ap++ = obj->user_write ? 'W' : '-';
+    *ap++ = obj->user_exec  ? 'E' : '-';
+    *ap++ = obj->pub_read   ? 'R' : '-';
+    *ap++ = obj->pub_write  ? 'W' : '-';
+    *ap++ = obj->pub_exec   ? 'E' : '-';
+    *ap++ = obj->priv       ? 'P' : '-';
+    if (fsetxattr(fd, XATTR_LOAD, load, 8, 0) != 0 || fsetxattr(fd, XATTR_EXEC, exec, 8, 0) != 0
+        || fsetxattr(fd, XATTR_ATTR, attr, ap - attr, 0) != 0)
+        return errno;
+    return 0;
+}
+
+/*
+ * Attributes come from the manifest if one is given and lists the
+ * file, otherwise from extended attributes or a .inf sidecar,
+ * otherwise they are defaulted.
+ */
+
+int AcornFS::host_load(afs_object *obj, const char *host_name, InfManifest *manifest) {
     int  status = 0;
     FILE *fp;
-    char *inf_fn;
+    char *inf_fn, *ptr;
+    const char *leaf;
     int len;
 
+    memset(obj, 0, sizeof(afs_object));
+    if ((leaf = strrchr(host_name, '/')))
+        leaf++;
+    else
+        leaf = host_name;
+    strncpy(obj->name, leaf, ACORN_FS_MAX_NAME - 1);
+    for (ptr = obj->name; (ptr = strchr(ptr, '.')); )
+        *ptr = '/';
+    obj->user_read = obj->user_write = 1;
     inf_fn = (char *)alloca(strlen(host_name) + 5);
     sprintf(inf_fn, "%s.inf", host_name);
-    if ((fp = fopen(inf_fn, "rt"))) {
+    if (!(manifest && manifest->lookup(host_name, obj)) && !host_getxattr(obj, host_name) && (fp = fopen(inf_fn, "rt"))) {
         parse_attr(obj, fp);
         fclose(fp);
     }
@@ -88,7 +169,7 @@ int AcornFS::host_load(afs_object *obj, const char *host_name) {
                 obj->length = len;
                 obj->data = (unsigned char *)malloc(len);
                 if (fseek(fp, 0, SEEK_SET) == 0) {
-                    if ((int)fread(obj->data, len, 1, fp) == len) {
+                    if (fread(obj->data, len, 1, fp) == 1) {
                         fclose(fp);
                         return 0;
                     }
@@ -107,10 +188,9 @@ void AcornFS::print_attr(afs_object *obj, FILE *fp) {
 
     fprintf(fp, "%-12s %08X %08X %08X", obj->name, obj->load_addr, obj->exec_addr, obj->length);
     ap = attr;
-    if (obj->locked) {
-        *ap++ = ' ';
+    *ap++ = ' ';
+    if (obj->locked)
         *ap++ = 'L';
-    }
     *ap++ = obj->is_dir     ? 'D' : '-';
     *ap++ = obj->user_read  ? 'R' : '-';
     *ap++ = obj->user_write ? 'W' : '-';
@@ -124,14 +204,30 @@ void AcornFS::print_attr(afs_object *obj, FILE *fp) {
 }
 
 
-int AcornFS::host_save(afs_object *obj, const char *host_name) {
+/*
+ * Write a file and its attributes, to the manifest if one is given,
+ * to extended attributes if host_xattr is set and the host filesystem
+ * supports them, or else to a .inf sidecar.
+ */
+
+int AcornFS::host_save(afs_object *obj, const char *host_name, InfManifest *manifest) {
     int  status = 0;
     FILE *fp;
     char *inf_fn;
 
     if ((fp = fopen(host_name, "wb"))) {
-        if (fwrite(obj->data, obj->length, 1, fp) == 1) {
+        if (fwrite(obj->data, obj->length, 1, fp) == 1 || obj->length == 0) {
+            if (manifest == NULL && host_xattr) {
+                if ((status = xattr_set(fileno(fp), obj)) != ENOTSUP) {
+                    if (fclose(fp) != 0 && status == 0)
+                        status = errno;
+                    return status;
+                }
+                status = 0;
+            }
             fclose(fp);
+            if (manifest)
+                return manifest->add(host_name, obj);
             inf_fn = (char *)alloca(strlen(host_name) + 5);
             sprintf(inf_fn, "%s.inf", host_name);
             if ((fp = fopen(inf_fn, "wt"))) {
@@ -149,3 +245,185 @@ int AcornFS::host_save(afs_object *obj, const char *host_name) {
         status = errno;
     return status;
 }
+
+/*
+ * Build the host name for an ADFS path below host_dir.  The leading
+ * "$." is dropped, ADFS directory separators become slashes and any
+ * slashes in ADFS names (the RISC OS convention for host extensions)
+ * become dots.  The result is malloced.
+ */
+
+char *AcornFS::host_path(const char *host_dir, const char *adfs_name) {
+    char *path, *ptr;
+    int ch;
+
+    if (adfs_name[0] == '$') {
+        adfs_name++;
+        if (*adfs_name == '.')
+            adfs_name++;
+    }
+    if ((path = (char *)malloc(strlen(host_dir) + strlen(adfs_name) + 2))) {
+        ptr = stpcpy(path, host_dir);
+        if (*adfs_name)
+            *ptr++ = '/';
+        while ((ch = *adfs_name++)) {
+            if (ch == '.')
+                ch = '/';
+            else if (ch == '/')
+                ch = '.';
+            *ptr++ = ch;
+        }
+        *ptr = '\0';
+    }
+    return path;
+}
+
+afs_status AcornFS::walk_dir(afs_object *dir, const char *path, afs_walk_fn fn, void *ctx) {
+    afs_status status;
+    afs_object *ents;
+    unsigned count, i;
+    char *child;
+
+    if ((status = list(dir, &ents, &count)) == AFS_OK) {
+        for (i = 0; status == AFS_OK && i < count; i++) {
+            if ((child = (char *)malloc(strlen(path) + strlen(ents[i].name) + 2)) == NULL) {
+                status = AFS_NO_MEMORY;
+                break;
+            }
+            sprintf(child, "%s.%s", path, ents[i].name);
+            if ((status = fn(ctx, child, ents + i)) == AFS_OK && ents[i].is_dir)
+                status = walk_dir(ents + i, child, fn, ctx);
+            free(child);
+        }
+        free(ents);
+    }
+    return status;
+}
+
+/*
+ * Call fn for every object at or below path, parents before their
+ * children.  The root itself is not passed to fn.  Any status other
+ * than AFS_OK from fn stops the walk and is returned.
+ */
+
+afs_status AcornFS::walk(const char *path, afs_walk_fn fn, void *ctx) {
+    afs_status status;
+    afs_object obj;
+
+    if ((status = find(path, &obj)) == AFS_OK) {
+        if (obj.is_dir)
+            status = walk_dir(&obj, path, fn, ctx);
+        else
+            status = fn(ctx, path, &obj);
+    }
+    return status;
+}
+
+afs_status AcornFS::mkdir(const char *name, const char *dest_dir) {
+    return AFS_NOT_IMPLEMENTED;
+}
+
+afs_status AcornFS::set_access(const char *adfs_name, const afs_object *attr) {
+    return AFS_NOT_IMPLEMENTED;
+}
+
+void AcornFS::obj_free(afs_object *obj) {
+    free(obj->data);
+    obj->data = NULL;
+}
+
+afs_status AcornFS::copy_obj(AcornFS *src, afs_object *obj, const char *path, AcornFS *dst, const char *dest_dir) {
+    afs_status status;
+    afs_object *ents;
+    unsigned count, i;
+    char *child, *dest;
+
+    if (!obj->is_dir) {
+        if ((status = src->load(obj)) == AFS_OK) {
+            status = dst->save(obj, dest_dir);
+            src->obj_free(obj);
+        }
+        return status;
+    }
+    if ((status = src->list(obj, &ents, &count)) != AFS_OK)
+        return status;
+    if (strcmp(path, "$") == 0)
+        dest = strdup(dest_dir);
+    else if ((status = dst->mkdir(obj->name, dest_dir)) != AFS_OK) {
+        free(ents);
+        return status;
+    }
+    else if ((dest = (char *)malloc(strlen(dest_dir) + strlen(obj->name) + 2))) {
+        sprintf(dest, "%s.%s", dest_dir, obj->name);
+        if ((status = dst->set_access(dest, obj)) == AFS_NOT_IMPLEMENTED)
+            status = AFS_OK;
+    }
+    if (dest == NULL)
+        status = AFS_NO_MEMORY;
+    for (i = 0; status == AFS_OK && i < count; i++) {
+        if ((child = (char *)malloc(strlen(path) + strlen(ents[i].name) + 2)) == NULL) {
+            status = AFS_NO_MEMORY;
+            break;
+        }
+        sprintf(child, "%s.%s", path, ents[i].name);
+        status = copy_obj(src, ents + i, child, dst, dest);
+        free(child);
+    }
+    free(dest);
+    free(ents);
+    return status;
+}
+
+/*
+ * Refuse a copy of dir that would land on dir itself or below it.  The
+ * target, each leading part of dest_dir and the root are looked up
+ * and compared by sector, so any spelling of the path is caught.
+ */
+
+afs_status AcornFS::copy_within(AcornFS *fs, afs_object *dir, const char *dest_dir) {
+    afs_status status;
+    afs_object obj;
+    char *path, *ptr;
+
+    if ((path = (char *)malloc(strlen(dest_dir) + strlen(dir->name) + 2)) == NULL)
+        return AFS_NO_MEMORY;
+    sprintf(path, "%s.%s", dest_dir, dir->name);
+    status = fs->find(path, &obj);
+    for (;;) {
+        if (status == AFS_OK && obj.is_dir && obj.sector == dir->sector) {
+            status = AFS_BAD_COMMAND;
+            break;
+        }
+        if ((ptr = strrchr(path, '.')) != NULL)
+            *ptr = '\0';
+        else if (strcmp(path, "$") != 0)
+            strcpy(path, "$");
+        else
+            break;
+        if ((status = fs->find(path, &obj)) != AFS_OK)
+            break;
+    }
+    free(path);
+    return status;
+}
+
+/*
+ * Copy a file, or a directory and everything below it, from one
+ * filesystem into a directory of another (or the same) one without
+ * going through the host.  Each file is loaded whole and saved, and
+ * attributes go with files and directories alike; copying "$" copies
+ * the contents of the root.  The directory listing is taken
+ * before the copy is made, but copying a directory into itself within
+ * one filesystem is still refused.
+ */
+
+afs_status AcornFS::copy(AcornFS *src, const char *src_name, AcornFS *dst, const char *dest_dir) {
+    afs_status status;
+    afs_object obj;
+
+    if ((status = src->find(src_name, &obj)) == AFS_OK && src == dst && obj.is_dir)
+        status = copy_within(src, &obj, dest_dir);
+    if (status == AFS_OK)
+        status = copy_obj(src, &obj, src_name, dst, dest_dir);
+    return status;
+}
@@ -24,6 +24,10 @@ typedef enum {
     AFS_BAD_ATTR,
     AFS_BUG,
     AFS_NOT_IMPLEMENTED,
+    AFS_IS_DIR,
+    AFS_EXISTS,
+    AFS_LOCKED,
+    AFS_NOT_EMPTY,
     AFS_MAX_ERROR
 } afs_status;
 
@@ -45,16 +49,34 @@ typedef struct {
     unsigned char *data;
 } afs_object;
 
+class InfManifest;
+
+typedef afs_status (*afs_walk_fn)(void *ctx, const char *path, afs_object *obj);
+
 class AcornFS {
     public:
+        virtual ~AcornFS() {};
         static const char *afs_error(afs_status status);
         virtual afs_status find(const char *adfs_name, afs_object *obj) = 0;
         virtual afs_status load(afs_object *obj) = 0;
         virtual afs_status save(afs_object *obj, const char *dest_dir) = 0;
+        virtual afs_status list(afs_object *dir, afs_object **ents, unsigned *count) = 0;
+        virtual afs_status mkdir(const char *name, const char *dest_dir);
+        virtual afs_status set_access(const char *adfs_name, const afs_object *attr);
+        virtual void obj_free(afs_object *obj);
+        afs_status walk(const char *path, afs_walk_fn fn, void *ctx);
+        static afs_status copy(AcornFS *src, const char *src_name, AcornFS *dst, const char *dest_dir);
         static afs_status parse_attr(afs_object *obj, FILE *fp);
         static void print_attr(afs_object *obj, FILE *fp);
-        static int host_load(afs_object *obj, const char *host_name);
-        static int host_save(afs_object *obj, const char *host_name);
+        static int host_load(afs_object *obj, const char *host_name, InfManifest *manifest = NULL);
+        static int host_save(afs_object *obj, const char *host_name, InfManifest *manifest = NULL);
+        static int host_getxattr(afs_object *obj, const char *host_name);
+        static char *host_path(const char *host_dir, const char *adfs_name);
+        static int host_xattr;
+    private:
+        afs_status walk_dir(afs_object *dir, const char *path, afs_walk_fn fn, void *ctx);
+        static afs_status copy_obj(AcornFS *src, afs_object *obj, const char *path, AcornFS *dst, const char *dest_dir);
+        static afs_status copy_within(AcornFS *fs, afs_object *dir, const char *dest_dir);
 };
 
 #endif
@@ -0,0 +1,197 @@
+#include "AcornFSAsync.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+AsyncThreadPool::AsyncThreadPool(unsigned nthreads) {
+    this->nthreads = nthreads ? nthreads : 1;
+    threads = NULL;
+    running = in_flight = 0;
+    stopping = 0;
+    pipe_fds[0] = pipe_fds[1] = -1;
+    todo_head = done_head = NULL;
+    todo_tail = &todo_head;
+    done_tail = &done_head;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wake, NULL);
+}
+
+AsyncThreadPool::~AsyncThreadPool() {
+    unsigned i;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < running; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+}
+
+int AsyncThreadPool::start() {
+    int err;
+
+    if (pipe(pipe_fds) != 0)
+        return errno;
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+    if ((threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL)
+        return ENOMEM;
+    for (; running < nthreads; running++)
+        if ((err = pthread_create(threads + running, NULL, worker, this)) != 0)
+            return err;
+    return 0;
+}
+
+void *AsyncThreadPool::worker(void *arg) {
+    AsyncThreadPool *pool = (AsyncThreadPool *)arg;
+    afs_async_req *req;
+    int was_empty;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->todo_head && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (!(req = pool->todo_head))
+            break;
+        if (!(pool->todo_head = req->next))
+            pool->todo_tail = &pool->todo_head;
+        pthread_mutex_unlock(&pool->lock);
+
+        req->status = req->run(req);
+
+        pthread_mutex_lock(&pool->lock);
+        req->next = NULL;
+        was_empty = pool->done_head == NULL;
+        *pool->done_tail = req;
+        pool->done_tail = &req->next;
+        if (was_empty && write(pool->pipe_fds[1], "", 1) < 0)
+            ; // the reader is woken by the earlier byte anyway.
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void AsyncThreadPool::submit(afs_async_req *req) {
+    pthread_mutex_lock(&lock);
+    req->next = NULL;
+    *todo_tail = req;
+    todo_tail = &req->next;
+    in_flight++;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+int AsyncThreadPool::fd() {
+    return pipe_fds[0];
+}
+
+unsigned AsyncThreadPool::pending() {
+    return in_flight;
+}
+
+/*
+ * Resume every coroutine whose operation has completed, waiting for
+ * at least one if block is set and anything is in flight.  Resumed
+ * coroutines may submit more work, which is picked up next time.
+ */
+
+unsigned AsyncThreadPool::poll(int block) {
+    struct pollfd pfd;
+    afs_async_req *req, *next;
+    unsigned count = 0;
+    char buf[64];
+
+    if (block && in_flight > 0) {
+        pfd.fd = pipe_fds[0];
+        pfd.events = POLLIN;
+        while (::poll(&pfd, 1, -1) < 0 && errno == EINTR)
+            ;
+    }
+    while (read(pipe_fds[0], buf, sizeof(buf)) > 0)
+        ;
+    pthread_mutex_lock(&lock);
+    req = done_head;
+    done_head = NULL;
+    done_tail = &done_head;
+    pthread_mutex_unlock(&lock);
+    for (; req; req = next) {
+        next = req->next;
+        in_flight--;
+        count++;
+        req->waiter.resume();
+    }
+    return count;
+}
+
+/*
+ * Suspends the calling coroutine until the completion source has run
+ * the request.  The request lives in the coroutine frame.
+ */
+
+struct afs_async_await {
+    AsyncCompletion *io;
+    afs_async_req   req;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> waiter) {
+        req.waiter = waiter;
+        io->submit(&req);
+    }
+    afs_status await_resume() { return req.status; }
+};
+
+static afs_status run_find(afs_async_req *req) {
+    return req->fs->find(req->name, req->obj);
+}
+
+static afs_status run_load(afs_async_req *req) {
+    return req->fs->load(req->obj);
+}
+
+static afs_status run_save(afs_async_req *req) {
+    return req->fs->save(req->obj, req->name);
+}
+
+static afs_status run_list(afs_async_req *req) {
+    return req->fs->list(req->obj, req->ents, req->count);
+}
+
+static afs_async_await make_await(AsyncCompletion *io, afs_status (*run)(afs_async_req *), AcornFS *fs, const char *name, afs_object *obj) {
+    afs_async_await aw;
+
+    aw.req = afs_async_req();
+    aw.io = io;
+    aw.req.run = run;
+    aw.req.fs = fs;
+    aw.req.name = name;
+    aw.req.obj = obj;
+    return aw;
+}
+
+afs_task<afs_status> AcornFSAsync::find(const char *adfs_name, afs_object *obj) {
+    co_return co_await make_await(io, run_find, fs, adfs_name, obj);
+}
+
+afs_task<afs_status> AcornFSAsync::load(afs_object *obj) {
+    co_return co_await make_await(io, run_load, fs, NULL, obj);
+}
+
+afs_task<afs_status> AcornFSAsync::save(afs_object *obj, const char *dest_dir) {
+    co_return co_await make_await(io, run_save, fs, dest_dir, obj);
+}
+
+afs_task<afs_status> AcornFSAsync::list(afs_object *dir, afs_object **ents, unsigned *count) {
+    afs_async_await aw = make_await(io, run_list, fs, NULL, dir);
+
+    aw.req.ents = ents;
+    aw.req.count = count;
+    co_return co_await aw;
+}
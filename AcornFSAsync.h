@@ -0,0 +1,144 @@
+#ifndef ACORN_FS_ASYNC_INC
+#define ACORN_FS_ASYNC_INC
+
+#include "AcornFS.h"
+
+#include <coroutine>
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * Awaitable AcornFS operations for event driven callers.  Needs C++20
+ * coroutines; the rest of the library does not.
+ *
+ * An operation is handed to an AsyncCompletion, which carries it out
+ * somewhere other than the calling thread and later resumes the
+ * waiting coroutine on the thread that drives it.  That lets one
+ * thread keep many image operations in flight.
+ */
+
+typedef struct afs_async_req afs_async_req;
+
+struct afs_async_req {
+    afs_async_req           *next;
+    std::coroutine_handle<> waiter;
+    afs_status              (*run)(afs_async_req *req);
+    AcornFS                 *fs;
+    const char              *name;
+    afs_object              *obj;
+    afs_object              **ents;
+    unsigned                *count;
+    afs_status              status;
+};
+
+/*
+ * A completion source: submit() must eventually call req->run (from
+ * any thread) and then resume req->waiter on the caller's own event
+ * loop thread.
+ */
+
+class AsyncCompletion {
+    public:
+        virtual ~AsyncCompletion() {}
+        virtual void submit(afs_async_req *req) = 0;
+};
+
+/*
+ * The stock completion source: a few threads run the blocking calls
+ * and queue the results.  fd() becomes readable while completions are
+ * waiting, for use with poll or epoll; poll() resumes them.
+ */
+
+class AsyncThreadPool: public AsyncCompletion {
+    public:
+        AsyncThreadPool(unsigned nthreads);
+        ~AsyncThreadPool();
+        int start();
+        void submit(afs_async_req *req);
+        int fd();
+        unsigned poll(int block);
+        unsigned pending();
+    private:
+        static void *worker(void *arg);
+        pthread_t       *threads;
+        unsigned        nthreads;
+        unsigned        running;
+        unsigned        in_flight;
+        int             stopping;
+        int             pipe_fds[2];
+        afs_async_req   *todo_head, **todo_tail;
+        afs_async_req   *done_head, **done_tail;
+        pthread_mutex_t lock;
+        pthread_cond_t  wake;
+};
+
+/*
+ * A lazily started coroutine producing a T.  Awaiting it runs it to
+ * completion; a top level task is kicked off with start() and is
+ * finished once done() is true.
+ */
+
+template<typename T>
+class afs_task {
+    public:
+        struct promise_type;
+        typedef std::coroutine_handle<promise_type> handle;
+
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(handle h) noexcept {
+                std::coroutine_handle<> next = h.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        struct promise_type {
+            T                       value;
+            std::coroutine_handle<> continuation;
+            afs_task get_return_object() { return afs_task(handle::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            final_awaiter final_suspend() noexcept { return {}; }
+            void return_value(T v) { value = v; }
+            void unhandled_exception() { abort(); }
+        };
+
+        afs_task(afs_task &&other) : coro(other.coro) { other.coro = nullptr; }
+        afs_task(const afs_task &) = delete;
+        afs_task &operator=(const afs_task &) = delete;
+        ~afs_task() { if (coro) coro.destroy(); }
+
+        bool await_ready() { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) {
+            coro.promise().continuation = waiter;
+            return coro;
+        }
+        T await_resume() { return coro.promise().value; }
+
+        void start() { coro.resume(); }
+        bool done() { return coro.done(); }
+        T result() { return coro.promise().value; }
+    private:
+        explicit afs_task(handle h) : coro(h) {}
+        handle coro;
+};
+
+/*
+ * Async front end for any AcornFS.  The filesystem must be safe for
+ * concurrent calls, as AcornADFS is.  Names and objects passed in
+ * must stay valid until the returned task completes.
+ */
+
+class AcornFSAsync {
+    public:
+        AcornFSAsync(AcornFS *fs, AsyncCompletion *io) : fs(fs), io(io) {};
+        afs_task<afs_status> find(const char *adfs_name, afs_object *obj);
+        afs_task<afs_status> load(afs_object *obj);
+        afs_task<afs_status> save(afs_object *obj, const char *dest_dir);
+        afs_task<afs_status> list(afs_object *dir, afs_object **ents, unsigned *count);
+    private:
+        AcornFS         *fs;
+        AsyncCompletion *io;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "AcornTrace.h"
+
+#ifdef AFS_TRACE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_once_t  trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE            *trace_fp;
+static int             trace_events;
+
+static void trace_close() {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp) {
+        fputs("\n]\n", trace_fp);
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_open() {
+    const char *name;
+
+    if ((name = getenv("AFS_TRACE_FILE")) && *name) {
+        if ((trace_fp = fopen(name, "w")) == NULL)
+            fprintf(stderr, "afs_trace: unable to create '%s'\n", name);
+        else {
+            setvbuf(trace_fp, NULL, _IOFBF, 1 << 16);
+            fputs("[\n", trace_fp);
+            atexit(trace_close);
+        }
+    }
+}
+
+static double trace_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void trace_string(const char *str, int len) {
+    int i;
+
+    putc('"', trace_fp);
+    for (i = 0; str && (len < 0 ? str[i] != '\0' : i < len); i++) {
+        if (str[i] == '"' || str[i] == '\\')
+            fprintf(trace_fp, "\\%c", str[i]);
+        else if ((unsigned char)str[i] < 0x20 || (unsigned char)str[i] >= 0x7f)
+            fprintf(trace_fp, "\\u%04x", (unsigned char)str[i]);
+        else
+            putc(str[i], trace_fp);
+    }
+    putc('"', trace_fp);
+}
+
+afs_trace_span::afs_trace_span(const char *op, const char *image, const char *path, int path_len, uint64_t bytes) {
+    pthread_once(&trace_once, trace_open);
+    this->op = op;
+    this->image = image;
+    this->path = path;
+    this->path_len = path_len;
+    this->bytes = bytes;
+    start = trace_fp ? trace_now() : 0;
+}
+
+afs_trace_span::~afs_trace_span() {
+    double end;
+
+    if (trace_fp == NULL)
+        return;
+    end = trace_now();
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp) {
+        fprintf(trace_fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{\"image\":",
+                trace_events++ ? ",\n" : "", op, start, end - start, (int)getpid(), (long)syscall(SYS_gettid));
+        trace_string(image, -1);
+        fputs(",\"path\":", trace_fp);
+        trace_string(path, path_len);
+        fprintf(trace_fp, ",\"bytes\":%llu}}", (unsigned long long)bytes);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#endif
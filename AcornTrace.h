@@ -0,0 +1,39 @@
+#ifndef ACORN_TRACE_INC
+#define ACORN_TRACE_INC
+
+#include <stdint.h>
+
+/*
+ * Optional spans around filesystem operations, written as a Chrome
+ * trace (for chrome://tracing or Perfetto) to the file named by
+ * $AFS_TRACE_FILE.  Each records the operation, thread, start and
+ * duration, the image, a path and a byte count (an object count for
+ * extract).  Only built in when
+ * AFS_TRACE is defined; otherwise AFS_SPAN expands to nothing and its
+ * arguments are not evaluated.
+ */
+
+#ifdef AFS_TRACE
+
+class afs_trace_span {
+    public:
+        afs_trace_span(const char *op, const char *image, const char *path, int path_len, uint64_t bytes);
+        ~afs_trace_span();
+    private:
+        const char *op;
+        const char *image;
+        const char *path;
+        int        path_len;
+        uint64_t   bytes;
+        double     start;
+};
+
+#define AFS_SPAN(op, image, path, path_len, bytes) afs_trace_span afs_span_(op, image, path, path_len, bytes)
+
+#else
+
+#define AFS_SPAN(op, image, path, path_len, bytes) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,226 @@
+#include "ContentStore.h"
+#include "Sha256.h"
+
+#include <alloca.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CS_MAX_QUEUED 64
+
+struct cs_job {
+    cs_job     *next;
+    afs_object obj;
+    char       *adfs_name;
+    char       *host_name;
+};
+
+ContentStore::ContentStore(const char *store_dir, FILE *manifest) {
+    dir = strdup(store_dir);
+    this->manifest = manifest;
+    threads = NULL;
+    nthreads = 0;
+    head = tail = NULL;
+    queued = 0;
+    done = 0;
+    error = 0;
+    blobs_written = 0;
+    blobs_shared = 0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&ready, NULL);
+    pthread_cond_init(&space, NULL);
+}
+
+ContentStore::~ContentStore() {
+    if (threads)
+        finish();
+    pthread_cond_destroy(&space);
+    pthread_cond_destroy(&ready);
+    pthread_mutex_destroy(&lock);
+    free(dir);
+}
+
+int ContentStore::start(unsigned nthreads) {
+    char *sub;
+    unsigned i;
+    int err;
+
+    if (dir == NULL)
+        return ENOMEM;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return errno;
+    sub = (char *)alloca(strlen(dir) + 4);
+    for (i = 0; i < 256; i++) {
+        sprintf(sub, "%s/%02x", dir, i);
+        if (mkdir(sub, 0777) != 0 && errno != EEXIST)
+            return errno;
+    }
+    if (nthreads == 0)
+        nthreads = 1;
+    if ((threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t))) == NULL)
+        return ENOMEM;
+    for (i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(threads + i, NULL, worker, this)) != 0) {
+            this->nthreads = i;
+            finish();
+            return err;
+        }
+    }
+    this->nthreads = nthreads;
+    return 0;
+}
+
+/*
+ * Queue an object for storing.  The store takes ownership of obj->data
+ * which is released with free() once it has been written.
+ */
+
+int ContentStore::submit(afs_object *obj, const char *adfs_name, const char *host_name) {
+    cs_job *job;
+
+    if ((job = (cs_job *)malloc(sizeof(cs_job))) == NULL)
+        return ENOMEM;
+    job->next = NULL;
+    job->obj = *obj;
+    job->adfs_name = strdup(adfs_name);
+    job->host_name = strdup(host_name);
+    if (job->adfs_name == NULL || job->host_name == NULL) {
+        free(job->adfs_name);
+        free(job->host_name);
+        free(job);
+        return ENOMEM;
+    }
+    obj->data = NULL;
+    pthread_mutex_lock(&lock);
+    while (queued >= CS_MAX_QUEUED)
+        pthread_cond_wait(&space, &lock);
+    if (tail)
+        tail->next = job;
+    else
+        head = job;
+    tail = job;
+    queued++;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int ContentStore::finish() {
+    unsigned i;
+
+    pthread_mutex_lock(&lock);
+    done = 1;
+    pthread_cond_broadcast(&ready);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    threads = NULL;
+    nthreads = 0;
+    if (manifest && fflush(manifest) != 0 && error == 0)
+        error = errno;
+    return error;
+}
+
+void *ContentStore::worker(void *arg) {
+    ContentStore *cs = (ContentStore *)arg;
+    cs_job *job;
+    int err;
+
+    for (;;) {
+        pthread_mutex_lock(&cs->lock);
+        while (cs->head == NULL && !cs->done)
+            pthread_cond_wait(&cs->ready, &cs->lock);
+        if ((job = cs->head) == NULL) {
+            pthread_mutex_unlock(&cs->lock);
+            return NULL;
+        }
+        if ((cs->head = job->next) == NULL)
+            cs->tail = NULL;
+        cs->queued--;
+        pthread_cond_signal(&cs->space);
+        pthread_mutex_unlock(&cs->lock);
+
+        if ((err = cs->store(job)) != 0) {
+            fprintf(stderr, "adfscp: unable to export '%s' to '%s': %s\n", job->adfs_name, job->host_name, strerror(err));
+            pthread_mutex_lock(&cs->lock);
+            if (cs->error == 0)
+                cs->error = err;
+            pthread_mutex_unlock(&cs->lock);
+        }
+        free(job->obj.data);
+        free(job->adfs_name);
+        free(job->host_name);
+        free(job);
+    }
+}
+
+int ContentStore::write_blob(const char *blob, afs_object *obj) {
+    char *tmp;
+    int fd, err = 0;
+
+    tmp = (char *)alloca(strlen(blob) + 8);
+    sprintf(tmp, "%s.XXXXXX", blob);
+    if ((fd = mkstemp(tmp)) < 0)
+        return errno;
+    if (obj->length > 0 && write(fd, obj->data, obj->length) != (ssize_t)obj->length)
+        err = errno ? errno : EIO;
+    if (close(fd) != 0 && err == 0)
+        err = errno;
+    if (err == 0) {
+        chmod(tmp, 0444);
+        if (rename(tmp, blob) == 0)
+            return 0;
+        err = errno;
+    }
+    unlink(tmp);
+    return err;
+}
+
+int ContentStore::store(cs_job *job) {
+    char hash[SHA256_HEX], *blob, *inf;
+    struct stat st;
+    FILE *fp;
+    int err, shared;
+
+    sha256_hex(job->obj.data, job->obj.length, hash);
+    blob = (char *)alloca(strlen(dir) + SHA256_HEX + 5);
+    sprintf(blob, "%s/%.2s/%s", dir, hash, hash);
+    if ((shared = (stat(blob, &st) == 0)) == 0)
+        if ((err = write_blob(blob, &job->obj)) != 0)
+            return err;
+    if (unlink(job->host_name) != 0 && errno != ENOENT)
+        return errno;
+    if (link(blob, job->host_name) != 0) {
+        if (errno != EXDEV && errno != EMLINK)
+            return errno;
+        if ((fp = fopen(job->host_name, "wb")) == NULL)
+            return errno;
+        err = 0;
+        if (job->obj.length > 0 && fwrite(job->obj.data, job->obj.length, 1, fp) != 1)
+            err = errno;
+        if (fclose(fp) != 0 && err == 0)
+            err = errno;
+        if (err)
+            return err;
+    }
+    inf = (char *)alloca(strlen(job->host_name) + 5);
+    sprintf(inf, "%s.inf", job->host_name);
+    if ((fp = fopen(inf, "wt")) == NULL)
+        return errno;
+    AcornFS::print_attr(&job->obj, fp);
+    if (fclose(fp) != 0)
+        return errno;
+
+    pthread_mutex_lock(&lock);
+    if (shared)
+        blobs_shared++;
+    else
+        blobs_written++;
+    if (manifest)
+        fprintf(manifest, "%s  %s\n", hash, job->adfs_name);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
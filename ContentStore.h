@@ -0,0 +1,44 @@
+#ifndef CONTENT_STORE_INC
+#define CONTENT_STORE_INC
+
+#include "AcornFS.h"
+
+#include <pthread.h>
+
+typedef struct cs_job cs_job;
+
+/*
+ * A content-addressed store of file data.  Each unique blob is written
+ * once as <store>/<xx>/<sha256> and exported files become hard links
+ * to it plus a .inf sidecar.  Hashing and writing happen on a pool of
+ * worker threads so the caller can keep reading the image.
+ */
+
+class ContentStore {
+    public:
+        ContentStore(const char *store_dir, FILE *manifest);
+        ~ContentStore();
+        int start(unsigned threads);
+        int submit(afs_object *obj, const char *adfs_name, const char *host_name);
+        int finish();
+        unsigned blobs_written;
+        unsigned blobs_shared;
+    private:
+        static void *worker(void *arg);
+        int store(cs_job *job);
+        int write_blob(const char *blob, afs_object *obj);
+        char            *dir;
+        FILE            *manifest;
+        pthread_t       *threads;
+        unsigned        nthreads;
+        pthread_mutex_t lock;
+        pthread_cond_t  ready;
+        pthread_cond_t  space;
+        cs_job          *head;
+        cs_job          *tail;
+        unsigned        queued;
+        int             done;
+        int             error;
+};
+
+#endif
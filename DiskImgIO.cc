@@ -1,33 +1,90 @@
 #include "DiskImgIOlinear.h"
+#include "DiskImgIOmem.h"
+#include "DiskImgProbe.h"
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
-DiskImgIO *DiskImgIO::openImg(const char *filename, int writable) {
-    DiskImgIO *dio;
+/*
+ * With in_memory set, linear images small enough for DiskImgIOmem are
+ * read whole and written back atomically on close; others are opened
+ * as usual.  An image read whole is probed from memory, so the file is
+ * read only once.
+ */
+
+DiskImgIO *DiskImgIO::openImg(const char *filename, int writable, int in_memory) {
+    DiskImgIO *dio = NULL;
+    DiskImgIOmem *mem;
+    unsigned char *head;
+    img_guess guess;
     const char *mode;
+    struct stat st;
+    size_t len;
     FILE *fp;
+    int err;
 
     mode = writable ? "rb+" : "rb";
-    if ((fp = fopen(filename, mode))) {
-        dio = new DiskImgIOlinear(fp);
-        return dio;
+    if ((fp = fopen(filename, mode)) == NULL)
+        return NULL;
+    guess.format = IMG_UNKNOWN;
+    if (in_memory && fstat(fileno(fp), &st) == 0 && st.st_size <= MEM_IMAGE_MAX) {
+        mem = new DiskImgIOmem(fp, writable);
+        if ((err = mem->load()) != 0) {
+            delete mem;
+            fclose(fp);
+            errno = err;
+            return NULL;
+        }
+        len = st.st_size < PROBE_SIZE ? st.st_size : PROBE_SIZE;
+        if (len > 0 && (head = mem->read(0, len)) != NULL) {
+            if (DiskImgProbe::probe_buf(head, len, st.st_size, filename, &guess, 1) != 1)
+                guess.format = IMG_UNKNOWN;
+            free(head);
+        }
+        if (guess.format == IMG_ADFS_L_INTERLEAVED)
+            delete mem;
+        else
+            dio = mem;
     }
-    return NULL;
+    else if (DiskImgProbe::probe_fd(fileno(fp), filename, &guess, 1) != 1)
+        guess.format = IMG_UNKNOWN;
+    if (dio == NULL)
+        dio = DiskImgProbe::open_as(fp, guess.format);
+    dio->filename = strdup(filename);
+    return dio;
 }
 
 DiskImgIO::DiskImgIO(FILE *fp) {
     this->fp = fp;
     this->sect_size = 256;
+    this->filename = NULL;
+}
+
+DiskImgIO::~DiskImgIO() {
+    free(filename);
+}
+
+const char *DiskImgIO::name() {
+    return filename ? filename : "";
 }
 
 int DiskImgIO::close() {
     return fclose(fp);
 }
 
+unsigned char *DiskImgIO::dio_alloc(unsigned bytes) {
+    return (unsigned char *)malloc(bytes);
+}
+
 void DiskImgIO::dio_free(unsigned char *data) {
     free(data);
 }
 
+int DiskImgIO::stat(struct stat *st) {
+    return ::fstat(fileno(fp), st);
+}
+
 unsigned DiskImgIO::sectors(unsigned bytes) {
     return ((bytes-1) / sect_size) + 1;
 }
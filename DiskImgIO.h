@@ -2,19 +2,25 @@
 #define DiskImgIO_INC
 
 #include <stdio.h>
+#include <sys/stat.h>
 
 class DiskImgIO {
     public:
-        static DiskImgIO *openImg(const char *filename, int writable);
+        static DiskImgIO *openImg(const char *filename, int writable, int in_memory = 0);
         DiskImgIO(FILE *fp);
+        virtual ~DiskImgIO();
         virtual unsigned char *read(unsigned sector, unsigned bytes) = 0;
+        unsigned char *dio_alloc(unsigned bytes);
         void dio_free(unsigned char *data);
         virtual int write(unsigned sector, unsigned bytes, const unsigned char *data) = 0;
-        int close();
+        virtual int close();
         unsigned sectors(unsigned bytes);
+        virtual int stat(struct stat *st);
+        const char *name();
     protected:
         FILE     *fp;
         unsigned sect_size;
+        char     *filename;
 };
 
 #endif
@@ -0,0 +1,57 @@
+#include "DiskImgIOinterleaved.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+DiskImgIOinterleaved::DiskImgIOinterleaved(FILE *fp, unsigned tracks, unsigned sect_per_track) : DiskImgIO(fp) {
+    this->tracks = tracks;
+    this->sect_per_track = sect_per_track;
+}
+
+off_t DiskImgIOinterleaved::posn(unsigned sector) {
+    unsigned track = sector / sect_per_track;
+    unsigned side = track / tracks;
+
+    track = (track % tracks) * 2 + side;
+    return ((off_t)track * sect_per_track + sector % sect_per_track) * sect_size;
+}
+
+/*
+ * Transfers are split at track boundaries as consecutive logical
+ * sectors are only contiguous in the file within a track.
+ */
+
+unsigned char *DiskImgIOinterleaved::read(unsigned sector, unsigned bytes) {
+    unsigned char *data, *ptr;
+    unsigned chunk;
+
+    if ((data = (unsigned char *)malloc(bytes))) {
+        for (ptr = data; bytes > 0; ptr += chunk, bytes -= chunk) {
+            chunk = (sect_per_track - sector % sect_per_track) * sect_size;
+            if (chunk > bytes)
+                chunk = bytes;
+            if (pread(fileno(fp), ptr, chunk, posn(sector)) != (ssize_t)chunk) {
+                free(data);
+                return NULL;
+            }
+            sector += chunk / sect_size;
+        }
+    }
+    return data;
+}
+
+int DiskImgIOinterleaved::write(unsigned sector, unsigned bytes, const unsigned char *data) {
+    unsigned chunk;
+    ssize_t done;
+
+    for (; bytes > 0; data += chunk, bytes -= chunk) {
+        chunk = (sect_per_track - sector % sect_per_track) * sect_size;
+        if (chunk > bytes)
+            chunk = bytes;
+        if ((done = pwrite(fileno(fp), data, chunk, posn(sector))) != (ssize_t)chunk)
+            return done < 0 ? errno : EIO;
+        sector += chunk / sect_size;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef DiskImgIOinterleaved_INC
+#define DiskImgIOinterleaved_INC
+
+#include "DiskImgIO.h"
+
+#include <sys/types.h>
+
+/*
+ * A double-sided image stored track by track with the sides
+ * alternating, as in .adl files, presented as the logical sector order
+ * ADFS uses: all of side 0 followed by all of side 1.
+ */
+
+class DiskImgIOinterleaved: public DiskImgIO {
+    public:
+        DiskImgIOinterleaved(FILE *fp, unsigned tracks, unsigned sect_per_track);
+        unsigned char *read(unsigned sector, unsigned bytes);
+        int write(unsigned sector, unsigned bytes, const unsigned char *data);
+    private:
+        off_t posn(unsigned sector);
+        unsigned tracks;
+        unsigned sect_per_track;
+};
+
+#endif
@@ -2,25 +2,30 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Positioned I/O leaves no shared file offset behind so concurrent
+ * readers of the same image do not disturb each other.
+ */
 
 unsigned char *DiskImgIOlinear::read(unsigned sector, unsigned bytes) {
-    int byte_posn = sector * sect_size;
+    off_t byte_posn = (off_t)sector * sect_size;
     unsigned char *data;
 
-    if (fseek(fp, byte_posn, SEEK_SET) == 0) {
-        if ((data = (unsigned char *)malloc(bytes))) {
-            if (fread(data, bytes, 1, fp) == 1)
-                return data;
-            free(data);
-        }
+    if ((data = (unsigned char *)malloc(bytes))) {
+        if (pread(fileno(fp), data, bytes, byte_posn) == (ssize_t)bytes)
+            return data;
+        free(data);
     }
     return NULL;
 }
 
 int DiskImgIOlinear::write(unsigned sector, unsigned bytes, const unsigned char *data) {
-    int byte_posn = sector * sect_size;
-    if (fseek(fp, byte_posn, SEEK_SET) == 0)
-        if (fwrite(data, bytes, 1, fp) == 1)
-            return 0;
-    return errno;
+    off_t byte_posn = (off_t)sector * sect_size;
+    ssize_t done;
+
+    if ((done = pwrite(fileno(fp), data, bytes, byte_posn)) == (ssize_t)bytes)
+        return 0;
+    return done < 0 ? errno : EIO;
 }
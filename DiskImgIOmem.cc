@@ -0,0 +1,153 @@
+#include "DiskImgIOmem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+DiskImgIOmem::DiskImgIOmem(FILE *fp, int writable) : DiskImgIO(fp) {
+    this->image = NULL;
+    this->size = 0;
+    this->capacity = 0;
+    pthread_mutex_init(&size_lock, NULL);
+    this->writable = writable;
+    this->dirty = 0;
+}
+
+DiskImgIOmem::~DiskImgIOmem() {
+    free(image);
+    pthread_mutex_destroy(&size_lock);
+}
+
+/*
+ * A writable image gets the largest buffer it could need up front, so
+ * the buffer never moves while readers under a shared lock are using
+ * it; space past the end of the file reads as zeros.
+ */
+
+int DiskImgIOmem::load() {
+    struct stat st;
+    ssize_t done;
+
+    if (fstat(fileno(fp), &st) != 0)
+        return errno;
+    if (st.st_size > MEM_IMAGE_MAX)
+        return EFBIG;
+    size = st.st_size;
+    capacity = writable ? MEM_IMAGE_MAX : size;
+    if (capacity > 0) {
+        if ((image = (unsigned char *)calloc(capacity, 1)) == NULL)
+            return ENOMEM;
+        if (size > 0 && (done = pread(fileno(fp), image, size, 0)) != (ssize_t)size)
+            return done < 0 ? errno : EIO;
+    }
+    return 0;
+}
+
+unsigned char *DiskImgIOmem::read(unsigned sector, unsigned bytes) {
+    size_t byte_posn = (size_t)sector * sect_size;
+    unsigned char *data;
+
+    if (byte_posn + bytes > capacity)
+        return NULL;
+    if ((data = (unsigned char *)malloc(bytes)))
+        memcpy(data, image + byte_posn, bytes);
+    return data;
+}
+
+/*
+ * Writes past the end grow the image, as when a new one is built, up
+ * to MEM_IMAGE_MAX.  Saves may write at the same time, so the end is
+ * moved under a lock of its own.
+ */
+
+int DiskImgIOmem::write(unsigned sector, unsigned bytes, const unsigned char *data) {
+    size_t byte_posn = (size_t)sector * sect_size;
+
+    if (!writable)
+        return EBADF;
+    if (byte_posn + bytes > capacity)
+        return EFBIG;
+    memcpy(image + byte_posn, data, bytes);
+    pthread_mutex_lock(&size_lock);
+    if (byte_posn + bytes > size)
+        size = byte_posn + bytes;
+    dirty = 1;
+    pthread_mutex_unlock(&size_lock);
+    return 0;
+}
+
+int DiskImgIOmem::commit() {
+    struct stat st;
+    unsigned char *ptr;
+    size_t left;
+    ssize_t done;
+    char *path, *tmp, *dir;
+    int fd, dfd, err = 0;
+
+    if (filename == NULL)
+        return EINVAL;
+    // replace the target of a symbolic link, not the link itself.
+    if ((path = realpath(filename, NULL)) == NULL)
+        return errno;
+    if ((tmp = (char *)malloc(strlen(path) + 8)) == NULL) {
+        free(path);
+        return ENOMEM;
+    }
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        err = errno;
+        free(tmp);
+        free(path);
+        return err;
+    }
+    for (ptr = image, left = size; left > 0; ptr += done, left -= done) {
+        if ((done = ::write(fd, ptr, left)) < 0) {
+            if (errno == EINTR)
+                done = 0;
+            else {
+                err = errno;
+                break;
+            }
+        }
+    }
+    if (err == 0 && fstat(fileno(fp), &st) == 0 && fchmod(fd, st.st_mode & 07777) != 0)
+        err = errno;
+    if (err == 0 && fsync(fd) != 0)
+        err = errno;
+    if (::close(fd) != 0 && err == 0)
+        err = errno;
+    if (err == 0 && rename(tmp, path) != 0)
+        err = errno;
+    if (err)
+        unlink(tmp);
+    else if ((dir = strdup(path))) {
+        // make the rename itself durable.
+        if ((dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) >= 0) {
+            fsync(dfd);
+            ::close(dfd);
+        }
+        free(dir);
+    }
+    free(tmp);
+    free(path);
+    return err;
+}
+
+int DiskImgIOmem::close() {
+    int err = 0;
+
+    if (dirty)
+        err = commit();
+    if (fclose(fp) != 0 && err == 0)
+        err = errno;
+    free(image);
+    image = NULL;
+    if (err) {
+        errno = err;
+        return EOF;
+    }
+    return 0;
+}
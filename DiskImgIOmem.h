@@ -0,0 +1,37 @@
+#ifndef DiskImgIOmem_INC
+#define DiskImgIOmem_INC
+
+#include "DiskImgIO.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define MEM_IMAGE_MAX (640 * 1024)
+
+/*
+ * A linear image held entirely in memory: it is read with one call
+ * when opened and, if anything was written, replaced as a whole on
+ * close by writing a temporary file alongside it and renaming that
+ * over the original, so an update either lands completely or not at
+ * all.  Meant for floppy sized images.
+ */
+
+class DiskImgIOmem: public DiskImgIO {
+    public:
+        DiskImgIOmem(FILE *fp, int writable);
+        ~DiskImgIOmem();
+        int load();
+        unsigned char *read(unsigned sector, unsigned bytes);
+        int write(unsigned sector, unsigned bytes, const unsigned char *data);
+        int close();
+    private:
+        int commit();
+        unsigned char   *image;
+        size_t          size;
+        size_t          capacity;
+        int             writable;
+        int             dirty;
+        pthread_mutex_t size_lock;
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "DiskImgIOstore.h"
+#include "SectorStore.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+DiskImgIOstore::DiskImgIOstore(FILE *fp, uint32_t *chunks, unsigned count, uint32_t length, struct stat *st) : DiskImgIO(fp) {
+    this->chunks = chunks;
+    this->count = count;
+    this->length = length;
+    this->index_st = *st;
+    this->index_st.st_size = length;
+    this->tracks = 0;
+    this->sect_per_track = 0;
+}
+
+DiskImgIOstore::~DiskImgIOstore() {
+    free(chunks);
+}
+
+void DiskImgIOstore::interleave(unsigned tracks, unsigned sect_per_track) {
+    this->tracks = tracks;
+    this->sect_per_track = sect_per_track;
+}
+
+off_t DiskImgIOstore::posn(unsigned sector) {
+    unsigned track = sector / sect_per_track;
+    unsigned side = track / tracks;
+
+    track = (track % tracks) * 2 + side;
+    return ((off_t)track * sect_per_track + sector % sect_per_track) * sect_size;
+}
+
+/*
+ * Chunks stored one after another, as those of an image archived for
+ * the first time are, are read together.
+ */
+
+int DiskImgIOstore::read_at(uint64_t posn, unsigned char *ptr, unsigned bytes) {
+    unsigned i, offset, chunk, left;
+
+    if (posn + bytes > length)
+        return EINVAL;
+    for (left = bytes; left > 0; ptr += chunk, left -= chunk) {
+        i = posn / SS_CHUNK_SIZE;
+        offset = posn % SS_CHUNK_SIZE;
+        chunk = SS_CHUNK_SIZE - offset;
+        while (chunk < left && i + 1 < count && chunks[i + 1] == chunks[i] + 1) {
+            chunk += SS_CHUNK_SIZE;
+            i++;
+        }
+        if (chunk > left)
+            chunk = left;
+        i = posn / SS_CHUNK_SIZE;
+        if (pread(fileno(fp), ptr, chunk, (off_t)chunks[i] * SS_CHUNK_SIZE + offset) != (ssize_t)chunk)
+            return EIO;
+        posn += chunk;
+    }
+    return 0;
+}
+
+unsigned char *DiskImgIOstore::read(unsigned sector, unsigned bytes) {
+    unsigned char *data, *ptr;
+    unsigned chunk;
+
+    if ((data = (unsigned char *)malloc(bytes)) == NULL)
+        return NULL;
+    if (tracks == 0) {
+        if (read_at((uint64_t)sector * sect_size, data, bytes) == 0)
+            return data;
+        free(data);
+        return NULL;
+    }
+    for (ptr = data; bytes > 0; ptr += chunk, bytes -= chunk) {
+        chunk = (sect_per_track - sector % sect_per_track) * sect_size;
+        if (chunk > bytes)
+            chunk = bytes;
+        if (read_at(posn(sector), ptr, chunk) != 0) {
+            free(data);
+            return NULL;
+        }
+        sector += chunk / sect_size;
+    }
+    return data;
+}
+
+int DiskImgIOstore::write(unsigned sector, unsigned bytes, const unsigned char *data) {
+    return EROFS;
+}
+
+int DiskImgIOstore::stat(struct stat *st) {
+    *st = index_st;
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef DiskImgIOstore_INC
+#define DiskImgIOstore_INC
+
+#include "DiskImgIO.h"
+
+#include <stdint.h>
+
+/*
+ * An image read back out of a SectorStore, with random access through
+ * its chunk index.  fp is the store's chunk file, shared by every image
+ * in it, so the image is read-only and stat reports the image's index
+ * file with the size of the image itself.  The store keeps the bytes
+ * of the image file as they were; an interleaved image is read through
+ * the same track mapping as DiskImgIOinterleaved once interleave is
+ * called.
+ */
+
+class DiskImgIOstore: public DiskImgIO {
+    public:
+        DiskImgIOstore(FILE *fp, uint32_t *chunks, unsigned count, uint32_t length, struct stat *st);
+        ~DiskImgIOstore();
+        unsigned char *read(unsigned sector, unsigned bytes);
+        int write(unsigned sector, unsigned bytes, const unsigned char *data);
+        int stat(struct stat *st);
+        void interleave(unsigned tracks, unsigned sect_per_track);
+    private:
+        int read_at(uint64_t posn, unsigned char *ptr, unsigned bytes);
+        off_t posn(unsigned sector);
+        uint32_t    *chunks;
+        unsigned    count;
+        uint32_t    length;
+        struct stat index_st;
+        unsigned    tracks;
+        unsigned    sect_per_track;
+};
+
+#endif
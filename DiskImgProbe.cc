@@ -0,0 +1,305 @@
+#include "DiskImgProbe.h"
+#include "DiskImgIOlinear.h"
+#include "DiskImgIOinterleaved.h"
+#include "AcornADFS.h"
+#include "AcornADFSdisc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+typedef struct {
+    const unsigned char *buf;
+    size_t              len;
+    off_t               size;
+    const char          *ext;
+} probe_data;
+
+typedef int (*probe_func)(const probe_data *pd);
+
+/*
+ * Evidence for an old map: both free space map checksums, a sane end
+ * pointer and a "Hugo" root directory at sector 2.  Scores up to 70.
+ */
+
+static int oldmap_score(const probe_data *pd) {
+    const unsigned char *buf = pd->buf;
+    int score = 0;
+
+    if (pd->len < 0x700)
+        return 0;
+    if (AcornADFS::checksum((uint8_t *)buf) == buf[0xff])
+        score += 20;
+    if (AcornADFS::checksum((uint8_t *)buf + 0x100) == buf[0x1ff])
+        score += 20;
+    if (buf[0x1fe] % 3 == 0 && buf[0x1fe] <= FSMAP_MAX_ENT * 3)
+        score += 5;
+    if (memcmp(buf + 0x201, "Hugo", 4) == 0 && memcmp(buf + 0x200 + DIR_SIZE - 5, "Hugo", 4) == 0)
+        score += 25;
+    return score < 40 ? 0 : score;
+}
+
+static int oldmap_floppy(const probe_data *pd, uint32_t sectors) {
+    int score = oldmap_score(pd);
+
+    if (score == 0 || adfs_get24(pd->buf + 0xfc) != sectors)
+        return 0;
+    if (pd->size == (off_t)sectors * 256)
+        score += 20;
+    return score;
+}
+
+static int probe_adfs_s(const probe_data *pd) {
+    return oldmap_floppy(pd, 640);
+}
+
+static int probe_adfs_m(const probe_data *pd) {
+    return oldmap_floppy(pd, 1280);
+}
+
+/*
+ * The first track of an L format image reads the same whichever way
+ * the sides are stored, so the file extension breaks the tie: .adl
+ * files are conventionally interleaved.
+ */
+
+static int probe_adfs_l(const probe_data *pd) {
+    int score = oldmap_floppy(pd, 2560);
+
+    if (score && pd->ext && strcasecmp(pd->ext, "adl") == 0)
+        score -= 5;
+    return score;
+}
+
+static int probe_adfs_l_interleaved(const probe_data *pd) {
+    int score = oldmap_floppy(pd, 2560);
+
+    if (score && !(pd->ext && strcasecmp(pd->ext, "adl") == 0))
+        score -= 5;
+    return score;
+}
+
+static int probe_adfs_hard(const probe_data *pd) {
+    int score = oldmap_score(pd);
+    uint32_t sectors;
+
+    if (score == 0)
+        return 0;
+    sectors = adfs_get24(pd->buf + 0xfc);
+    if (sectors == 640 || sectors == 1280 || sectors == 2560)
+        return 0;
+    if (pd->size >= (off_t)sectors * 256)
+        score += 20;
+    return score;
+}
+
+/*
+ * A new map disc record: at byte 4 of the map for floppies and inside
+ * the boot block at 0xc00 for hard discs and F format.
+ */
+
+static int disc_record_ok(const unsigned char *rec) {
+    return rec[0] >= 8 && rec[0] <= 12 && rec[1] > 0 && rec[2] >= 1 && rec[2] <= 16
+        && rec[3] <= 8 && rec[4] >= 8 && rec[4] <= 21;
+}
+
+static int probe_adfs_newmap(const probe_data *pd) {
+    const unsigned char *buf = pd->buf;
+    int score = 0;
+
+    if (pd->len >= 0x1000 && disc_record_ok(buf + 0xdc0))
+        score = 60;
+    else if (pd->len >= 0x40 && disc_record_ok(buf + 4))
+        score = 50;
+    if (score && pd->len >= 0x805
+        && (memcmp(buf + 0x801, "Hugo", 4) == 0 || memcmp(buf + 0x801, "Nick", 4) == 0))
+        score += 20;
+    if (score && (pd->size == 819200 || pd->size == 1638400))
+        score += 10;
+    return score;
+}
+
+/*
+ * A DFS catalogue: printable names in sector 0 for as many entries as
+ * sector 1 claims, and a sector count of 400 or 800.
+ */
+
+static int dfs_cat_score(const unsigned char *cat) {
+    unsigned count = cat[0x105], sectors, i, j;
+    int score = 0;
+
+    if (count % 8 != 0 || count > 31 * 8)
+        return 0;
+    sectors = ((cat[0x106] & 3) << 8) | cat[0x107];
+    if (sectors == 400 || sectors == 800)
+        score += 30;
+    else if (sectors < 2)
+        return 0;
+    for (i = 8; i <= count; i += 8) {
+        for (j = 0; j < 8; j++) {
+            unsigned char ch = cat[i + j] & 0x7f;
+            if (ch < 0x20 || ch == 0x7f)
+                return 0;
+        }
+        if (((cat[0x100 + i + 6] & 3) << 8 | cat[0x100 + i + 7]) >= sectors)
+            return 0;
+    }
+    return score + (count ? 30 : 10);
+}
+
+static int probe_dfs_single(const probe_data *pd) {
+    int score;
+
+    if (pd->len < 0x200 || (score = dfs_cat_score(pd->buf)) == 0)
+        return 0;
+    if (pd->size <= 204800)
+        score += 20;
+    return score;
+}
+
+static int probe_dfs_double(const probe_data *pd) {
+    int score;
+
+    if (pd->len < 0xc00 || pd->size <= 102400 || (score = dfs_cat_score(pd->buf)) == 0)
+        return 0;
+    if (dfs_cat_score(pd->buf + 0xa00) == 0)
+        return 0;
+    return score + 30;
+}
+
+static int probe_compressed(const probe_data *pd) {
+    const unsigned char *buf = pd->buf;
+
+    if (pd->len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b)
+        return 90;
+    if (pd->len >= 4 && memcmp(buf, "PK\3\4", 4) == 0)
+        return 90;
+    if (pd->len >= 3 && memcmp(buf, "BZh", 3) == 0)
+        return 80;
+    if (pd->len >= 6 && memcmp(buf, "\xfd" "7zXZ\0", 6) == 0)
+        return 90;
+    return 0;
+}
+
+static const struct {
+    img_format format;
+    const char *name;
+    probe_func probe;
+    int        supported;
+} formats[] = {
+    { IMG_UNKNOWN,            "unknown",            NULL,                     0 },
+    { IMG_ADFS_S,             "adfs-s",             probe_adfs_s,             1 },
+    { IMG_ADFS_M,             "adfs-m",             probe_adfs_m,             1 },
+    { IMG_ADFS_L,             "adfs-l",             probe_adfs_l,             1 },
+    { IMG_ADFS_L_INTERLEAVED, "adfs-l-interleaved", probe_adfs_l_interleaved, 1 },
+    { IMG_ADFS_HARD,          "adfs-hard",          probe_adfs_hard,          1 },
+    { IMG_ADFS_NEWMAP,        "adfs-newmap",        probe_adfs_newmap,        0 },
+    { IMG_DFS_SINGLE,         "dfs-single",         probe_dfs_single,         0 },
+    { IMG_DFS_DOUBLE,         "dfs-double",         probe_dfs_double,         0 },
+    { IMG_COMPRESSED,         "compressed",         probe_compressed,         0 }
+};
+
+const char *DiskImgProbe::format_name(img_format format) {
+    if (format < IMG_MAX_FORMAT)
+        return formats[format].name;
+    return "invalid";
+}
+
+int DiskImgProbe::supported(img_format format) {
+    return format < IMG_MAX_FORMAT && formats[format].supported;
+}
+
+unsigned DiskImgProbe::probe_buf(const unsigned char *buf, size_t len, off_t size, const char *filename, img_guess *guesses, unsigned max) {
+    probe_data pd;
+    img_guess guess;
+    unsigned count = 0, i, j;
+    const char *ext;
+
+    pd.buf = buf;
+    pd.len = len;
+    pd.size = size;
+    pd.ext = NULL;
+    if (filename && (ext = strrchr(filename, '.')) && !strchr(ext, '/'))
+        pd.ext = ext + 1;
+    for (i = 1; i < IMG_MAX_FORMAT; i++) {
+        guess.format = formats[i].format;
+        if ((guess.score = formats[i].probe(&pd)) <= 0)
+            continue;
+        if (count < max)
+            count++;
+        else if (max == 0 || guesses[max-1].score >= guess.score)
+            continue;
+        for (j = count - 1; j > 0 && guesses[j-1].score < guess.score; j--)
+            guesses[j] = guesses[j-1];
+        guesses[j] = guess;
+    }
+    return count;
+}
+
+unsigned DiskImgProbe::probe_fd(int fd, const char *filename, img_guess *guesses, unsigned max) {
+    unsigned char buf[PROBE_SIZE];
+    struct stat st;
+    ssize_t got;
+
+    if (fstat(fd, &st) != 0 || (got = pread(fd, buf, sizeof(buf), 0)) < 0)
+        return 0;
+    return probe_buf(buf, got, st.st_size, filename, guesses, max);
+}
+
+unsigned DiskImgProbe::probe(const char *filename, img_guess *guesses, unsigned max) {
+    unsigned count;
+    int fd;
+
+    if ((fd = ::open(filename, O_RDONLY)) < 0)
+        return 0;
+    count = probe_fd(fd, filename, guesses, max);
+    ::close(fd);
+    return count;
+}
+
+DiskImgIO *DiskImgProbe::open_as(FILE *fp, img_format format) {
+    if (format == IMG_ADFS_L_INTERLEAVED)
+        return new DiskImgIOinterleaved(fp, 80, 16);
+    return new DiskImgIOlinear(fp);
+}
+
+/*
+ * Open an image as its best supported guess.  Fails with EMEDIUMTYPE
+ * if no supported format matches.
+ */
+
+DiskImgIO *DiskImgProbe::open(const char *filename, int writable, img_format *format) {
+    img_guess guesses[PROBE_MAX_GUESS];
+    unsigned count, i;
+    FILE *fp;
+
+    if ((fp = fopen(filename, writable ? "rb+" : "rb")) == NULL)
+        return NULL;
+    count = probe_fd(fileno(fp), filename, guesses, PROBE_MAX_GUESS);
+    for (i = 0; i < count; i++) {
+        if (formats[guesses[i].format].supported) {
+            if (format)
+                *format = guesses[i].format;
+            return open_as(fp, guesses[i].format);
+        }
+    }
+    fclose(fp);
+    errno = EMEDIUMTYPE;
+    return NULL;
+}
+
+AcornFS *DiskImgProbe::mount(DiskImgIO *dio, img_format format) {
+    switch (format) {
+        case IMG_ADFS_S:
+        case IMG_ADFS_M:
+        case IMG_ADFS_L:
+        case IMG_ADFS_L_INTERLEAVED:
+        case IMG_ADFS_HARD:
+            return new AcornADFS(dio);
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef DiskImgProbe_INC
+#define DiskImgProbe_INC
+
+#include "DiskImgIO.h"
+#include "AcornFS.h"
+
+#include <sys/types.h>
+
+#define PROBE_SIZE       4096
+#define PROBE_MAX_GUESS  8
+
+typedef enum {
+    IMG_UNKNOWN,
+    IMG_ADFS_S,
+    IMG_ADFS_M,
+    IMG_ADFS_L,
+    IMG_ADFS_L_INTERLEAVED,
+    IMG_ADFS_HARD,
+    IMG_ADFS_NEWMAP,
+    IMG_DFS_SINGLE,
+    IMG_DFS_DOUBLE,
+    IMG_COMPRESSED,
+    IMG_MAX_FORMAT
+} img_format;
+
+typedef struct {
+    img_format format;
+    int        score;
+} img_guess;
+
+/*
+ * Classify disc images from their size and the first PROBE_SIZE bytes
+ * so an archive can be triaged with one small read per image.  Each
+ * registered format scores the evidence from 0 to 100 and the guesses
+ * come back best first.
+ */
+
+class DiskImgProbe {
+    public:
+        static unsigned probe(const char *filename, img_guess *guesses, unsigned max);
+        static unsigned probe_fd(int fd, const char *filename, img_guess *guesses, unsigned max);
+        static unsigned probe_buf(const unsigned char *buf, size_t len, off_t size, const char *filename, img_guess *guesses, unsigned max);
+        static const char *format_name(img_format format);
+        static int supported(img_format format);
+        static DiskImgIO *open(const char *filename, int writable, img_format *format);
+        static DiskImgIO *open_as(FILE *fp, img_format format);
+        static AcornFS *mount(DiskImgIO *dio, img_format format);
+};
+
+#endif
@@ -0,0 +1,455 @@
+#include "HostMirror.h"
+#include "Sha256.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * State file lines, numbers in hex:
+ *   D <path> <sector> <length> <sequence> <hash>
+ *   F <path> <sector> <length> <load> <exec> <attributes> <sha256>
+ * separated by tabs.
+ */
+
+struct hm_ent {
+    char          *path;
+    char          type;
+    int           seen;
+    uint32_t      sector;
+    uint32_t      length;
+    uint32_t      load_addr;
+    uint32_t      exec_addr;
+    uint32_t      attr;     // sequence number for a directory.
+    uint32_t      hash;
+    unsigned char sha[SHA256_SIZE];
+    unsigned      child;    // first child, or ~0u.
+    unsigned      sibling;
+};
+
+struct hm_file {
+    char   *path;
+    char   *host;
+    hm_ent *old;
+};
+
+static uint32_t path_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+
+    while (*path)
+        hash = (hash ^ (unsigned char)*path++) * 16777619u;
+    return hash;
+}
+
+static uint32_t obj_attr(const afs_object *obj) {
+    return obj->user_read | obj->user_write << 1 | obj->locked << 2 | obj->user_exec << 3
+        | obj->pub_read << 4 | obj->pub_write << 5 | obj->pub_exec << 6 | obj->priv << 7;
+}
+
+static void sha_hex(const unsigned char *sha, char *hex) {
+    unsigned i;
+
+    for (i = 0; i < SHA256_SIZE; i++)
+        sprintf(hex + i * 2, "%02x", sha[i]);
+}
+
+static int sha_parse(const char *hex, unsigned char *sha) {
+    unsigned i, byte;
+
+    for (i = 0; i < SHA256_SIZE; i++) {
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return 0;
+        sha[i] = byte;
+    }
+    return 1;
+}
+
+HostMirror::HostMirror(AcornADFS *adfs, const char *host_dir) {
+    this->adfs = adfs;
+    dir = strdup(host_dir);
+    state_name = state_tmp = NULL;
+    state = NULL;
+    text = NULL;
+    ents = NULL;
+    index = NULL;
+    count = mask = 0;
+    files = NULL;
+    pending = NULL;
+    nfiles = alloc = 0;
+    error = NULL;
+    written = kept = deleted = dirs_skipped = 0;
+}
+
+HostMirror::~HostMirror() {
+    if (state) {
+        fclose(state);
+        unlink(state_tmp);
+    }
+    while (nfiles > 0) {
+        nfiles--;
+        free(pending[nfiles].path);
+        free(pending[nfiles].host);
+    }
+    free(pending);
+    free(files);
+    free(index);
+    free(ents);
+    free(text);
+    free(state_tmp);
+    free(state_name);
+    free(dir);
+}
+
+/*
+ * Read the state left by the previous run, if any, and link each entry
+ * to its parent directory's list of children.
+ */
+
+int HostMirror::load() {
+    char *line, *next, *parent;
+    unsigned lines, slot, i;
+    struct stat st;
+    hm_ent *ent, *up;
+    ssize_t got;
+    int fd, fields, err = 0;
+    char sha[SHA256_HEX];
+
+    if (dir == NULL || asprintf(&state_name, "%s/%s", dir, MIRROR_STATE_NAME) < 0) {
+        state_name = NULL;
+        return ENOMEM;
+    }
+    if ((fd = open(state_name, O_RDONLY)) < 0)
+        return errno == ENOENT ? 0 : errno;
+    if (fstat(fd, &st) != 0 || (text = (char *)malloc(st.st_size + 1)) == NULL)
+        err = errno ? errno : ENOMEM;
+    else if ((got = read(fd, text, st.st_size)) != st.st_size)
+        err = got < 0 ? errno : EIO;
+    close(fd);
+    if (err)
+        return err;
+    text[st.st_size] = '\0';
+    for (lines = 0, line = text; (line = strchr(line, '\n')); line++)
+        lines++;
+    for (mask = 16; mask < lines * 2; mask <<= 1)
+        ;
+    ents = (hm_ent *)calloc(lines + 1, sizeof(hm_ent));
+    index = (unsigned *)malloc(mask * sizeof(unsigned));
+    if (ents == NULL || index == NULL)
+        return ENOMEM;
+    memset(index, 0xff, mask * sizeof(unsigned));
+    mask--;
+    for (line = text; *line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+        ent = ents + count;
+        if ((line[0] != 'D' && line[0] != 'F') || line[1] != '\t')
+            continue;
+        ent->type = line[0];
+        ent->path = line + 2;
+        if ((line = strchr(ent->path, '\t')) == NULL)
+            continue;
+        *line++ = '\0';
+        if (ent->type == 'D')
+            fields = sscanf(line, "%X\t%X\t%X\t%X", &ent->sector, &ent->length, &ent->attr, &ent->hash) == 4;
+        else
+            fields = sscanf(line, "%X\t%X\t%X\t%X\t%X\t%64s", &ent->sector, &ent->length, &ent->load_addr, &ent->exec_addr, &ent->attr, sha) == 6
+                && sha_parse(sha, ent->sha);
+        if (!fields || lookup(ent->path))
+            continue;
+        ent->child = ent->sibling = ~0u;
+        for (slot = path_hash(ent->path) & mask; index[slot] != ~0u; slot = (slot + 1) & mask)
+            ;
+        index[slot] = count++;
+    }
+    for (i = 0; i < count; i++) {
+        if ((parent = strrchr(ents[i].path, '.')) == NULL)
+            continue;
+        *parent = '\0';
+        up = lookup(ents[i].path);
+        *parent = '.';
+        if (up && up->type == 'D') {
+            ents[i].sibling = up->child;
+            up->child = i;
+        }
+    }
+    return 0;
+}
+
+hm_ent *HostMirror::lookup(const char *path) {
+    unsigned slot;
+
+    if (index == NULL)
+        return NULL;
+    for (slot = path_hash(path) & mask; index[slot] != ~0u; slot = (slot + 1) & mask)
+        if (strcmp(ents[index[slot]].path, path) == 0)
+            return ents + index[slot];
+    return NULL;
+}
+
+afs_status HostMirror::host_error(const char *what, const char *name, int err) {
+    if (asprintf(error, "unable to %s '%s': %s", what, name, strerror(err)) < 0)
+        *error = NULL;
+    return AFS_HOST_ERROR;
+}
+
+/*
+ * Take away what an old entry left on the host, a whole tree for a
+ * directory, and mark it dealt with.
+ */
+
+afs_status HostMirror::remove_old(hm_ent *ent) {
+    afs_status status = AFS_OK;
+    unsigned i;
+    char *host, *inf;
+
+    if (ent->seen)
+        return AFS_OK;
+    ent->seen = 1;
+    if (ent->type == 'D')
+        for (i = ent->child; status == AFS_OK && i != ~0u; i = ents[i].sibling)
+            status = remove_old(ents + i);
+    if (status != AFS_OK)
+        return status;
+    if ((host = AcornFS::host_path(dir, ent->path)) == NULL)
+        return AFS_NO_MEMORY;
+    if (ent->type == 'D') {
+        if (rmdir(host) != 0 && errno != ENOENT && errno != ENOTEMPTY)
+            status = host_error("remove", host, errno);
+    }
+    else if (unlink(host) != 0 && errno != ENOENT)
+        status = host_error("remove", host, errno);
+    else if (asprintf(&inf, "%s.inf", host) < 0)
+        status = AFS_NO_MEMORY;
+    else {
+        unlink(inf);
+        free(inf);
+    }
+    if (status == AFS_OK)
+        deleted++;
+    free(host);
+    return status;
+}
+
+static int remove_ent(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/*
+ * Clear away a directory on the host, whatever is in it, so a file of
+ * the same name can take its place.
+ */
+
+afs_status HostMirror::remove_tree(const char *path) {
+    afs_status status = AFS_OK;
+    char *host;
+
+    if ((host = AcornFS::host_path(dir, path)) == NULL)
+        return AFS_NO_MEMORY;
+    if (nftw(host, remove_ent, 16, FTW_DEPTH | FTW_PHYS) != 0 && errno != ENOENT)
+        status = host_error("remove", host, errno);
+    free(host);
+    return status;
+}
+
+// Carry a file over from the last run without reading it.
+void HostMirror::keep_file(hm_ent *ent) {
+    char sha[SHA256_HEX];
+
+    ent->seen = 1;
+    sha_hex(ent->sha, sha);
+    fprintf(state, "F\t%s\t%X\t%X\t%X\t%X\t%X\t%s\n", ent->path, ent->sector, ent->length,
+            ent->load_addr, ent->exec_addr, ent->attr, sha);
+    kept++;
+}
+
+afs_status HostMirror::add_file(afs_object *obj, const char *path, hm_ent *old) {
+    afs_object *new_files;
+    hm_file *new_pending;
+    hm_file *file;
+
+    if (nfiles == alloc) {
+        alloc = alloc ? alloc * 2 : 64;
+        new_files = (afs_object *)realloc(files, alloc * sizeof(afs_object));
+        if (new_files)
+            files = new_files;
+        new_pending = (hm_file *)realloc(pending, alloc * sizeof(hm_file));
+        if (new_pending)
+            pending = new_pending;
+        if (new_files == NULL || new_pending == NULL)
+            return AFS_NO_MEMORY;
+    }
+    file = pending + nfiles;
+    file->old = old;
+    file->path = strdup(path);
+    file->host = AcornFS::host_path(dir, path);
+    if (file->path == NULL || file->host == NULL) {
+        free(file->path);
+        free(file->host);
+        return AFS_NO_MEMORY;
+    }
+    files[nfiles++] = *obj;
+    return AFS_OK;
+}
+
+/*
+ * Bring one directory up to date.  If its stamp matches the last run
+ * its files are carried over as they were and only its subdirectories
+ * are looked at; otherwise it is listed, files whose entry is the same
+ * as last time are carried over and the rest are queued to be read and
+ * compared.
+ */
+
+afs_status HostMirror::sync_dir(afs_object *dir_obj, const char *path) {
+    afs_status status;
+    afs_object *list, child;
+    unsigned seq, nents, i;
+    uint32_t hash;
+    hm_ent *old, *ent;
+    char *host, *sub;
+
+    if ((status = adfs->stamp(dir_obj, &seq, &hash)) != AFS_OK)
+        return status;
+    if ((old = lookup(path)) && old->type != 'D' && (status = remove_old(old)) != AFS_OK)
+        return status;
+    if ((host = AcornFS::host_path(dir, path)) == NULL)
+        return AFS_NO_MEMORY;
+    if (mkdir(host, 0777) != 0 && errno != EEXIST)
+        status = host_error("create", host, errno);
+    free(host);
+    if (status != AFS_OK)
+        return status;
+    fprintf(state, "D\t%s\t%X\t%X\t%X\t%X\n", path, dir_obj->sector, dir_obj->length, seq, hash);
+
+    if (old && old->type == 'D' && old->sector == dir_obj->sector && old->length == dir_obj->length
+        && old->attr == seq && old->hash == hash) {
+        old->seen = 1;
+        dirs_skipped++;
+        for (i = old->child; status == AFS_OK && i != ~0u; i = ent->sibling) {
+            ent = ents + i;
+            if (ent->type == 'D') {
+                memset(&child, 0, sizeof(child));
+                child.is_dir = 1;
+                child.sector = ent->sector;
+                child.length = ent->length;
+                status = sync_dir(&child, ent->path);
+            }
+            else
+                keep_file(ent);
+        }
+        return status;
+    }
+    if (old)
+        old->seen = 1;
+    if ((status = adfs->list(dir_obj, &list, &nents)) != AFS_OK)
+        return status;
+    for (i = 0; status == AFS_OK && i < nents; i++) {
+        if (asprintf(&sub, "%s.%s", path, list[i].name) < 0) {
+            status = AFS_NO_MEMORY;
+            break;
+        }
+        ent = lookup(sub);
+        if (list[i].is_dir)
+            status = sync_dir(list + i, sub);
+        else if (ent && ent->type == 'D') {
+            if ((status = remove_old(ent)) == AFS_OK && (status = remove_tree(sub)) == AFS_OK)
+                status = add_file(list + i, sub, NULL);
+        }
+        else if (ent && ent->sector == list[i].sector && ent->length == list[i].length
+                 && ent->load_addr == list[i].load_addr && ent->exec_addr == list[i].exec_addr
+                 && ent->attr == obj_attr(list + i))
+            keep_file(ent);
+        else
+            status = add_file(list + i, sub, ent);
+        free(sub);
+    }
+    free(list);
+    return status;
+}
+
+/*
+ * Extraction callback: a file is only written if it is new or its
+ * entry or content differs from the last run.
+ */
+
+afs_status HostMirror::save_file(void *ctx, unsigned index, afs_object *obj) {
+    HostMirror *hm = (HostMirror *)ctx;
+    hm_file *file = hm->pending + index;
+    hm_ent *old = file->old;
+    unsigned char sha[SHA256_SIZE];
+    char hex[SHA256_HEX];
+    sha256_ctx sc;
+    int err;
+
+    sha256_init(&sc);
+    sha256_update(&sc, obj->data, obj->length);
+    sha256_final(&sc, sha);
+    if (old)
+        old->seen = 1;
+    if (old && old->sector == obj->sector && old->length == obj->length && old->load_addr == obj->load_addr
+        && old->exec_addr == obj->exec_addr && old->attr == obj_attr(obj) && memcmp(old->sha, sha, SHA256_SIZE) == 0)
+        hm->kept++;
+    else if ((err = AcornFS::host_save(obj, file->host)) == 0)
+        hm->written++;
+    else {
+        hm->adfs->obj_free(obj);
+        return hm->host_error("write", file->host, err);
+    }
+    hm->adfs->obj_free(obj);
+    sha_hex(sha, hex);
+    fprintf(hm->state, "F\t%s\t%X\t%X\t%X\t%X\t%X\t%s\n", file->path, obj->sector, obj->length,
+            obj->load_addr, obj->exec_addr, obj_attr(obj), hex);
+    return AFS_OK;
+}
+
+/*
+ * Bring the host tree up to date with the image.  The new state is
+ * written alongside the old one and only replaces it in finish(), so a
+ * failed run is simply repeated.  On a host error *error describes it.
+ */
+
+afs_status HostMirror::run(char **error) {
+    afs_status status;
+    afs_object root;
+    unsigned i;
+    int fd;
+
+    this->error = error;
+    *error = NULL;
+    if (state_name == NULL || asprintf(&state_tmp, "%s.XXXXXX", state_name) < 0) {
+        state_tmp = NULL;
+        return AFS_NO_MEMORY;
+    }
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return host_error("create", dir, errno);
+    if ((fd = mkstemp(state_tmp)) < 0 || (state = fdopen(fd, "w")) == NULL)
+        return host_error("create", state_tmp, errno);
+    if ((status = adfs->find("$", &root)) == AFS_OK
+        && (status = sync_dir(&root, "$")) == AFS_OK)
+        status = adfs->extract(files, nfiles, save_file, this);
+    for (i = count; status == AFS_OK && i-- > 0;)
+        status = remove_old(ents + i);
+    return status;
+}
+
+int HostMirror::finish() {
+    int err = 0;
+
+    if (state == NULL)
+        return EINVAL;
+    if (fflush(state) != 0 || fsync(fileno(state)) != 0)
+        err = errno;
+    if (fclose(state) != 0 && err == 0)
+        err = errno;
+    state = NULL;
+    if (err == 0 && rename(state_tmp, state_name) != 0)
+        err = errno;
+    if (err)
+        unlink(state_tmp);
+    return err;
+}
@@ -0,0 +1,62 @@
+#ifndef HOST_MIRROR_INC
+#define HOST_MIRROR_INC
+
+#include "AcornADFS.h"
+
+#define MIRROR_STATE_NAME ".acorn.sync"
+
+typedef struct hm_ent hm_ent;
+typedef struct hm_file hm_file;
+
+/*
+ * Keep a host tree in step with an image from one run to the next.
+ * MIRROR_STATE_NAME at the top of the tree records every directory
+ * with its sector, master sequence number and a hash of its contents,
+ * and every file with its sector, length, addresses, attributes and
+ * SHA-256.  A directory whose stamp is unchanged is not listed and its
+ * files are not read; in one that has changed only files whose entry
+ * differs are read, and only those whose content also differs are
+ * written.  Like a size and mtime check, a file rewritten in place
+ * with an identical entry is not noticed until the state is removed.  Anything no longer on the image is
+ * removed from the host.  Attributes go in .inf files or xattrs as
+ * AcornFS::host_save does.
+ */
+
+class HostMirror {
+    public:
+        HostMirror(AcornADFS *adfs, const char *host_dir);
+        ~HostMirror();
+        int load();
+        afs_status run(char **error);
+        int finish();
+        unsigned written;
+        unsigned kept;
+        unsigned deleted;
+        unsigned dirs_skipped;
+    private:
+        hm_ent *lookup(const char *path);
+        afs_status sync_dir(afs_object *dir, const char *path);
+        afs_status add_file(afs_object *obj, const char *path, hm_ent *old);
+        afs_status remove_old(hm_ent *ent);
+        afs_status remove_tree(const char *path);
+        void keep_file(hm_ent *ent);
+        afs_status host_error(const char *what, const char *name, int err);
+        static afs_status save_file(void *ctx, unsigned index, afs_object *obj);
+        AcornADFS  *adfs;
+        char       *dir;
+        char       *state_name;
+        char       *state_tmp;
+        FILE       *state;
+        char       *text;
+        hm_ent     *ents;
+        unsigned   count;
+        unsigned   *index;
+        unsigned   mask;
+        afs_object *files;
+        hm_file    *pending;
+        unsigned   nfiles;
+        unsigned   alloc;
+        char       **error;
+};
+
+#endif
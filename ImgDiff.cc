@@ -0,0 +1,205 @@
+#include "ImgDiff.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIFF_SECT_SIZE 256
+#define DIFF_CHUNK     4096
+#define DIFF_MAGIC     "ADFSDIFF"
+#define DIFF_VERSION   1
+#define DIFF_HDR_SIZE  (8 + 4 * 3 + SHA256_SIZE)
+
+/*
+ * Patch layout, all numbers little endian:
+ *   "ADFSDIFF", version, old sectors, new sectors, SHA-256 of old
+ *   then runs of: start sector, sector count, data
+ *   ending with a run of zero sectors.
+ */
+
+static void put32(unsigned char *base, uint32_t value) {
+    base[0] = value;
+    base[1] = value >> 8;
+    base[2] = value >> 16;
+    base[3] = value >> 24;
+}
+
+static uint32_t get32(const unsigned char *base) {
+    return base[0] | (base[1] << 8) | (base[2] << 16) | ((uint32_t)base[3] << 24);
+}
+
+static unsigned img_sectors(DiskImgIO *dio) {
+    struct stat st;
+
+    if (dio->stat(&st) != 0)
+        return 0;
+    return st.st_size / DIFF_SECT_SIZE;
+}
+
+ImgDiff::ImgDiff() {
+    bitmap = NULL;
+    sectors = sectors_changed = old_sectors = 0;
+    memset(old_hash, 0, sizeof(old_hash));
+}
+
+ImgDiff::~ImgDiff() {
+    free(bitmap);
+}
+
+/*
+ * Both images are read a chunk at a time; a chunk which compares equal
+ * as a whole, as most do, costs one memcmp and only chunks that differ
+ * are compared sector by sector.  Sectors beyond the end of the old
+ * image all count as changed.  The old image is hashed on the way.
+ */
+
+int ImgDiff::compare(DiskImgIO *old_img, DiskImgIO *new_img) {
+    unsigned char *old_data, *new_data;
+    unsigned sect, count, i, total;
+    sha256_ctx ctx;
+    int err = 0;
+
+    sectors = img_sectors(new_img);
+    old_sectors = img_sectors(old_img);
+    sectors_changed = 0;
+    free(bitmap);
+    if ((bitmap = (unsigned char *)calloc(sectors / 8 + 1, 1)) == NULL)
+        return ENOMEM;
+    total = sectors > old_sectors ? sectors : old_sectors;
+    sha256_init(&ctx);
+    for (sect = 0; err == 0 && sect < total; sect += count) {
+        count = total - sect < DIFF_CHUNK ? total - sect : DIFF_CHUNK;
+        old_data = new_data = NULL;
+        if (sect < old_sectors) {
+            i = old_sectors - sect < count ? old_sectors - sect : count;
+            if ((old_data = old_img->read(sect, i * DIFF_SECT_SIZE)) == NULL)
+                err = errno ? errno : EIO;
+            else
+                sha256_update(&ctx, old_data, i * DIFF_SECT_SIZE);
+        }
+        if (err == 0 && sect < sectors) {
+            i = sectors - sect < count ? sectors - sect : count;
+            if ((new_data = new_img->read(sect, i * DIFF_SECT_SIZE)) == NULL)
+                err = errno ? errno : EIO;
+        }
+        if (err == 0 && new_data) {
+            i = sectors - sect < count ? sectors - sect : count;
+            if (old_data == NULL || sect + i > old_sectors || memcmp(old_data, new_data, i * DIFF_SECT_SIZE) != 0) {
+                for (i = 0; i < count && sect + i < sectors; i++) {
+                    if (sect + i >= old_sectors || memcmp(old_data + i * DIFF_SECT_SIZE, new_data + i * DIFF_SECT_SIZE, DIFF_SECT_SIZE) != 0) {
+                        bitmap[(sect + i) >> 3] |= 1 << ((sect + i) & 7);
+                        sectors_changed++;
+                    }
+                }
+            }
+        }
+        if (old_data)
+            old_img->dio_free(old_data);
+        if (new_data)
+            new_img->dio_free(new_data);
+    }
+    sha256_final(&ctx, old_hash);
+    return err;
+}
+
+/*
+ * True if any of count sectors from sector differ.
+ */
+
+int ImgDiff::changed(unsigned sector, unsigned count) {
+    for (; count > 0 && sector < sectors; sector++, count--)
+        if (bitmap[sector >> 3] & (1 << (sector & 7)))
+            return 1;
+    return 0;
+}
+
+int ImgDiff::write_patch(FILE *fp, DiskImgIO *new_img) {
+    unsigned char hdr[DIFF_HDR_SIZE], *data;
+    unsigned start, end;
+    int err = 0;
+
+    memcpy(hdr, DIFF_MAGIC, 8);
+    put32(hdr + 8, DIFF_VERSION);
+    put32(hdr + 12, old_sectors);
+    put32(hdr + 16, sectors);
+    memcpy(hdr + 20, old_hash, SHA256_SIZE);
+    if (fwrite(hdr, DIFF_HDR_SIZE, 1, fp) != 1)
+        return errno ? errno : EIO;
+    for (start = 0; err == 0 && start < sectors; start = end) {
+        if (!changed(start, 1)) {
+            end = start + 1;
+            continue;
+        }
+        for (end = start + 1; end < sectors && end - start < DIFF_CHUNK && changed(end, 1); end++)
+            ;
+        if ((data = new_img->read(start, (end - start) * DIFF_SECT_SIZE)) == NULL)
+            return errno ? errno : EIO;
+        put32(hdr, start);
+        put32(hdr + 4, end - start);
+        if (fwrite(hdr, 8, 1, fp) != 1 || fwrite(data, (end - start) * DIFF_SECT_SIZE, 1, fp) != 1)
+            err = errno ? errno : EIO;
+        new_img->dio_free(data);
+    }
+    memset(hdr, 0, 8);
+    if (err == 0 && (fwrite(hdr, 8, 1, fp) != 1 || fflush(fp) != 0))
+        err = errno ? errno : EIO;
+    return err;
+}
+
+int ImgDiff::hash_image(DiskImgIO *dio, unsigned sectors, unsigned char *digest) {
+    unsigned char *data;
+    unsigned sect, count;
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    for (sect = 0; sect < sectors; sect += count) {
+        count = sectors - sect < DIFF_CHUNK ? sectors - sect : DIFF_CHUNK;
+        if ((data = dio->read(sect, count * DIFF_SECT_SIZE)) == NULL)
+            return errno ? errno : EIO;
+        sha256_update(&ctx, data, count * DIFF_SECT_SIZE);
+        dio->dio_free(data);
+    }
+    sha256_final(&ctx, digest);
+    return 0;
+}
+
+/*
+ * Replay a patch onto an image.  Returns -1 if the image is not the
+ * one the patch was made from, otherwise 0 or an errno value.  An
+ * image that shrank is not truncated; the tail is left as it was.
+ */
+
+int ImgDiff::apply(DiskImgIO *dio, FILE *fp) {
+    unsigned char hdr[DIFF_HDR_SIZE], digest[SHA256_SIZE], *data;
+    unsigned start, count, target;
+    int err;
+
+    if (fread(hdr, DIFF_HDR_SIZE, 1, fp) != 1 || memcmp(hdr, DIFF_MAGIC, 8) != 0 || get32(hdr + 8) != DIFF_VERSION)
+        return EINVAL;
+    if (img_sectors(dio) != get32(hdr + 12))
+        return -1;
+    if ((err = hash_image(dio, get32(hdr + 12), digest)) != 0)
+        return err;
+    if (memcmp(digest, hdr + 20, SHA256_SIZE) != 0)
+        return -1;
+    target = get32(hdr + 16);
+    for (;;) {
+        if (fread(hdr, 8, 1, fp) != 1)
+            return EINVAL;
+        start = get32(hdr);
+        if ((count = get32(hdr + 4)) == 0)
+            break;
+        if (count > DIFF_CHUNK || start + count > target)
+            return EINVAL;
+        if ((data = (unsigned char *)malloc(count * DIFF_SECT_SIZE)) == NULL)
+            return ENOMEM;
+        if (fread(data, count * DIFF_SECT_SIZE, 1, fp) != 1)
+            err = EINVAL;
+        else
+            err = dio->write(start, count * DIFF_SECT_SIZE, data);
+        free(data);
+        if (err)
+            return err;
+    }
+    return 0;
+}
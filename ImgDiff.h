@@ -0,0 +1,33 @@
+#ifndef IMG_DIFF_INC
+#define IMG_DIFF_INC
+
+#include "DiskImgIO.h"
+#include "Sha256.h"
+
+#include <stdio.h>
+
+/*
+ * Sector level comparison of two revisions of an image, and a patch
+ * format carrying just the changed sectors.  A patch records the size
+ * and SHA-256 of the image it was made from and is only applied to an
+ * identical one.
+ */
+
+class ImgDiff {
+    public:
+        ImgDiff();
+        ~ImgDiff();
+        int compare(DiskImgIO *old_img, DiskImgIO *new_img);
+        int changed(unsigned sector, unsigned count);
+        int write_patch(FILE *fp, DiskImgIO *new_img);
+        static int apply(DiskImgIO *dio, FILE *fp);
+        unsigned sectors;
+        unsigned sectors_changed;
+    private:
+        static int hash_image(DiskImgIO *dio, unsigned sectors, unsigned char *digest);
+        unsigned char *bitmap;
+        unsigned      old_sectors;
+        unsigned char old_hash[SHA256_SIZE];
+};
+
+#endif
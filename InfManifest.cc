@@ -0,0 +1,202 @@
+#include "InfManifest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct inf_entry {
+    const char *path;
+    afs_object attr;
+};
+
+static uint32_t path_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+
+    while (*path)
+        hash = (hash ^ (unsigned char)*path++) * 16777619u;
+    return hash;
+}
+
+InfManifest::InfManifest(const char *host_dir) {
+    dir = strdup(host_dir);
+    dir_len = dir ? strlen(dir) : 0;
+    fp = NULL;
+    text = NULL;
+    ents = NULL;
+    index = NULL;
+    count = mask = 0;
+}
+
+InfManifest::~InfManifest() {
+    if (fp)
+        finish();
+    free(index);
+    free(ents);
+    free(text);
+    free(dir);
+}
+
+const char *InfManifest::relative(const char *host_name) {
+    if (strncmp(host_name, dir, dir_len) == 0 && host_name[dir_len] == '/')
+        return host_name + dir_len + 1;
+    return host_name;
+}
+
+/*
+ * Parse one sidecar style line, as AcornFS::parse_attr does but
+ * working on memory rather than a stream.
+ */
+
+static int parse_line(char *ptr, afs_object *obj) {
+    char *name;
+    size_t len;
+
+    memset(obj, 0, sizeof(*obj));
+    ptr += strspn(ptr, " \t");
+    name = ptr;
+    ptr += strcspn(ptr, " \t");
+    if ((len = ptr - name) == 0 || len >= ACORN_FS_MAX_NAME)
+        return 0;
+    memcpy(obj->name, name, len);
+    obj->load_addr = strtoul(ptr, &ptr, 16);
+    obj->exec_addr = strtoul(ptr, &ptr, 16);
+    obj->length = strtoul(ptr, &ptr, 16);
+    ptr += strspn(ptr, " \t");
+    if (*ptr == 'L') {
+        obj->locked = 1;
+        ptr++;
+    }
+    if (strlen(ptr) < 8)
+        return 0;
+    obj->is_dir     = (ptr[0] == 'D');
+    obj->user_read  = (ptr[1] == 'R');
+    obj->user_write = (ptr[2] == 'W');
+    obj->user_exec  = (ptr[3] == 'E');
+    obj->pub_read   = (ptr[4] == 'R');
+    obj->pub_write  = (ptr[5] == 'W');
+    obj->pub_exec   = (ptr[6] == 'E');
+    obj->priv       = (ptr[7] == 'P');
+    return 1;
+}
+
+/*
+ * Read the whole manifest with a single read and index it.  Returns
+ * ENOENT if the directory has none, which is not an error as far as
+ * callers are concerned: the sidecars are used instead.
+ */
+
+int InfManifest::load() {
+    char *name, *line, *next, *tab;
+    unsigned lines, slot;
+    struct stat st;
+    ssize_t got;
+    int fd, err = 0;
+
+    if ((name = (char *)malloc(dir_len + sizeof(INF_MANIFEST_NAME) + 1)) == NULL)
+        return ENOMEM;
+    sprintf(name, "%s/%s", dir, INF_MANIFEST_NAME);
+    fd = open(name, O_RDONLY);
+    free(name);
+    if (fd < 0)
+        return errno;
+    if (fstat(fd, &st) != 0 || (text = (char *)malloc(st.st_size + 1)) == NULL)
+        err = errno ? errno : ENOMEM;
+    else if ((got = read(fd, text, st.st_size)) != st.st_size)
+        err = got < 0 ? errno : EIO;
+    close(fd);
+    if (err)
+        return err;
+    text[st.st_size] = '\0';
+    for (lines = 0, line = text; (line = strchr(line, '\n')); line++)
+        lines++;
+    for (mask = 16; mask < lines * 2; mask <<= 1)
+        ;
+    ents = (inf_entry *)malloc((lines + 1) * sizeof(inf_entry));
+    index = (unsigned *)malloc(mask * sizeof(unsigned));
+    if (ents == NULL || index == NULL)
+        return ENOMEM;
+    memset(index, 0xff, mask * sizeof(unsigned));
+    mask--;
+    for (line = text; *line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+        if ((tab = strchr(line, '\t')) == NULL)
+            continue;
+        *tab = '\0';
+        if (!parse_line(tab + 1, &ents[count].attr))
+            continue;
+        ents[count].path = line;
+        for (slot = path_hash(line) & mask; index[slot] != ~0u; slot = (slot + 1) & mask)
+            ;
+        index[slot] = count++;
+    }
+    return 0;
+}
+
+/*
+ * Fill in the attributes for a host file from the manifest.  The
+ * length is left alone as it comes from the file itself.  Returns 1
+ * if the file was found.
+ */
+
+int InfManifest::lookup(const char *host_name, afs_object *obj) {
+    const char *path = relative(host_name);
+    unsigned slot, length;
+
+    if (index == NULL)
+        return 0;
+    for (slot = path_hash(path) & mask; index[slot] != ~0u; slot = (slot + 1) & mask) {
+        if (strcmp(ents[index[slot]].path, path) == 0) {
+            length = obj->length;
+            *obj = ents[index[slot]].attr;
+            obj->length = length;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int InfManifest::create() {
+    char *name;
+
+    if ((name = (char *)malloc(dir_len + sizeof(INF_MANIFEST_NAME) + 1)) == NULL)
+        return ENOMEM;
+    sprintf(name, "%s/%s", dir, INF_MANIFEST_NAME);
+    fp = fopen(name, "wt");
+    free(name);
+    return fp ? 0 : errno;
+}
+
+/*
+ * Append the attributes for a host file.  A path holding a tab or a
+ * newline could not be read back, so it is refused with EINVAL; EBADF
+ * means create() was not called or failed.
+ */
+
+int InfManifest::add(const char *host_name, afs_object *obj) {
+    const char *path = relative(host_name);
+
+    if (fp == NULL)
+        return EBADF;
+    if (strpbrk(path, "\t\n"))
+        return EINVAL;
+    fprintf(fp, "%s\t", path);
+    AcornFS::print_attr(obj, fp);
+    return ferror(fp) ? EIO : 0;
+}
+
+int InfManifest::finish() {
+    int err = 0;
+
+    if (fp) {
+        if (fclose(fp) != 0)
+            err = errno;
+        fp = NULL;
+    }
+    return err;
+}
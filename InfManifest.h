@@ -0,0 +1,39 @@
+#ifndef INF_MANIFEST_INC
+#define INF_MANIFEST_INC
+
+#include "AcornFS.h"
+
+#define INF_MANIFEST_NAME ".acorn.inf"
+
+typedef struct inf_entry inf_entry;
+
+/*
+ * The attributes of every file below a host directory kept in one
+ * file, INF_MANIFEST_NAME at the top of the tree, in place of a .inf
+ * sidecar per file.  Each line is the path relative to the directory,
+ * a tab and then what the sidecar would have held.  The manifest is
+ * written sequentially and read back in one go into a hash table.
+ */
+
+class InfManifest {
+    public:
+        InfManifest(const char *host_dir);
+        ~InfManifest();
+        int load();
+        int create();
+        int lookup(const char *host_name, afs_object *obj);
+        int add(const char *host_name, afs_object *obj);
+        int finish();
+    private:
+        const char *relative(const char *host_name);
+        char      *dir;
+        size_t    dir_len;
+        FILE      *fp;
+        char      *text;
+        inf_entry *ents;
+        unsigned  count;
+        unsigned  *index;
+        unsigned  mask;
+};
+
+#endif
@@ -0,0 +1,343 @@
+#include "SectorStore.h"
+#include "DiskImgIOstore.h"
+#include "DiskImgProbe.h"
+
+#include <alloca.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SS_SECT_SIZE 256
+#define SS_RUN       64
+#define SS_REC_SIZE  (SHA256_SIZE + 4)
+
+struct ss_slot {
+    uint32_t      chunk;    // chunk number plus one, zero if free.
+    unsigned char hash[SHA256_SIZE];
+};
+
+static void put32(unsigned char *base, uint32_t value) {
+    base[0] = value;
+    base[1] = value >> 8;
+    base[2] = value >> 16;
+    base[3] = value >> 24;
+}
+
+static uint32_t get32(const unsigned char *base) {
+    return base[0] | (base[1] << 8) | (base[2] << 16) | ((uint32_t)base[3] << 24);
+}
+
+SectorStore::SectorStore(const char *store_dir) {
+    dir = strdup(store_dir);
+    pack_fd = -1;
+    idx = NULL;
+    table = NULL;
+    mask = 0;
+    count = 0;
+    chunks_written = 0;
+    chunks_shared = 0;
+    pthread_mutex_init(&lock, NULL);
+}
+
+SectorStore::~SectorStore() {
+    if (idx)
+        close();
+    free(table);
+    free(dir);
+    pthread_mutex_destroy(&lock);
+}
+
+int SectorStore::grow() {
+    ss_slot *old = table, *slot;
+    unsigned old_size = table ? mask + 1 : 0, size, i, j;
+
+    size = old_size ? old_size * 2 : 1024;
+    if ((table = (ss_slot *)calloc(size, sizeof(ss_slot))) == NULL) {
+        table = old;
+        return ENOMEM;
+    }
+    mask = size - 1;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].chunk) {
+            for (j = get32(old[i].hash) & mask; table[j].chunk; j = (j + 1) & mask)
+                ;
+            slot = table + j;
+            *slot = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * Open the store for adding, creating it if need be, and load the
+ * chunk hashes.  Only index records whose chunk made it into the chunk
+ * file are kept, so an interrupted run leaves a consistent store.
+ */
+
+int SectorStore::open() {
+    unsigned char rec[SS_REC_SIZE];
+    struct stat st;
+    char *path;
+    uint32_t stored;
+    ss_slot *slot;
+    int err;
+
+    if (dir == NULL)
+        return ENOMEM;
+    path = (char *)alloca(strlen(dir) + 12);
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return errno;
+    sprintf(path, "%s/images", dir);
+    if (mkdir(path, 0777) != 0 && errno != EEXIST)
+        return errno;
+    sprintf(path, "%s/chunks.idx", dir);
+    if ((idx = fopen(path, "ab+")) == NULL)
+        return errno;
+    if (flock(fileno(idx), LOCK_EX) != 0)
+        return errno;
+    rewind(idx);
+    sprintf(path, "%s/chunks", dir);
+    if ((pack_fd = ::open(path, O_RDWR | O_CREAT, 0666)) < 0 || fstat(pack_fd, &st) != 0)
+        return errno;
+    stored = st.st_size / SS_CHUNK_SIZE;
+    if ((err = grow()) != 0)
+        return err;
+    while (count < stored && fread(rec, SS_REC_SIZE, 1, idx) == 1 && get32(rec + SHA256_SIZE) == count) {
+        if (count * 2 >= mask && (err = grow()) != 0)
+            return err;
+        for (slot = table + (get32(rec) & mask); slot->chunk; slot = table + ((slot - table + 1) & mask))
+            ;
+        memcpy(slot->hash, rec, SHA256_SIZE);
+        slot->chunk = ++count;
+    }
+    if (ftruncate(fileno(idx), (off_t)count * SS_REC_SIZE) != 0 || fseeko(idx, (off_t)count * SS_REC_SIZE, SEEK_SET) != 0)
+        return errno;
+    return 0;
+}
+
+/*
+ * Find a chunk by hash, appending it to the store if it is new.  Called
+ * with the lock held.
+ */
+
+int SectorStore::lookup(const unsigned char *hash, const unsigned char *data, uint32_t *chunk) {
+    unsigned char rec[SS_REC_SIZE];
+    unsigned i;
+    int err;
+
+    for (i = get32(hash) & mask; table[i].chunk; i = (i + 1) & mask) {
+        if (memcmp(table[i].hash, hash, SHA256_SIZE) == 0) {
+            *chunk = table[i].chunk - 1;
+            chunks_shared++;
+            return 0;
+        }
+    }
+    if (pwrite(pack_fd, data, SS_CHUNK_SIZE, (off_t)count * SS_CHUNK_SIZE) != SS_CHUNK_SIZE)
+        return errno ? errno : EIO;
+    memcpy(rec, hash, SHA256_SIZE);
+    put32(rec + SHA256_SIZE, count);
+    if (fwrite(rec, SS_REC_SIZE, 1, idx) != 1)
+        return errno;
+    memcpy(table[i].hash, hash, SHA256_SIZE);
+    table[i].chunk = count + 1;
+    *chunk = count++;
+    chunks_written++;
+    if (count * 2 >= mask && (err = grow()) != 0)
+        return err;
+    return 0;
+}
+
+int SectorStore::write_index(const char *name, uint32_t length, uint32_t *chunks, unsigned nchunks) {
+    unsigned char *buf;
+    size_t size = SS_HDR_SIZE + (size_t)nchunks * 4;
+    char *path, *tmp;
+    unsigned i;
+    int fd, err = 0;
+
+    if ((buf = (unsigned char *)malloc(size)) == NULL)
+        return ENOMEM;
+    memcpy(buf, SS_MAGIC, 8);
+    put32(buf + 8, SS_VERSION);
+    put32(buf + 12, length);
+    put32(buf + 16, nchunks);
+    for (i = 0; i < nchunks; i++)
+        put32(buf + SS_HDR_SIZE + i * 4, chunks[i]);
+    path = (char *)alloca(strlen(dir) + strlen(name) + 9);
+    sprintf(path, "%s/images/%s", dir, name);
+    tmp = (char *)alloca(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0)
+        err = errno;
+    else {
+        if (write(fd, buf, size) != (ssize_t)size)
+            err = errno ? errno : EIO;
+        if (::close(fd) != 0 && err == 0)
+            err = errno;
+        // link rather than rename so an image of the same name is
+        // never replaced, even by another add racing this one.
+        if (err == 0) {
+            chmod(tmp, 0644);
+            if (link(tmp, path) != 0)
+                err = errno;
+        }
+        unlink(tmp);
+    }
+    free(buf);
+    return err;
+}
+
+/*
+ * Archive an image under a name, which must be a plain file name not
+ * already in the store (EEXIST).  dio should be a DiskImgIOlinear so
+ * the host file's bytes are kept whatever its layout.  The image is read and hashed a run
+ * of chunks at a time outside the lock; the last chunk is padded with
+ * zeros.
+ */
+
+int SectorStore::add(const char *name, DiskImgIO *dio) {
+    unsigned char hashes[SS_RUN][SHA256_SIZE], pad[SS_CHUNK_SIZE], *data;
+    const unsigned char *chunk_data;
+    uint32_t *chunks = NULL, length;
+    unsigned nchunks, first, run, bytes, i;
+    struct stat st;
+    sha256_ctx ctx;
+    char *path;
+    int err = 0;
+
+    if (*name == '\0' || *name == '.' || strchr(name, '/'))
+        return EINVAL;
+    path = (char *)alloca(strlen(dir) + strlen(name) + 9);
+    sprintf(path, "%s/images/%s", dir, name);
+    if (lstat(path, &st) == 0)
+        return EEXIST;
+    if (dio->stat(&st) != 0)
+        return errno;
+    if (st.st_size > 0xffffffffLL)
+        return EFBIG;
+    length = st.st_size;
+    nchunks = (length + SS_CHUNK_SIZE - 1) / SS_CHUNK_SIZE;
+    if (nchunks > 0 && (chunks = (uint32_t *)malloc(nchunks * sizeof(uint32_t))) == NULL)
+        return ENOMEM;
+    for (first = 0; err == 0 && first < nchunks; first += run) {
+        run = nchunks - first < SS_RUN ? nchunks - first : SS_RUN;
+        bytes = run * SS_CHUNK_SIZE;
+        if (bytes > length - first * SS_CHUNK_SIZE)
+            bytes = length - first * SS_CHUNK_SIZE;
+        if ((data = dio->read(first * (SS_CHUNK_SIZE / SS_SECT_SIZE), bytes)) == NULL) {
+            err = errno ? errno : EIO;
+            break;
+        }
+        if (bytes < run * SS_CHUNK_SIZE) {
+            memset(pad, 0, SS_CHUNK_SIZE);
+            memcpy(pad, data + (run - 1) * SS_CHUNK_SIZE, bytes - (run - 1) * SS_CHUNK_SIZE);
+        }
+        for (i = 0; i < run; i++) {
+            chunk_data = (i == run - 1 && bytes < run * SS_CHUNK_SIZE) ? pad : data + i * SS_CHUNK_SIZE;
+            sha256_init(&ctx);
+            sha256_update(&ctx, chunk_data, SS_CHUNK_SIZE);
+            sha256_final(&ctx, hashes[i]);
+        }
+        pthread_mutex_lock(&lock);
+        for (i = 0; err == 0 && i < run; i++) {
+            chunk_data = (i == run - 1 && bytes < run * SS_CHUNK_SIZE) ? pad : data + i * SS_CHUNK_SIZE;
+            err = lookup(hashes[i], chunk_data, chunks + first + i);
+        }
+        if (err == 0 && fflush(idx) != 0)
+            err = errno;
+        pthread_mutex_unlock(&lock);
+        dio->dio_free(data);
+    }
+    if (err == 0)
+        err = write_index(name, length, chunks, nchunks);
+    free(chunks);
+    return err;
+}
+
+int SectorStore::close() {
+    int err = 0;
+
+    if (pack_fd >= 0) {
+        if (fsync(pack_fd) != 0)
+            err = errno;
+        if (::close(pack_fd) != 0 && err == 0)
+            err = errno;
+        pack_fd = -1;
+    }
+    if (idx) {
+        if ((fflush(idx) != 0 || fsync(fileno(idx)) != 0) && err == 0)
+            err = errno;
+        if (fclose(idx) != 0 && err == 0)
+            err = errno;
+        idx = NULL;
+    }
+    return err;
+}
+
+/*
+ * Open an archived image for reading.  Unless raw is set the image is
+ * probed and an interleaved one is read in logical sector order, as
+ * DiskImgIO::openImg would the original.  Sets errno and returns NULL
+ * on failure.
+ */
+
+DiskImgIO *SectorStore::open_image(const char *store_dir, const char *name, int raw) {
+    unsigned char hdr[SS_HDR_SIZE], *buf;
+    img_guess guess;
+    uint32_t *chunks, length, nchunks, i;
+    DiskImgIOstore *dio;
+    struct stat st;
+    char *path;
+    FILE *fp, *pack;
+    int err = 0;
+
+    if (*name == '\0' || *name == '.' || strchr(name, '/')) {
+        errno = EINVAL;
+        return NULL;
+    }
+    path = (char *)alloca(strlen(store_dir) + strlen(name) + 9);
+    sprintf(path, "%s/images/%s", store_dir, name);
+    if ((fp = fopen(path, "rb")) == NULL)
+        return NULL;
+    if (fread(hdr, SS_HDR_SIZE, 1, fp) != 1 || memcmp(hdr, SS_MAGIC, 8) != 0 || get32(hdr + 8) != SS_VERSION
+        || (nchunks = get32(hdr + 16)) != (get32(hdr + 12) + SS_CHUNK_SIZE - 1) / SS_CHUNK_SIZE) {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+    length = get32(hdr + 12);
+    chunks = (uint32_t *)malloc(nchunks * sizeof(uint32_t) + 1);
+    buf = (unsigned char *)malloc(nchunks * 4 + 1);
+    if (chunks == NULL || buf == NULL)
+        err = ENOMEM;
+    else if (fread(buf, 4, nchunks, fp) != nchunks)
+        err = ferror(fp) ? errno : EINVAL;
+    else if (fstat(fileno(fp), &st) != 0)
+        err = errno;
+    fclose(fp);
+    if (err == 0) {
+        for (i = 0; i < nchunks; i++)
+            chunks[i] = get32(buf + i * 4);
+        sprintf(path, "%s/chunks", store_dir);
+        if ((pack = fopen(path, "rb")) == NULL)
+            err = errno;
+    }
+    free(buf);
+    if (err) {
+        free(chunks);
+        errno = err;
+        return NULL;
+    }
+    dio = new DiskImgIOstore(pack, chunks, nchunks, length, &st);
+    if (!raw && length > 0 && (buf = dio->read(0, length < PROBE_SIZE ? length : PROBE_SIZE))) {
+        if (DiskImgProbe::probe_buf(buf, length < PROBE_SIZE ? length : PROBE_SIZE, length, name, &guess, 1) == 1
+            && guess.format == IMG_ADFS_L_INTERLEAVED)
+            dio->interleave(80, 16);
+        free(buf);
+    }
+    return dio;
+}
@@ -0,0 +1,55 @@
+#ifndef SECTOR_STORE_INC
+#define SECTOR_STORE_INC
+
+#include "DiskImgIO.h"
+#include "Sha256.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define SS_CHUNK_SIZE  4096
+#define SS_MAGIC       "ADFSSTOR"
+#define SS_VERSION     1
+#define SS_HDR_SIZE    (8 + 4 * 3)
+
+typedef struct ss_slot ss_slot;
+
+/*
+ * An archive of many images which keeps each distinct track sized
+ * chunk once.  Under the store directory:
+ *   chunks      the unique chunks, SS_CHUNK_SIZE bytes each, in the
+ *               order they were first seen
+ *   chunks.idx  the SHA-256 and number of each chunk, for adding
+ *   images/     one index per image: SS_MAGIC, version, length in
+ *               bytes, chunk count and then the chunk numbers, all
+ *               little endian
+ * Images are stored byte for byte as the host files were, whatever
+ * their layout, so a restored image is identical to the original.
+ * Adding is safe from several threads; reading an image back needs
+ * only its index, see open_image.
+ */
+
+class SectorStore {
+    public:
+        SectorStore(const char *store_dir);
+        ~SectorStore();
+        int open();
+        int add(const char *name, DiskImgIO *dio);
+        int close();
+        static DiskImgIO *open_image(const char *store_dir, const char *name, int raw = 0);
+        unsigned chunks_written;
+        unsigned chunks_shared;
+    private:
+        int lookup(const unsigned char *hash, const unsigned char *data, uint32_t *chunk);
+        int grow();
+        int write_index(const char *name, uint32_t length, uint32_t *chunks, unsigned count);
+        char            *dir;
+        int             pack_fd;
+        FILE            *idx;
+        ss_slot         *table;
+        unsigned        mask;
+        uint32_t        count;
+        pthread_mutex_t lock;
+};
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef SHA256_INC
+#define SHA256_INC
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+#define SHA256_HEX  (SHA256_SIZE * 2 + 1)
+
+typedef struct {
+    uint32_t      state[8];
+    uint64_t      count;
+    unsigned char buf[64];
+} sha256_ctx;
+
+extern void sha256_init(sha256_ctx *ctx);
+extern void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+extern void sha256_final(sha256_ctx *ctx, unsigned char *digest);
+extern void sha256_hex(const void *data, size_t len, char *hex);
+
+#endif
@@ -0,0 +1,155 @@
+#include "TarStream.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAR_BLOCK 512
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header;
+
+TarStream::TarStream(FILE *fp) {
+    this->fp = fp;
+}
+
+int TarStream::pad(unsigned long long size) {
+    static const char zeros[TAR_BLOCK] = { 0 };
+    unsigned rem = size % TAR_BLOCK;
+
+    if (rem && fwrite(zeros, TAR_BLOCK - rem, 1, fp) != 1)
+        return errno ? errno : EIO;
+    return 0;
+}
+
+int TarStream::header(const char *name, char type, unsigned long long size, unsigned mode, time_t mtime) {
+    tar_header hdr;
+    unsigned char *ptr;
+    unsigned sum = 0, i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.name, name, sizeof(hdr.name));
+    snprintf(hdr.mode, sizeof(hdr.mode), "%07o", mode);
+    snprintf(hdr.uid, sizeof(hdr.uid), "%07o", 0);
+    snprintf(hdr.gid, sizeof(hdr.gid), "%07o", 0);
+    snprintf(hdr.size, sizeof(hdr.size), "%011llo", size & 077777777777ULL);
+    snprintf(hdr.mtime, sizeof(hdr.mtime), "%011llo", (unsigned long long)(mtime > 0 ? mtime : 0) & 077777777777ULL);
+    hdr.typeflag = type;
+    memcpy(hdr.magic, "ustar", 6);
+    memcpy(hdr.version, "00", 2);
+    memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+    for (ptr = (unsigned char *)&hdr, i = 0; i < sizeof(hdr); i++)
+        sum += ptr[i];
+    snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", sum);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        return errno ? errno : EIO;
+    return 0;
+}
+
+/*
+ * Append one "<len> <key>=<value>\n" record, where len counts its own
+ * digits too.
+ */
+
+static int pax_record(char **buf, size_t *used, const char *key, const char *value) {
+    size_t base = strlen(key) + strlen(value) + 3, len;
+    char *nbuf;
+
+    len = base + snprintf(NULL, 0, "%zu", base);
+    len = base + snprintf(NULL, 0, "%zu", len);
+    if ((nbuf = (char *)realloc(*buf, *used + len + 1)) == NULL)
+        return ENOMEM;
+    sprintf(nbuf + *used, "%zu %s=%s\n", len, key, value);
+    *buf = nbuf;
+    *used += len;
+    return 0;
+}
+
+int TarStream::pax(const char *path, afs_object *obj, time_t mtime) {
+    char *buf = NULL, value[16], attr[12], *ap;
+    size_t used = 0;
+    int err;
+
+    ap = attr;
+    if (obj->locked)     *ap++ = 'L';
+    if (obj->user_read)  *ap++ = 'R';
+    if (obj->user_write) *ap++ = 'W';
+    if (obj->user_exec)  *ap++ = 'E';
+    *ap++ = '/';
+    if (obj->pub_read)   *ap++ = 'r';
+    if (obj->pub_write)  *ap++ = 'w';
+    if (obj->pub_exec)   *ap++ = 'e';
+    if (obj->priv)       *ap++ = 'P';
+    *ap = '\0';
+    err = strlen(path) < 100 ? 0 : pax_record(&buf, &used, "path", path);
+    if (err == 0) {
+        sprintf(value, "%08X", obj->load_addr);
+        err = pax_record(&buf, &used, "ADFS.load", value);
+    }
+    if (err == 0) {
+        sprintf(value, "%08X", obj->exec_addr);
+        err = pax_record(&buf, &used, "ADFS.exec", value);
+    }
+    if (err == 0)
+        err = pax_record(&buf, &used, "ADFS.attr", attr);
+    if (err == 0 && (err = header("././@PaxHeader", 'x', used, 0644, mtime)) == 0) {
+        if (fwrite(buf, used, 1, fp) != 1)
+            err = errno ? errno : EIO;
+        else
+            err = pad(used);
+    }
+    free(buf);
+    return err;
+}
+
+/*
+ * Add one member; a directory gets a trailing slash and no data, a
+ * file must already be loaded.
+ */
+
+int TarStream::add(const char *path, afs_object *obj, time_t mtime) {
+    unsigned long long size = obj->is_dir ? 0 : obj->length;
+    unsigned mode;
+    char *name;
+    int err;
+
+    if ((name = (char *)malloc(strlen(path) + 2)) == NULL)
+        return ENOMEM;
+    strcpy(name, path);
+    if (obj->is_dir)
+        strcat(name, "/");
+    mode = obj->is_dir ? 0755 : (obj->user_write ? 0644 : 0444);
+    if ((err = pax(name, obj, mtime)) == 0 && (err = header(name, obj->is_dir ? '5' : '0', size, mode, mtime)) == 0 && size > 0) {
+        if (fwrite(obj->data, size, 1, fp) != 1)
+            err = errno ? errno : EIO;
+        else
+            err = pad(size);
+    }
+    free(name);
+    return err;
+}
+
+int TarStream::finish() {
+    static const char zeros[TAR_BLOCK * 2] = { 0 };
+
+    if (fwrite(zeros, sizeof(zeros), 1, fp) != 1 || fflush(fp) != 0)
+        return errno ? errno : EIO;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef TAR_STREAM_INC
+#define TAR_STREAM_INC
+
+#include "AcornFS.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Writes a POSIX pax archive to a stream.  Every member carries its
+ * ADFS metadata as ADFS.load, ADFS.exec and ADFS.attr extended
+ * header records, along with a path record when the name does not
+ * fit the ustar header.
+ */
+
+class TarStream {
+    public:
+        TarStream(FILE *fp);
+        int add(const char *path, afs_object *obj, time_t mtime);
+        int finish();
+    private:
+        int header(const char *name, char type, unsigned long long size, unsigned mode, time_t mtime);
+        int pax(const char *path, afs_object *obj, time_t mtime);
+        int pad(unsigned long long size);
+        FILE *fp;
+};
+
+#endif
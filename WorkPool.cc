@@ -0,0 +1,130 @@
+#include "WorkPool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+struct wp_queue {
+    pthread_mutex_t lock;
+    unsigned        head;
+    unsigned        tail;
+    unsigned        self;
+    WorkPool        *pool;
+};
+
+WorkPool::WorkPool(unsigned nworkers) {
+    this->nworkers = nworkers ? nworkers : 1;
+    queues = NULL;
+    fn = NULL;
+    ctx = NULL;
+}
+
+WorkPool::~WorkPool() {
+}
+
+unsigned WorkPool::workers() {
+    return nworkers;
+}
+
+int WorkPool::next(unsigned self, unsigned *item) {
+    wp_queue *q = queues + self, *victim;
+    unsigned i, best, left, most, mid, end;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *item = q->head++;
+        pthread_mutex_unlock(&q->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    for (;;) {
+        best = nworkers;
+        most = 0;
+        for (i = 0; i < nworkers; i++) {
+            if (i == self)
+                continue;
+            pthread_mutex_lock(&queues[i].lock);
+            left = queues[i].tail - queues[i].head;
+            pthread_mutex_unlock(&queues[i].lock);
+            if (left > most) {
+                most = left;
+                best = i;
+            }
+        }
+        if (best == nworkers)
+            return 0;
+        victim = queues + best;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            mid = victim->head + (victim->tail - victim->head) / 2;
+            end = victim->tail;
+            victim->tail = mid;
+            pthread_mutex_unlock(&victim->lock);
+            // Only one lock is held at a time so thieves cannot deadlock.
+            *item = mid;
+            pthread_mutex_lock(&q->lock);
+            q->head = mid + 1;
+            q->tail = end;
+            pthread_mutex_unlock(&q->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
+
+void *WorkPool::worker(void *arg) {
+    wp_queue *q = (wp_queue *)arg;
+    WorkPool *pool = q->pool;
+    unsigned item;
+
+    while (pool->next(q->self, &item))
+        pool->fn(pool->ctx, q->self, item);
+    return NULL;
+}
+
+/*
+ * Run fn for items 0 to nitems-1 and return when all have completed.
+ * Returns 0 or an errno value if the threads could not be started.
+ */
+
+int WorkPool::run(unsigned nitems, wp_func fn, void *ctx) {
+    pthread_t *threads;
+    unsigned i, started;
+    int err = 0;
+
+    if ((queues = (wp_queue *)malloc(nworkers * sizeof(wp_queue))) == NULL)
+        return ENOMEM;
+    if ((threads = (pthread_t *)malloc(nworkers * sizeof(pthread_t))) == NULL) {
+        free(queues);
+        return ENOMEM;
+    }
+    this->fn = fn;
+    this->ctx = ctx;
+    for (i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queues[i].head = (unsigned)((unsigned long long)nitems * i / nworkers);
+        queues[i].tail = (unsigned)((unsigned long long)nitems * (i + 1) / nworkers);
+        queues[i].self = i;
+        queues[i].pool = this;
+    }
+    for (started = 0; started < nworkers; started++)
+        if ((err = pthread_create(threads + started, NULL, worker, queues + started)) != 0)
+            break;
+    if (started == 0) {
+        for (i = 0; i < nitems; i++)
+            fn(ctx, 0, i);
+        err = 0;
+    }
+    else if (started < nworkers) {
+        // Threads that failed to start leave their ranges to be stolen.
+        err = 0;
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0; i < nworkers; i++)
+        pthread_mutex_destroy(&queues[i].lock);
+    free(threads);
+    free(queues);
+    queues = NULL;
+    return err;
+}
@@ -0,0 +1,32 @@
+#ifndef WORK_POOL_INC
+#define WORK_POOL_INC
+
+#include <pthread.h>
+
+typedef void (*wp_func)(void *ctx, unsigned worker, unsigned item);
+
+typedef struct wp_queue wp_queue;
+
+/*
+ * A fixed pool of threads that runs fn once for each item index.
+ * Items start out dealt as contiguous ranges, one per worker; a worker
+ * that runs dry steals the back half of the busiest remaining range so
+ * a few slow items do not leave the other threads idle.
+ */
+
+class WorkPool {
+    public:
+        WorkPool(unsigned nworkers);
+        ~WorkPool();
+        unsigned workers();
+        int run(unsigned nitems, wp_func fn, void *ctx);
+    private:
+        static void *worker(void *arg);
+        int next(unsigned self, unsigned *item);
+        unsigned  nworkers;
+        wp_queue  *queues;
+        wp_func   fn;
+        void      *ctx;
+};
+
+#endif
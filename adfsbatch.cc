@@ -0,0 +1,710 @@
+#include "DiskImgIO.h"
+#include "DiskImgIOlinear.h"
+#include "DiskImgProbe.h"
+#include "AcornADFS.h"
+#include "HostMirror.h"
+#include "InfManifest.h"
+#include "SectorStore.h"
+#include "WorkPool.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char usage[] =
+    "Usage: adfsbatch [-j workers] [-s store-dir] [-o host-dir] [-m|-x] <list|extract|sync|verify|probe> <image|@list-file|pattern>...\n"
+    "       adfsbatch [-j workers] [-s store-dir] [-E] search <string|regex> <image|@list-file|pattern>...\n"
+    "       adfsbatch [-j workers] archive <store-dir> <image|@list-file|pattern>...\n";
+
+typedef enum {
+    JOB_LIST,
+    JOB_EXTRACT,
+    JOB_SYNC,
+    JOB_VERIFY,
+    JOB_PROBE,
+    JOB_SEARCH,
+    JOB_ARCHIVE
+} batch_job;
+
+/*
+ * Each worker has its own compiled pattern for -E, as regexec locks the
+ * pattern it runs and a shared one would let only one worker search at
+ * a time.
+ */
+
+typedef struct {
+    FILE     *out;
+    char     *buf;
+    size_t   size;
+    unsigned failed;
+    regex_t  regex;
+    int      have_regex;
+} batch_worker;
+
+typedef struct {
+    char            **images;
+    char            **errors;
+    unsigned        nimages;
+    batch_job       job;
+    const char      *host_dir;
+    int             use_manifest;
+    char            *needle;
+    size_t          needle_len;
+    int             use_regex;
+    const char      *store_dir;
+    SectorStore     *store;
+    batch_worker    *workers;
+    pthread_mutex_t out_lock;
+} batch_ctx;
+
+typedef struct {
+    AcornADFS   *adfs;
+    FILE        *out;
+    const char  *image;
+    char        *host_dir;
+    char        **error;
+    batch_ctx   *bc;
+    regex_t     *regex;
+    InfManifest *manifest;
+    afs_object  *files;
+    char        **names;
+    unsigned    nfiles;
+    unsigned    alloc;
+} walk_ctx;
+
+static afs_status list_obj(void *ctx, const char *path, afs_object *obj) {
+    walk_ctx *wc = (walk_ctx *)ctx;
+
+    fprintf(wc->out, "%s:%s\t", wc->image, path);
+    AcornFS::print_attr(obj, wc->out);
+    return AFS_OK;
+}
+
+/*
+ * Extraction and searching gather the files while walking, with a
+ * host or ADFS name for each, and then read them in disc order with
+ * AcornADFS::extract.  Extraction creates directories as it goes.
+ */
+
+static afs_status add_file(walk_ctx *wc, afs_object *obj, char *name) {
+    afs_object *files;
+    char **names;
+
+    if (wc->nfiles == wc->alloc) {
+        wc->alloc = wc->alloc ? wc->alloc * 2 : 64;
+        files = (afs_object *)realloc(wc->files, wc->alloc * sizeof(afs_object));
+        if (files)
+            wc->files = files;
+        names = (char **)realloc(wc->names, wc->alloc * sizeof(char *));
+        if (names)
+            wc->names = names;
+        if (files == NULL || names == NULL) {
+            free(name);
+            return AFS_NO_MEMORY;
+        }
+    }
+    wc->files[wc->nfiles] = *obj;
+    wc->names[wc->nfiles++] = name;
+    return AFS_OK;
+}
+
+static afs_status extract_obj(void *ctx, const char *path, afs_object *obj) {
+    walk_ctx *wc = (walk_ctx *)ctx;
+    char *host;
+
+    if ((host = AcornFS::host_path(wc->host_dir, path)) == NULL)
+        return AFS_NO_MEMORY;
+    if (obj->is_dir) {
+        if (mkdir(host, 0777) != 0 && errno != EEXIST) {
+            if (asprintf(wc->error, "unable to write '%s': %s", host, strerror(errno)) < 0)
+                *wc->error = NULL;
+            free(host);
+            return AFS_HOST_ERROR;
+        }
+        free(host);
+        return AFS_OK;
+    }
+    return add_file(wc, obj, host);
+}
+
+static afs_status extract_save(void *ctx, unsigned index, afs_object *obj) {
+    walk_ctx *wc = (walk_ctx *)ctx;
+    int err;
+
+    err = AcornFS::host_save(obj, wc->names[index], wc->manifest);
+    wc->adfs->obj_free(obj);
+    if (err) {
+        if (asprintf(wc->error, "unable to write '%s': %s", wc->names[index], strerror(err)) < 0)
+            *wc->error = NULL;
+        return AFS_HOST_ERROR;
+    }
+    return AFS_OK;
+}
+
+static afs_status search_obj(void *ctx, const char *path, afs_object *obj) {
+    walk_ctx *wc = (walk_ctx *)ctx;
+    char *name;
+
+    if (obj->is_dir || obj->length < (wc->bc->use_regex ? 1 : wc->bc->needle_len))
+        return AFS_OK;
+    if ((name = strdup(path)) == NULL)
+        return AFS_NO_MEMORY;
+    return add_file(wc, obj, name);
+}
+
+/*
+ * Report every offset at which the string occurs in one file; glibc's
+ * memmem does the scanning.  With -E the offsets of the non-empty,
+ * non-overlapping matches of the regular expression are reported
+ * instead; REG_STARTEND lets it run over data containing NULs.
+ */
+
+static void search_regex(walk_ctx *wc, unsigned index, afs_object *obj) {
+    regmatch_t match;
+    regoff_t start = 0;
+
+    while (start < (regoff_t)obj->length) {
+        match.rm_so = start;
+        match.rm_eo = obj->length;
+        if (regexec(wc->regex, (const char *)obj->data, 1, &match, REG_STARTEND | (start ? REG_NOTBOL : 0)) != 0)
+            break;
+        if (match.rm_eo > match.rm_so) {
+            fprintf(wc->out, "%s:%s\t%lu\n", wc->image, wc->names[index], (unsigned long)match.rm_so);
+            start = match.rm_eo;
+        }
+        else
+            start = match.rm_so + 1;
+    }
+}
+
+static afs_status search_file(void *ctx, unsigned index, afs_object *obj) {
+    walk_ctx *wc = (walk_ctx *)ctx;
+    unsigned char *ptr = obj->data, *end = obj->data + obj->length;
+    size_t len = wc->bc->needle_len;
+
+    if (wc->bc->use_regex)
+        search_regex(wc, index, obj);
+    else {
+        while ((ptr = (unsigned char *)memmem(ptr, end - ptr, wc->bc->needle, len)) != NULL) {
+            fprintf(wc->out, "%s:%s\t%lu\n", wc->image, wc->names[index], (unsigned long)(ptr - obj->data));
+            ptr++;
+        }
+    }
+    wc->adfs->obj_free(obj);
+    return AFS_OK;
+}
+
+static void flush_output(batch_ctx *bc, batch_worker *bw) {
+    fflush(bw->out);
+    if (bw->size > 0) {
+        pthread_mutex_lock(&bc->out_lock);
+        fwrite(bw->buf, bw->size, 1, stdout);
+        pthread_mutex_unlock(&bc->out_lock);
+    }
+}
+
+/*
+ * Classify an image from one small read without opening it as a
+ * filesystem, listing every plausible format best first.
+ */
+
+static void probe_image(batch_worker *bw, const char *image, char **error) {
+    img_guess guesses[PROBE_MAX_GUESS];
+    unsigned count, i;
+    int fd;
+
+    if ((fd = open(image, O_RDONLY)) < 0) {
+        *error = strdup(strerror(errno));
+        bw->failed++;
+        return;
+    }
+    count = DiskImgProbe::probe_fd(fd, image, guesses, PROBE_MAX_GUESS);
+    close(fd);
+    fprintf(bw->out, "%s:", image);
+    for (i = 0; i < count; i++)
+        fprintf(bw->out, "%c%s %d", i ? ',' : '\t', DiskImgProbe::format_name(guesses[i].format), guesses[i].score);
+    fputs(count ? "\n" : "\tunknown\n", bw->out);
+}
+
+/*
+ * Add an image to the sector store under its base name.
+ */
+
+static void archive_image(batch_ctx *bc, batch_worker *bw, const char *image, char **error) {
+    DiskImgIO *dio;
+    char *base = NULL;
+    FILE *fp;
+    int err;
+
+    // archived byte for byte: no probing for the layout.
+    if ((fp = fopen(image, "rb")) == NULL)
+        err = errno;
+    else {
+        dio = new DiskImgIOlinear(fp);
+        if ((base = strdup(image)) == NULL)
+            err = ENOMEM;
+        else
+            err = bc->store->add(basename(base), dio);
+        dio->close();
+        delete dio;
+    }
+    if (err == EEXIST) {
+        if (asprintf(error, "an image named '%s' is already archived", basename(base)) < 0)
+            *error = NULL;
+        bw->failed++;
+    }
+    else if (err) {
+        *error = strdup(strerror(err));
+        bw->failed++;
+    }
+    free(base);
+}
+
+static void batch_image(void *ctx, unsigned worker, unsigned item) {
+    batch_ctx *bc = (batch_ctx *)ctx;
+    batch_worker *bw = bc->workers + worker;
+    const char *image = bc->images[item];
+    char **error = bc->errors + item, *base;
+    afs_status status = AFS_OK;
+    unsigned problems;
+    int err;
+    walk_ctx wc;
+    HostMirror *mirror;
+    DiskImgIO *dio;
+
+    rewind(bw->out);
+    if (bc->job == JOB_PROBE) {
+        probe_image(bw, image, error);
+        flush_output(bc, bw);
+        return;
+    }
+    if (bc->job == JOB_ARCHIVE) {
+        archive_image(bc, bw, image, error);
+        return;
+    }
+    if (bc->store_dir)
+        dio = SectorStore::open_image(bc->store_dir, image);
+    else
+        dio = DiskImgIO::openImg(image, 0);
+    if (dio == NULL) {
+        *error = strdup(strerror(errno));
+        bw->failed++;
+        return;
+    }
+    wc.adfs = new AcornADFS(dio);
+    wc.out = bw->out;
+    wc.image = image;
+    wc.host_dir = NULL;
+    wc.error = error;
+    wc.bc = bc;
+    wc.regex = &bw->regex;
+    wc.manifest = NULL;
+    wc.files = NULL;
+    wc.names = NULL;
+    wc.nfiles = wc.alloc = 0;
+    switch (bc->job) {
+        case JOB_LIST:
+            status = wc.adfs->walk("$", list_obj, &wc);
+            break;
+        case JOB_EXTRACT:
+            base = strdup(image);
+            if (base == NULL || asprintf(&wc.host_dir, "%s/%s", bc->host_dir, basename(base)) < 0)
+                status = AFS_NO_MEMORY;
+            else if (mkdir(wc.host_dir, 0777) != 0 && errno != EEXIST) {
+                if (asprintf(error, "unable to create '%s': %s", wc.host_dir, strerror(errno)) < 0)
+                    *error = NULL;
+                status = AFS_HOST_ERROR;
+            }
+            else {
+                if (bc->use_manifest) {
+                    wc.manifest = new InfManifest(wc.host_dir);
+                    if ((err = wc.manifest->create()) != 0) {
+                        if (asprintf(error, "unable to create manifest in '%s': %s", wc.host_dir, strerror(err)) < 0)
+                            *error = NULL;
+                        status = AFS_HOST_ERROR;
+                    }
+                }
+                if (status == AFS_OK && (status = wc.adfs->walk("$", extract_obj, &wc)) == AFS_OK)
+                    status = wc.adfs->extract(wc.files, wc.nfiles, extract_save, &wc);
+                if (wc.manifest && (err = wc.manifest->finish()) != 0 && status == AFS_OK) {
+                    if (asprintf(error, "unable to write manifest in '%s': %s", wc.host_dir, strerror(err)) < 0)
+                        *error = NULL;
+                    status = AFS_HOST_ERROR;
+                }
+                delete wc.manifest;
+            }
+            free(wc.host_dir);
+            free(base);
+            break;
+        case JOB_SYNC:
+            base = strdup(image);
+            if (base == NULL || asprintf(&wc.host_dir, "%s/%s", bc->host_dir, basename(base)) < 0)
+                status = AFS_NO_MEMORY;
+            else {
+                mirror = new HostMirror(wc.adfs, wc.host_dir);
+                if ((err = mirror->load()) != 0) {
+                    if (asprintf(error, "unable to read sync state in '%s': %s", wc.host_dir, strerror(err)) < 0)
+                        *error = NULL;
+                    status = AFS_HOST_ERROR;
+                }
+                else if ((status = mirror->run(error)) == AFS_OK) {
+                    if ((err = mirror->finish()) != 0) {
+                        if (asprintf(error, "unable to write sync state in '%s': %s", wc.host_dir, strerror(err)) < 0)
+                            *error = NULL;
+                        status = AFS_HOST_ERROR;
+                    }
+                    else
+                        fprintf(bw->out, "%s:\t%u written, %u unchanged, %u removed\n", image, mirror->written, mirror->kept, mirror->deleted);
+                }
+                delete mirror;
+            }
+            free(wc.host_dir);
+            free(base);
+            break;
+        case JOB_SEARCH:
+            if ((status = wc.adfs->walk("$", search_obj, &wc)) == AFS_OK)
+                status = wc.adfs->extract(wc.files, wc.nfiles, search_file, &wc);
+            break;
+        case JOB_VERIFY:
+            fprintf(bw->out, "%s:\n", image);
+            if ((status = wc.adfs->check(bw->out, &problems)) == AFS_OK && problems > 0) {
+                if (asprintf(error, "%u problem(s) found", problems) < 0)
+                    *error = NULL;
+                status = AFS_BROKEN_DIR;
+            }
+            else if (status == AFS_OK)
+                rewind(bw->out);
+            break;
+        case JOB_PROBE:
+        case JOB_ARCHIVE:
+            break;
+    }
+    while (wc.nfiles > 0)
+        free(wc.names[--wc.nfiles]);
+    free(wc.names);
+    free(wc.files);
+    if (status != AFS_OK && *error == NULL)
+        *error = strdup(AcornFS::afs_error(status));
+    delete wc.adfs;
+    dio->close();
+    delete dio;
+
+    flush_output(bc, bw);
+    if (status != AFS_OK)
+        bw->failed++;
+}
+
+static int add_image(batch_ctx *bc, unsigned *size, const char *name) {
+    char **images;
+
+    if (bc->nimages >= *size) {
+        *size = *size ? *size * 2 : 256;
+        if ((images = (char **)realloc(bc->images, *size * sizeof(char *))) == NULL)
+            return ENOMEM;
+        bc->images = images;
+    }
+    if ((bc->images[bc->nimages] = strdup(name)) == NULL)
+        return ENOMEM;
+    bc->nimages++;
+    return 0;
+}
+
+static int add_list(batch_ctx *bc, unsigned *size, const char *list_name) {
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t got;
+    FILE *fp;
+    int err = 0;
+
+    if (strcmp(list_name, "-") == 0)
+        fp = stdin;
+    else if ((fp = fopen(list_name, "rt")) == NULL)
+        return errno;
+    while (err == 0 && (got = getline(&line, &len, fp)) >= 0) {
+        while (got > 0 && (line[got-1] == '\n' || line[got-1] == '\r'))
+            line[--got] = '\0';
+        if (got > 0)
+            err = add_image(bc, size, line);
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    return err;
+}
+
+static int add_pattern(batch_ctx *bc, unsigned *size, const char *pattern) {
+    glob_t gl;
+    size_t i;
+    int err = 0;
+
+    if (glob(pattern, 0, NULL, &gl) != 0)
+        return ENOENT;
+    for (i = 0; err == 0 && i < gl.gl_pathc; i++)
+        err = add_image(bc, size, gl.gl_pathv[i]);
+    globfree(&gl);
+    return err;
+}
+
+/*
+ * Decode \xNN and \\ escapes in a search string in place, so binary
+ * patterns can be given, and return its length.
+ */
+
+static size_t unescape(char *str) {
+    char *in = str, *out = str, hex[3];
+
+    while (*in) {
+        if (in[0] == '\\' && in[1] == 'x' && isxdigit(in[2]) && isxdigit(in[3])) {
+            hex[0] = in[2];
+            hex[1] = in[3];
+            hex[2] = '\0';
+            *out++ = strtoul(hex, NULL, 16);
+            in += 4;
+        }
+        else if (in[0] == '\\' && in[1] == '\\') {
+            *out++ = '\\';
+            in += 2;
+        }
+        else
+            *out++ = *in++;
+    }
+    return out - str;
+}
+
+/*
+ * Extraction and syncing write each image into a directory named after
+ * its base name, so two images with the same base name would write
+ * into the same directory at once.  Report every such pair before any
+ * work starts.
+ */
+
+typedef struct {
+    const char *base;
+    const char *image;
+} batch_target;
+
+static int target_cmp(const void *a, const void *b) {
+    return strcmp(((const batch_target *)a)->base, ((const batch_target *)b)->base);
+}
+
+static int check_targets(batch_ctx *bc) {
+    batch_target *targets;
+    char **bases;
+    unsigned i, clashes = 0;
+    int err = 0;
+
+    targets = (batch_target *)malloc((bc->nimages + 1) * sizeof(batch_target));
+    bases = (char **)calloc(bc->nimages + 1, sizeof(char *));
+    if (targets == NULL || bases == NULL)
+        err = ENOMEM;
+    for (i = 0; err == 0 && i < bc->nimages; i++) {
+        if ((bases[i] = strdup(bc->images[i])) == NULL)
+            err = ENOMEM;
+        else {
+            targets[i].base = basename(bases[i]);
+            targets[i].image = bc->images[i];
+        }
+    }
+    if (err == 0) {
+        qsort(targets, bc->nimages, sizeof(batch_target), target_cmp);
+        for (i = 1; i < bc->nimages; i++) {
+            if (strcmp(targets[i - 1].base, targets[i].base) == 0) {
+                fprintf(stderr, "adfsbatch: '%s' and '%s' would both be written to '%s/%s'\n",
+                        targets[i - 1].image, targets[i].image, bc->host_dir, targets[i].base);
+                clashes++;
+            }
+        }
+        if (clashes)
+            err = EEXIST;
+    }
+    else
+        fprintf(stderr, "adfsbatch: %s\n", strerror(err));
+    for (i = 0; bases && i < bc->nimages; i++)
+        free(bases[i]);
+    free(bases);
+    free(targets);
+    return err;
+}
+
+/*
+ * Each worker holds at most one image and one host file open at a
+ * time, so keep the pool small enough to stay inside RLIMIT_NOFILE.
+ */
+
+static unsigned fd_limit_workers(unsigned workers) {
+    struct rlimit rl;
+    rlim_t max;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        max = rl.rlim_cur > 16 ? (rl.rlim_cur - 16) / 2 : 1;
+        if (workers > max)
+            workers = max;
+    }
+    return workers ? workers : 1;
+}
+
+int main(int argc, char **argv) {
+    batch_ctx bc;
+    unsigned size = 0, workers = 0, i, failed = 0;
+    const char *job;
+    char errbuf[256];
+    regex_t regex;
+    WorkPool *pool;
+    long ncpu;
+    int opt, err = 0;
+
+    memset(&bc, 0, sizeof(bc));
+    bc.host_dir = ".";
+    while ((opt = getopt(argc, argv, "j:o:s:mxE")) != -1) {
+        switch (opt) {
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'o':
+                bc.host_dir = optarg;
+                break;
+            case 's':
+                bc.store_dir = optarg;
+                break;
+            case 'm':
+                bc.use_manifest = 1;
+                break;
+            case 'x':
+                AcornFS::host_xattr = 1;
+                break;
+            case 'E':
+                bc.use_regex = 1;
+                break;
+            default:
+                fputs(usage, stderr);
+                return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        fputs(usage, stderr);
+        return 1;
+    }
+    job = argv[optind++];
+    if (strcasecmp(job, "list") == 0)
+        bc.job = JOB_LIST;
+    else if (strcasecmp(job, "extract") == 0)
+        bc.job = JOB_EXTRACT;
+    else if (strcasecmp(job, "sync") == 0)
+        bc.job = JOB_SYNC;
+    else if (strcasecmp(job, "verify") == 0)
+        bc.job = JOB_VERIFY;
+    else if (strcasecmp(job, "probe") == 0)
+        bc.job = JOB_PROBE;
+    else if (strcasecmp(job, "search") == 0 && argc - optind >= 2) {
+        bc.job = JOB_SEARCH;
+        bc.needle = argv[optind++];
+        if (bc.use_regex) {
+            // checked here; each worker compiles its own copy.
+            if ((err = regcomp(&regex, bc.needle, REG_EXTENDED)) != 0) {
+                regerror(err, &regex, errbuf, sizeof(errbuf));
+                fprintf(stderr, "adfsbatch: bad regular expression '%s': %s\n", bc.needle, errbuf);
+                return 1;
+            }
+            regfree(&regex);
+        }
+        else if ((bc.needle_len = unescape(bc.needle)) == 0) {
+            fputs(usage, stderr);
+            return 1;
+        }
+    }
+    else if (strcasecmp(job, "archive") == 0 && argc - optind >= 2) {
+        bc.job = JOB_ARCHIVE;
+        bc.store = new SectorStore(argv[optind++]);
+    }
+    else {
+        fputs(usage, stderr);
+        return 1;
+    }
+    for (; err == 0 && optind < argc; optind++) {
+        if (argv[optind][0] == '@' || strcmp(argv[optind], "-") == 0)
+            err = add_list(&bc, &size, argv[optind][0] == '@' ? argv[optind] + 1 : argv[optind]);
+        else if (strpbrk(argv[optind], "*?["))
+            err = add_pattern(&bc, &size, argv[optind]);
+        else
+            err = add_image(&bc, &size, argv[optind]);
+        if (err)
+            fprintf(stderr, "adfsbatch: unable to read image list '%s': %s\n", argv[optind], strerror(err));
+    }
+    if (err)
+        return 2;
+    if ((bc.job == JOB_EXTRACT || bc.job == JOB_SYNC) && check_targets(&bc) != 0)
+        return 2;
+    if (bc.store && (err = bc.store->open()) != 0) {
+        fprintf(stderr, "adfsbatch: unable to open store: %s\n", strerror(err));
+        return 5;
+    }
+    if ((bc.job == JOB_EXTRACT || bc.job == JOB_SYNC) && mkdir(bc.host_dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "adfsbatch: unable to create '%s': %s\n", bc.host_dir, strerror(errno));
+        return 5;
+    }
+
+    if (workers == 0 && (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+        workers = ncpu;
+    pool = new WorkPool(fd_limit_workers(workers));
+    bc.errors = (char **)calloc(bc.nimages, sizeof(char *));
+    bc.workers = (batch_worker *)calloc(pool->workers(), sizeof(batch_worker));
+    if (bc.errors == NULL || bc.workers == NULL)
+        err = ENOMEM;
+    for (i = 0; err == 0 && i < pool->workers(); i++) {
+        if ((bc.workers[i].out = open_memstream(&bc.workers[i].buf, &bc.workers[i].size)) == NULL)
+            err = errno;
+        else if (bc.job == JOB_SEARCH && bc.use_regex) {
+            if (regcomp(&bc.workers[i].regex, bc.needle, REG_EXTENDED) != 0)
+                err = ENOMEM;
+            else
+                bc.workers[i].have_regex = 1;
+        }
+    }
+    if (err == 0) {
+        pthread_mutex_init(&bc.out_lock, NULL);
+        err = pool->run(bc.nimages, batch_image, &bc);
+        pthread_mutex_destroy(&bc.out_lock);
+    }
+    if (err) {
+        fprintf(stderr, "adfsbatch: unable to start workers: %s\n", strerror(err));
+        return 2;
+    }
+    fflush(stdout);
+
+    for (i = 0; i < pool->workers(); i++) {
+        failed += bc.workers[i].failed;
+        fclose(bc.workers[i].out);
+        free(bc.workers[i].buf);
+        if (bc.workers[i].have_regex)
+            regfree(&bc.workers[i].regex);
+    }
+    for (i = 0; i < bc.nimages; i++) {
+        if (bc.errors[i]) {
+            fprintf(stderr, "adfsbatch: %s: %s\n", bc.images[i], bc.errors[i]);
+            free(bc.errors[i]);
+        }
+        free(bc.images[i]);
+    }
+    if (bc.store) {
+        if ((err = bc.store->close()) != 0) {
+            fprintf(stderr, "adfsbatch: unable to write store: %s\n", strerror(err));
+            failed = bc.nimages;
+        }
+        fprintf(stderr, "adfsbatch: %u chunk(s) written, %u shared\n", bc.store->chunks_written, bc.store->chunks_shared);
+        delete bc.store;
+    }
+    fprintf(stderr, "adfsbatch: %u image(s), %u failed\n", bc.nimages, failed);
+    free(bc.errors);
+    free(bc.images);
+    free(bc.workers);
+    delete pool;
+    return failed ? 3 : 0;
+}
@@ -0,0 +1,440 @@
+#include "DiskImgIO.h"
+#include "AcornADFS.h"
+#include "AcornFSAsync.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char usage[] =
+    "Usage: adfsbench [-d depth] [-b dirs-per-dir] [-f files-per-dir] [-F frag-percent]\n"
+    "                 [-m max-file-size] [-s sectors] [-i iterations] [-r seed]\n";
+
+/*
+ * Exposes the internals of AcornADFS that are worth timing on their own.
+ */
+
+class BenchADFS: public AcornADFS {
+    public:
+        BenchADFS(DiskImgIO *dio) : AcornADFS(dio) {};
+        using AcornADFS::checksum;
+        using AcornADFS::search;
+        using AcornADFS::load_fsmap;
+        using AcornADFS::alloc_write;
+        using AcornADFS::map_free;
+        unsigned char *map() { return fsmap; };
+};
+
+typedef struct {
+    unsigned depth;
+    unsigned branch;
+    unsigned files;
+    unsigned frag;
+    unsigned max_size;
+    unsigned sectors;
+    unsigned iters;
+    unsigned seed;
+} bench_cfg;
+
+typedef struct {
+    char     **items;
+    unsigned used;
+    unsigned size;
+} name_list;
+
+typedef struct {
+    const char *name;
+    unsigned long ops;
+    unsigned long long ns;
+    unsigned long long bytes;
+} bench_result;
+
+static bench_result results[16];
+static unsigned nresults;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(const char *name, unsigned long ops, unsigned long long start, unsigned long long bytes) {
+    bench_result *r = results + nresults++;
+
+    r->name  = name;
+    r->ops   = ops;
+    r->ns    = now_ns() - start;
+    r->bytes = bytes;
+}
+
+static int list_add(name_list *nl, const char *name) {
+    char **items;
+
+    if (nl->used >= nl->size) {
+        nl->size = nl->size ? nl->size * 2 : 64;
+        if ((items = (char **)realloc(nl->items, nl->size * sizeof(char *))) == NULL)
+            return 0;
+        nl->items = items;
+    }
+    return (nl->items[nl->used++] = strdup(name)) != NULL;
+}
+
+static void list_free(name_list *nl) {
+    unsigned i;
+
+    for (i = 0; i < nl->used; i++)
+        free(nl->items[i]);
+    free(nl->items);
+}
+
+static const char *parent_of(const char *path, char *buf) {
+    const char *dot = strrchr(path, '.');
+
+    memcpy(buf, path, dot - path);
+    buf[dot - path] = '\0';
+    return buf;
+}
+
+static void fill(afs_object *obj, unsigned length) {
+    unsigned i;
+
+    obj->length = length;
+    obj->data = (unsigned char *)malloc(length);
+    for (i = 0; i < length; i++)
+        obj->data[i] = rand();
+}
+
+static afs_status gen_tree(BenchADFS *adfs, const bench_cfg *cfg, const char *dir, unsigned depth, name_list *files, name_list *dirs) {
+    afs_status status;
+    afs_object obj;
+    char name[ADFS_MAX_NAME+1], *path;
+    unsigned i;
+
+    for (i = 0; i < cfg->files; i++) {
+        memset(&obj, 0, sizeof(obj));
+        sprintf(obj.name, "F%03u", i);
+        obj.user_read = obj.user_write = 1;
+        obj.load_addr = 0xffff1900;
+        obj.exec_addr = 0xffff8023;
+        fill(&obj, 1 + rand() % cfg->max_size);
+        status = adfs->save(&obj, dir);
+        free(obj.data);
+        if (status != AFS_OK)
+            return status;
+        if (asprintf(&path, "%s.%s", dir, obj.name) < 0 || !list_add(files, path))
+            return AFS_NO_MEMORY;
+        free(path);
+    }
+    if (depth == 0)
+        return AFS_OK;
+    for (i = 0; i < cfg->branch; i++) {
+        sprintf(name, "D%02u", i % 100);
+        if ((status = adfs->mkdir(name, dir)) != AFS_OK)
+            return status;
+        if (asprintf(&path, "%s.%s", dir, name) < 0 || !list_add(dirs, path))
+            return AFS_NO_MEMORY;
+        status = gen_tree(adfs, cfg, path, depth - 1, files, dirs);
+        free(path);
+        if (status != AFS_OK)
+            return status;
+    }
+    return AFS_OK;
+}
+
+/*
+ * Grow a share of the files so each moves to a new extent and leaves
+ * a hole behind, stopping early if the free space map fills up.
+ */
+
+static unsigned fragment(BenchADFS *adfs, const bench_cfg *cfg, name_list *files) {
+    char parent[256];
+    afs_object obj;
+    unsigned i, moved = 0, length;
+
+    for (i = 0; i < files->used; i++) {
+        if ((unsigned)(rand() % 100) >= cfg->frag)
+            continue;
+        if (adfs->find(files->items[i], &obj) != AFS_OK)
+            continue;
+        length = obj.length + 256 * (1 + rand() % 4);
+        fill(&obj, length);
+        if (adfs->save(&obj, parent_of(files->items[i], parent)) == AFS_OK)
+            moved++;
+        free(obj.data);
+        if (adfs->load_fsmap() == AFS_OK && adfs->map()[0x1fe] >= 80 * 3)
+            break;
+    }
+    return moved;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static DiskImgIO *create_image(const char *name, BenchADFS **adfs, unsigned sectors) {
+    DiskImgIO *dio;
+    FILE *fp;
+
+    if ((fp = fopen(name, "wb")) == NULL)
+        return NULL;
+    fclose(fp);
+    if ((dio = DiskImgIO::openImg(name, 1)) == NULL)
+        return NULL;
+    *adfs = new BenchADFS(dio);
+    if ((*adfs)->format(sectors) != AFS_OK) {
+        delete *adfs;
+        dio->close();
+        delete dio;
+        return NULL;
+    }
+    return dio;
+}
+
+/*
+ * One coroutine per file, all in flight at once from this thread.
+ */
+
+static afs_task<afs_status> find_load(AcornFSAsync *fsa, AcornADFS *fs, const char *path, unsigned long long *bytes) {
+    afs_object obj;
+    afs_status status;
+
+    if ((status = co_await fsa->find(path, &obj)) == AFS_OK) {
+        if ((status = co_await fsa->load(&obj)) == AFS_OK) {
+            *bytes += obj.length;
+            fs->obj_free(&obj);
+        }
+    }
+    co_return status;
+}
+
+static void bench_async(BenchADFS *adfs, const bench_cfg *cfg, name_list *files) {
+    unsigned long long start, bytes = 0;
+    unsigned long ops = 0;
+    afs_task<afs_status> **tasks;
+    AsyncThreadPool pool(4);
+    AcornFSAsync fsa(adfs, &pool);
+    unsigned i, it;
+
+    if (pool.start() != 0 || (tasks = (afs_task<afs_status> **)calloc(files->used, sizeof(*tasks))) == NULL)
+        return;
+    start = now_ns();
+    for (it = 0; it < cfg->iters; it++) {
+        for (i = 0; i < files->used; i++) {
+            tasks[i] = new afs_task<afs_status>(find_load(&fsa, adfs, files->items[i], &bytes));
+            tasks[i]->start();
+        }
+        while (pool.pending() > 0)
+            pool.poll(1);
+        for (i = 0; i < files->used; i++, ops++)
+            delete tasks[i];
+    }
+    record("async_find+load", ops, start, bytes);
+    free(tasks);
+}
+
+static void bench_all(BenchADFS *adfs, const bench_cfg *cfg, name_list *files, name_list *dirs, const char *tmp_dir) {
+    unsigned long long start, bytes;
+    unsigned long ops;
+    afs_object root, obj, *objs;
+    afs_object *ents;
+    unsigned count, i, it;
+    unsigned char *ent;
+    char parent[256], *host, *img2;
+    BenchADFS *copy;
+    DiskImgIO *dio2;
+    volatile unsigned sum = 0;
+
+    objs = (afs_object *)calloc(files->used, sizeof(afs_object));
+    for (i = 0; i < files->used; i++)
+        adfs->find(files->items[i], objs + i);
+
+    start = now_ns();
+    for (ops = it = 0; it < cfg->iters; it++)
+        for (i = 0; i < files->used; i++, ops++)
+            adfs->find(files->items[i], &obj);
+    record("find", ops, start, 0);
+
+    adfs->find("$", &root);
+    if (adfs->list(&root, &ents, &count) == AFS_OK) {
+        start = now_ns();
+        for (ops = it = 0; it < cfg->iters; it++) {
+            for (i = 0; i < count; i++, ops++) {
+                adfs->find("$", &root);
+                adfs->search(&root, &obj, ents[i].name, strlen(ents[i].name), &ent);
+                adfs->obj_free(&root);
+            }
+        }
+        record("search", ops, start, 0);
+        free(ents);
+    }
+
+    start = now_ns();
+    for (ops = it = bytes = 0; it < cfg->iters; it++) {
+        for (i = 0; i < files->used; i++, ops++) {
+            obj = objs[i];
+            if (adfs->load(&obj) == AFS_OK) {
+                bytes += obj.length;
+                adfs->obj_free(&obj);
+            }
+        }
+    }
+    record("load", ops, start, bytes);
+
+    bench_async(adfs, cfg, files);
+
+    for (i = 0; i < files->used; i++)
+        adfs->load(objs + i);
+    start = now_ns();
+    for (ops = it = bytes = 0; it < cfg->iters; it++) {
+        for (i = 0; i < files->used; i++, ops++) {
+            if (adfs->save(objs + i, parent_of(files->items[i], parent)) == AFS_OK)
+                bytes += objs[i].length;
+        }
+    }
+    record("save", ops, start, bytes);
+
+    if (adfs->load_fsmap() == AFS_OK) {
+        memset(&obj, 0, sizeof(obj));
+        fill(&obj, 1024);
+        start = now_ns();
+        for (ops = it = 0; it < cfg->iters * 100; it++, ops++) {
+            if (adfs->alloc_write(&obj) != AFS_OK || adfs->map_free(&obj) != AFS_OK)
+                break;
+        }
+        record("alloc_write+map_free", ops, start, ops * obj.length);
+        free(obj.data);
+
+        start = now_ns();
+        for (ops = it = 0; it < cfg->iters * 10000; it++, ops++)
+            sum = sum + BenchADFS::checksum(adfs->map());
+        record("checksum", ops, start, 0);
+    }
+
+    start = now_ns();
+    for (ops = bytes = 0; ops < files->used; ops++) {
+        if (adfs->find(files->items[ops], &obj) == AFS_OK && adfs->load(&obj) == AFS_OK) {
+            if (asprintf(&host, "%s/%lu", tmp_dir, ops) >= 0) {
+                if (AcornFS::host_save(&obj, host) == 0)
+                    bytes += obj.length;
+                free(host);
+            }
+            adfs->obj_free(&obj);
+        }
+    }
+    record("copy_out", ops, start, bytes);
+
+    if (asprintf(&img2, "%s/copy.adf", tmp_dir) >= 0) {
+        if ((dio2 = create_image(img2, &copy, cfg->sectors))) {
+            for (i = 0; i < dirs->used; i++) {
+                parent_of(dirs->items[i], parent);
+                copy->mkdir(strrchr(dirs->items[i], '.') + 1, parent);
+            }
+            start = now_ns();
+            for (ops = bytes = 0; ops < files->used; ops++) {
+                if (asprintf(&host, "%s/%lu", tmp_dir, ops) >= 0) {
+                    if (AcornFS::host_load(&obj, host) == 0) {
+                        strcpy(obj.name, strrchr(files->items[ops], '.') + 1);
+                        if (copy->save(&obj, parent_of(files->items[ops], parent)) == AFS_OK)
+                            bytes += obj.length;
+                        free(obj.data);
+                    }
+                    free(host);
+                }
+            }
+            record("copy_in", ops, start, bytes);
+            delete copy;
+            dio2->close();
+            delete dio2;
+        }
+        free(img2);
+    }
+
+    for (i = 0; i < files->used; i++)
+        adfs->obj_free(objs + i);
+    free(objs);
+}
+
+static void print_json(const bench_cfg *cfg, unsigned nfiles, unsigned ndirs, unsigned moved, unsigned fragments) {
+    bench_result *r;
+    unsigned i;
+
+    printf("{\n  \"config\": {\"depth\": %u, \"dirs_per_dir\": %u, \"files_per_dir\": %u, \"frag_percent\": %u, "
+           "\"max_file_size\": %u, \"sectors\": %u, \"iterations\": %u, \"seed\": %u},\n",
+           cfg->depth, cfg->branch, cfg->files, cfg->frag, cfg->max_size, cfg->sectors, cfg->iters, cfg->seed);
+    printf("  \"image\": {\"files\": %u, \"dirs\": %u, \"files_moved\": %u, \"free_fragments\": %u},\n",
+           nfiles, ndirs, moved, fragments);
+    printf("  \"results\": [\n");
+    for (i = 0; i < nresults; i++) {
+        r = results + i;
+        printf("    {\"name\": \"%s\", \"ops\": %lu, \"total_ns\": %llu, \"ns_per_op\": %.1f",
+               r->name, r->ops, r->ns, r->ops ? (double)r->ns / r->ops : 0.0);
+        if (r->bytes)
+            printf(", \"bytes\": %llu, \"mb_per_s\": %.2f", r->bytes, r->ns ? r->bytes * 1000.0 / r->ns : 0.0);
+        printf("}%s\n", i + 1 < nresults ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    bench_cfg cfg = { 2, 3, 8, 20, 4096, 2560, 10, 1 };
+    name_list files = { NULL, 0, 0 }, dirs = { NULL, 0, 0 };
+    char tmp_dir[] = "/tmp/adfsbench.XXXXXX", *img;
+    afs_status status;
+    BenchADFS *adfs;
+    DiskImgIO *dio;
+    unsigned moved;
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "d:b:f:F:m:s:i:r:")) != -1) {
+        switch (opt) {
+            case 'd': cfg.depth    = atoi(optarg); break;
+            case 'b': cfg.branch   = atoi(optarg); break;
+            case 'f': cfg.files    = atoi(optarg); break;
+            case 'F': cfg.frag     = atoi(optarg); break;
+            case 'm': cfg.max_size = atoi(optarg); break;
+            case 's': cfg.sectors  = atoi(optarg); break;
+            case 'i': cfg.iters    = atoi(optarg); break;
+            case 'r': cfg.seed     = atoi(optarg); break;
+            default:
+                fputs(usage, stderr);
+                return 1;
+        }
+    }
+    if (cfg.max_size == 0 || cfg.iters == 0 || cfg.files + cfg.branch > 47) {
+        fputs(usage, stderr);
+        return 1;
+    }
+    srand(cfg.seed);
+    if (mkdtemp(tmp_dir) == NULL || asprintf(&img, "%s/bench.adf", tmp_dir) < 0) {
+        fprintf(stderr, "adfsbench: unable to create work directory: %s\n", strerror(errno));
+        return 2;
+    }
+    if ((dio = create_image(img, &adfs, cfg.sectors)) == NULL) {
+        fprintf(stderr, "adfsbench: unable to create image '%s': %s\n", img, strerror(errno));
+        rc = 2;
+    }
+    else {
+        if ((status = gen_tree(adfs, &cfg, "$", cfg.depth, &files, &dirs)) != AFS_OK) {
+            fprintf(stderr, "adfsbench: unable to generate image: %s\n", AcornFS::afs_error(status));
+            rc = 4;
+        }
+        else {
+            moved = fragment(adfs, &cfg, &files);
+            adfs->load_fsmap();
+            bench_all(adfs, &cfg, &files, &dirs, tmp_dir);
+            print_json(&cfg, files.used, dirs.used, moved, adfs->map() ? adfs->map()[0x1fe] / 3 : 0);
+        }
+        delete adfs;
+        dio->close();
+        delete dio;
+    }
+    nftw(tmp_dir, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+    list_free(&files);
+    list_free(&dirs);
+    free(img);
+    return rc;
+}
@@ -1,33 +1,55 @@
 #include "DiskImgIO.h"
 #include "AcornADFS.h"
+#include "AcornADFSbuild.h"
+#include "AcornADFSdisc.h"
+#include "ContentStore.h"
+#include "HostMirror.h"
+#include "ImgDiff.h"
+#include "SectorStore.h"
+#include "TarStream.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static const char usage[] = "Usage: adfscp: <in|out> <adfs-disc> <from-name> <to-name>\n";
+static const char usage[] =
+    "Usage: adfscp: [-x] [-M] <in|out> <adfs-disc> <from-name> <to-name>\n"
+    "       adfscp: [-M] fsck <adfs-disc>\n"
+    "       adfscp: [-M] catalog <adfs-disc>\n"
+    "       adfscp: [-M] build <adfs-disc> <S|M|L|sectors> <host-dir|@manifest>\n"
+    "       adfscp: [-M] export <adfs-disc> <store-dir> <host-dir> <manifest>\n"
+    "       adfscp: [-x] [-M] batch <adfs-disc> <command-file|->\n"
+    "       adfscp: [-M] tar <adfs-disc>\n"
+    "       adfscp: [-M] diff <old-disc> <new-disc> [patch-file]\n"
+    "       adfscp: [-M] patch <adfs-disc> <patch-file>\n"
+    "       adfscp: [-M] rename <adfs-disc> <from-name> <to-name>\n"
+    "       adfscp: [-M] delete <adfs-disc> [-f] <adfs-name>\n"
+    "       adfscp: [-M] copy <from-disc> <adfs-name> <to-disc> <adfs-dir>\n"
+    "       adfscp: restore <store-dir> <name> <adfs-disc>\n"
+    "       adfscp: [-x] [-M] sync <adfs-disc> <host-dir>\n";
 
-int main(int argc, char **argv) {
-    const char *cmd, *disc, *aname, *hname;
+static int in_memory;
+
+static char *catalog_name(const char *disc) {
+    char *cat;
+
+    if ((cat = (char *)malloc(strlen(disc) + 5)))
+        sprintf(cat, "%s.cat", disc);
+    return cat;
+}
+
+static int copy(int argc, char **argv, int copyin) {
+    const char *disc, *aname, *hname;
+    char *cat = NULL;
     AcornADFS *adfs;
-    afs_status status;
+    afs_status status = AFS_OK;
     afs_object obj;
-    int err, copyin;
+    int err = 0;
 
-    if (argc != 5) {
-        fputs(usage, stderr);
-        return 1;
-    }
-    cmd = argv[1];
-    if (strcasecmp(cmd, "in") == 0)
-        copyin = 1;
-    else if (strcasecmp(cmd, "out") == 0)
-        copyin = 0;
-    else {
-        fputs(usage, stderr);
-        return 1;
-    }
     disc = argv[2];
-    DiskImgIO *dio = DiskImgIO::openImg(disc, copyin);
+    DiskImgIO *dio = DiskImgIO::openImg(disc, copyin, in_memory);
     if (dio == NULL) {
         fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
         return 2;
@@ -45,6 +67,8 @@ int main(int argc, char **argv) {
     } else {
         aname = argv[3];
         hname = argv[4];
+        if ((cat = catalog_name(disc)))
+            adfs->use_catalog(cat, 0);
         if ((status = adfs->find(aname, &obj)) == AFS_OK) {
             if ((status = adfs->load(&obj)) == AFS_OK) {
                 if ((err = AcornFS::host_save(&obj, hname)) != 0) {
@@ -54,10 +78,827 @@ int main(int argc, char **argv) {
             }
         }
     }
-    dio->close();
+    delete adfs;
+    if (dio->close() != 0 && status == AFS_OK && err == 0) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", disc, strerror(errno));
+        err = 4;
+    }
+    free(cat);
     if (status != AFS_OK) {
         fprintf(stderr, "adfscp: error loading ADFS file '%s': %s\n", aname, AcornFS::afs_error(status));
         err = 4;
     }
     return err;
 }
+
+static int cmd_in(int argc, char **argv) {
+    return copy(argc, argv, 1);
+}
+
+static int cmd_out(int argc, char **argv) {
+    return copy(argc, argv, 0);
+}
+
+static int cmd_fsck(int argc, char **argv) {
+    const char *disc = argv[2];
+    AcornADFS *adfs;
+    afs_status status;
+    unsigned problems;
+
+    DiskImgIO *dio = DiskImgIO::openImg(disc, 0, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
+        return 2;
+    }
+    adfs = new AcornADFS(dio);
+    status = adfs->check(stdout, &problems);
+    delete adfs;
+    dio->close();
+    if (status != AFS_OK) {
+        fprintf(stderr, "adfscp: unable to check ADFS disc '%s': %s\n", disc, AcornFS::afs_error(status));
+        return 4;
+    }
+    if (problems > 0) {
+        fprintf(stderr, "adfscp: %u problem(s) found on '%s'\n", problems, disc);
+        return 3;
+    }
+    return 0;
+}
+
+static int cmd_catalog(int argc, char **argv) {
+    const char *disc = argv[2];
+    AcornADFS *adfs;
+    afs_status status;
+    char *cat;
+    int rc = 0;
+
+    DiskImgIO *dio = DiskImgIO::openImg(disc, 0, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
+        return 2;
+    }
+    adfs = new AcornADFS(dio);
+    if ((cat = catalog_name(disc)) == NULL)
+        status = AFS_NO_MEMORY;
+    else
+        status = adfs->use_catalog(cat, 1);
+    if (status != AFS_OK) {
+        fprintf(stderr, "adfscp: unable to catalog ADFS disc '%s': %s\n", disc, AcornFS::afs_error(status));
+        rc = 4;
+    }
+    free(cat);
+    delete adfs;
+    dio->close();
+    return rc;
+}
+
+/*
+ * Files gathered on a walk, with a name for each, ready to be handed
+ * to AcornADFS::extract.
+ */
+
+typedef struct {
+    afs_object *objs;
+    char       **names;
+    unsigned   count;
+    unsigned   alloc;
+} file_list;
+
+static afs_status file_list_add(file_list *fl, afs_object *obj, char *name) {
+    afs_object *objs;
+    char **names;
+
+    if (fl->count == fl->alloc) {
+        fl->alloc = fl->alloc ? fl->alloc * 2 : 64;
+        if ((objs = (afs_object *)realloc(fl->objs, fl->alloc * sizeof(afs_object))) != NULL)
+            fl->objs = objs;
+        if ((names = (char **)realloc(fl->names, fl->alloc * sizeof(char *))) != NULL)
+            fl->names = names;
+        if (objs == NULL || names == NULL) {
+            free(name);
+            return AFS_NO_MEMORY;
+        }
+    }
+    fl->objs[fl->count] = *obj;
+    fl->names[fl->count++] = name;
+    return AFS_OK;
+}
+
+static void file_list_free(file_list *fl) {
+    while (fl->count > 0)
+        free(fl->names[--fl->count]);
+    free(fl->names);
+    free(fl->objs);
+}
+
+typedef struct {
+    AcornADFS    *adfs;
+    ContentStore *store;
+    const char   *host_dir;
+    file_list    files;
+} export_ctx;
+
+static afs_status export_obj(void *ctx, const char *path, afs_object *obj) {
+    export_ctx *ec = (export_ctx *)ctx;
+    afs_status status = AFS_OK;
+    char *name;
+
+    if (obj->is_dir) {
+        if ((name = AcornFS::host_path(ec->host_dir, path)) == NULL)
+            return AFS_NO_MEMORY;
+        if (mkdir(name, 0777) != 0 && errno != EEXIST) {
+            fprintf(stderr, "adfscp: unable to create directory '%s': %s\n", name, strerror(errno));
+            status = AFS_HOST_ERROR;
+        }
+        free(name);
+    }
+    else if ((name = strdup(path)) == NULL)
+        status = AFS_NO_MEMORY;
+    else
+        status = file_list_add(&ec->files, obj, name);
+    return status;
+}
+
+static afs_status export_file(void *ctx, unsigned index, afs_object *obj) {
+    export_ctx *ec = (export_ctx *)ctx;
+    const char *path = ec->files.names[index];
+    afs_status status = AFS_OK;
+    char *host;
+    int err;
+
+    if ((host = AcornFS::host_path(ec->host_dir, path)) == NULL)
+        status = AFS_NO_MEMORY;
+    else if ((err = ec->store->submit(obj, path, host)) != 0) {
+        fprintf(stderr, "adfscp: unable to export '%s': %s\n", path, strerror(err));
+        status = AFS_HOST_ERROR;
+    }
+    ec->adfs->obj_free(obj);
+    free(host);
+    return status;
+}
+
+static int cmd_export(int argc, char **argv) {
+    const char *disc = argv[2], *mname = argv[5];
+    ContentStore *store;
+    export_ctx ec;
+    afs_status status;
+    FILE *manifest;
+    long ncpu;
+    int err, rc = 0;
+
+    DiskImgIO *dio = DiskImgIO::openImg(disc, 0, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
+        return 2;
+    }
+    if ((manifest = fopen(mname, "wt")) == NULL) {
+        fprintf(stderr, "adfscp: unable to create manifest '%s': %s\n", mname, strerror(errno));
+        dio->close();
+        return 5;
+    }
+    ec.adfs = new AcornADFS(dio);
+    ec.host_dir = argv[4];
+    memset(&ec.files, 0, sizeof(ec.files));
+    store = ec.store = new ContentStore(argv[3], manifest);
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        ncpu = 1;
+    if (mkdir(ec.host_dir, 0777) != 0 && errno != EEXIST)
+        err = errno;
+    else
+        err = store->start(ncpu);
+    if (err == 0) {
+        if ((status = ec.adfs->walk("$", export_obj, &ec)) == AFS_OK)
+            status = ec.adfs->extract(ec.files.objs, ec.files.count, export_file, &ec);
+        err = store->finish();
+        if (status != AFS_OK) {
+            fprintf(stderr, "adfscp: error exporting ADFS disc '%s': %s\n", disc, AcornFS::afs_error(status));
+            rc = 4;
+        }
+        else
+            fprintf(stderr, "adfscp: %u blob(s) written, %u shared\n", store->blobs_written, store->blobs_shared);
+    }
+    if (err != 0) {
+        fprintf(stderr, "adfscp: error exporting to '%s': %s\n", argv[3], strerror(err));
+        rc = 5;
+    }
+    file_list_free(&ec.files);
+    delete store;
+    if (fclose(manifest) != 0 && rc == 0) {
+        fprintf(stderr, "adfscp: error writing manifest '%s': %s\n", mname, strerror(errno));
+        rc = 5;
+    }
+    delete ec.adfs;
+    dio->close();
+    return rc;
+}
+
+static int cmd_build(int argc, char **argv) {
+    const char *disc = argv[2], *size = argv[3], *src = argv[4];
+    AcornADFSbuild *build;
+    afs_status status;
+    unsigned sectors;
+    DiskImgIO *dio;
+    FILE *fp;
+    int rc = 0;
+
+    if (strcasecmp(size, "S") == 0)
+        sectors = 640;
+    else if (strcasecmp(size, "M") == 0)
+        sectors = 1280;
+    else if (strcasecmp(size, "L") == 0)
+        sectors = 2560;
+    else if ((sectors = strtoul(size, NULL, 0)) == 0) {
+        fputs(usage, stderr);
+        return 1;
+    }
+    build = new AcornADFSbuild();
+    if (src[0] == '@')
+        status = build->add_manifest(src + 1);
+    else
+        status = build->add_tree(src);
+    if (status != AFS_OK) {
+        fprintf(stderr, "adfscp: unable to read '%s': %s\n", src, AcornFS::afs_error(status));
+        delete build;
+        return 5;
+    }
+    if ((fp = fopen(disc, "wb")) == NULL || fclose(fp) != 0 || (dio = DiskImgIO::openImg(disc, 1, in_memory)) == NULL) {
+        fprintf(stderr, "adfscp: unable to create ADFS disc '%s': %s\n", disc, strerror(errno));
+        delete build;
+        return 2;
+    }
+    if ((status = build->write(dio, sectors)) != AFS_OK) {
+        fprintf(stderr, "adfscp: unable to build ADFS disc '%s': %s\n", disc, AcornFS::afs_error(status));
+        rc = 4;
+    }
+    if (dio->close() != 0 && rc == 0) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", disc, strerror(errno));
+        rc = 4;
+    }
+    delete dio;
+    delete build;
+    return rc;
+}
+
+/*
+ * Run commands from a file against one open image.  Each line is one
+ * of:
+ *
+ *   in <host-file> <adfs-dir>
+ *   out <adfs-name> <host-file>
+ *   list <adfs-name>
+ *   info <adfs-name>
+ *   rename <from-name> <to-name>
+ *   delete <adfs-name>
+ *
+ * Blank lines and lines starting with '#' are ignored.  Directory and
+ * map updates are held back until the end; each command reports
+ * "<line>: ok" or "<line>: error: <reason>" on stdout.
+ */
+
+static afs_status batch_cmd(AcornADFS *adfs, char **args, int nargs, const char **host_err) {
+    afs_object obj, *ents;
+    afs_status status;
+    unsigned count, i;
+    int err;
+
+    *host_err = NULL;
+    if (strcasecmp(args[0], "in") == 0 && nargs == 3) {
+        if ((err = AcornFS::host_load(&obj, args[1])) != 0) {
+            *host_err = strerror(err);
+            return AFS_HOST_ERROR;
+        }
+        status = adfs->save(&obj, args[2]);
+        free(obj.data);
+        return status;
+    }
+    if (strcasecmp(args[0], "out") == 0 && nargs == 3) {
+        if ((status = adfs->find(args[1], &obj)) == AFS_OK && (status = adfs->load(&obj)) == AFS_OK) {
+            if ((err = AcornFS::host_save(&obj, args[2])) != 0) {
+                *host_err = strerror(err);
+                status = AFS_HOST_ERROR;
+            }
+            adfs->obj_free(&obj);
+        }
+        return status;
+    }
+    if (strcasecmp(args[0], "list") == 0 && nargs == 2) {
+        if ((status = adfs->find(args[1], &obj)) == AFS_OK) {
+            if (!obj.is_dir)
+                AcornFS::print_attr(&obj, stdout);
+            else if ((status = adfs->list(&obj, &ents, &count)) == AFS_OK) {
+                for (i = 0; i < count; i++)
+                    AcornFS::print_attr(ents + i, stdout);
+                free(ents);
+            }
+        }
+        return status;
+    }
+    if (strcasecmp(args[0], "rename") == 0 && nargs == 3)
+        return adfs->rename(args[1], args[2]);
+    if (strcasecmp(args[0], "delete") == 0 && nargs == 2)
+        return adfs->remove(args[1], 0);
+    if (strcasecmp(args[0], "info") == 0 && nargs == 2) {
+        if ((status = adfs->find(args[1], &obj)) == AFS_OK) {
+            fprintf(stdout, "%s\t", args[1]);
+            AcornFS::print_attr(&obj, stdout);
+        }
+        return status;
+    }
+    return AFS_BAD_COMMAND;
+}
+
+static int cmd_batch(int argc, char **argv) {
+    const char *disc = argv[2], *cname = argv[3], *host_err;
+    char *line = NULL, *args[4], *ptr;
+    unsigned lineno = 0, failed = 0;
+    AcornADFS *adfs;
+    afs_status status;
+    size_t len = 0;
+    FILE *fp;
+    int nargs, rc = 0;
+
+    if (strcmp(cname, "-") == 0)
+        fp = stdin;
+    else if ((fp = fopen(cname, "rt")) == NULL) {
+        fprintf(stderr, "adfscp: unable to open command file '%s': %s\n", cname, strerror(errno));
+        return 5;
+    }
+    DiskImgIO *dio = DiskImgIO::openImg(disc, 1, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
+        if (fp != stdin)
+            fclose(fp);
+        return 2;
+    }
+    adfs = new AcornADFS(dio);
+    adfs->set_deferred(1);
+    while (getline(&line, &len, fp) >= 0) {
+        lineno++;
+        nargs = 0;
+        for (ptr = strtok(line, " \t\r\n"); ptr && nargs < 4; ptr = strtok(NULL, " \t\r\n"))
+            args[nargs++] = ptr;
+        if (nargs == 0 || args[0][0] == '#')
+            continue;
+        if (ptr != NULL)
+            status = AFS_BAD_COMMAND;
+        else
+            status = batch_cmd(adfs, args, nargs, &host_err);
+        if (status == AFS_OK)
+            printf("%u: ok\n", lineno);
+        else {
+            printf("%u: error: %s\n", lineno, host_err ? host_err : AcornFS::afs_error(status));
+            failed++;
+        }
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    if ((status = adfs->set_deferred(0)) != AFS_OK) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", disc, AcornFS::afs_error(status));
+        rc = 4;
+    }
+    delete adfs;
+    if (dio->close() != 0 && rc == 0) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", disc, strerror(errno));
+        rc = 4;
+    }
+    if (failed > 0) {
+        fprintf(stderr, "adfscp: %u command(s) failed\n", failed);
+        rc = 4;
+    }
+    return rc;
+}
+
+/*
+ * Write the whole image to stdout as a pax archive.  Directories go
+ * first, while walking, then the files are read back in ascending
+ * sector order so the image is swept once from start to end.
+ */
+
+typedef struct {
+    AcornADFS *adfs;
+    TarStream *tar;
+    file_list files;
+    int       err;
+} tar_ctx;
+
+static time_t tar_mtime(afs_object *obj) {
+    unsigned long long cs;
+
+    if ((obj->load_addr & 0xfff00000) != 0xfff00000)
+        return 0;
+    cs = ((unsigned long long)(obj->load_addr & 0xff) << 32) | obj->exec_addr;
+    return (time_t)(cs / 100) - 2208988800LL;
+}
+
+static afs_status tar_obj(void *ctx, const char *adfs_name, afs_object *obj) {
+    tar_ctx *tc = (tar_ctx *)ctx;
+    char *path;
+
+    if ((path = AcornFS::host_path("", adfs_name)) == NULL)
+        return AFS_NO_MEMORY;
+    if (obj->is_dir) {
+        tc->err = tc->tar->add(path + 1, obj, tar_mtime(obj));
+        free(path);
+        return tc->err ? AFS_HOST_ERROR : AFS_OK;
+    }
+    return file_list_add(&tc->files, obj, path);
+}
+
+static afs_status tar_file(void *ctx, unsigned index, afs_object *obj) {
+    tar_ctx *tc = (tar_ctx *)ctx;
+
+    tc->err = tc->tar->add(tc->files.names[index] + 1, obj, tar_mtime(obj));
+    tc->adfs->obj_free(obj);
+    return tc->err ? AFS_HOST_ERROR : AFS_OK;
+}
+
+static int cmd_tar(int argc, char **argv) {
+    const char *disc = argv[2];
+    static char buf[1 << 20];
+    afs_status status;
+    tar_ctx tc;
+    int rc = 0;
+
+    DiskImgIO *dio = DiskImgIO::openImg(disc, 0, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
+        return 2;
+    }
+    AcornADFS *adfs = new AcornADFS(dio);
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    memset(&tc, 0, sizeof(tc));
+    tc.adfs = adfs;
+    tc.tar = new TarStream(stdout);
+    if ((status = adfs->walk("$", tar_obj, &tc)) == AFS_OK)
+        status = adfs->extract(tc.files.objs, tc.files.count, tar_file, &tc);
+    if (status == AFS_OK)
+        tc.err = tc.tar->finish();
+    if (tc.err != 0) {
+        fprintf(stderr, "adfscp: error writing archive: %s\n", strerror(tc.err));
+        rc = 5;
+    }
+    else if (status != AFS_OK) {
+        fprintf(stderr, "adfscp: error reading ADFS disc '%s': %s\n", disc, AcornFS::afs_error(status));
+        rc = 4;
+    }
+    file_list_free(&tc.files);
+    delete tc.tar;
+    delete adfs;
+    dio->close();
+    return rc;
+}
+
+/*
+ * Compare two images sector by sector and name what changed: files
+ * and directories of the new image whose entry changed or whose data
+ * touches a changed sector are listed as M (or A when not in the old
+ * image) and objects of the old
+ * image no longer present as D.  Optionally write a patch as well.
+ */
+
+typedef struct {
+    ImgDiff   *diff;
+    AcornADFS *other;
+    DiskImgIO *dio;
+    int       is_old;
+} diff_ctx;
+
+static afs_status diff_obj(void *ctx, const char *path, afs_object *obj) {
+    diff_ctx *dc = (diff_ctx *)ctx;
+    afs_object other;
+    int found;
+
+    found = dc->other && dc->other->find(path, &other) == AFS_OK;
+    if (dc->is_old) {
+        if (!found)
+            printf("D\t%s\n", path);
+    }
+    else if (!found)
+        printf("A\t%s\n", path);
+    else if (other.sector != obj->sector || other.length != obj->length
+             || other.load_addr != obj->load_addr || other.exec_addr != obj->exec_addr
+             || (obj->length > 0 && dc->diff->changed(obj->sector, dc->dio->sectors(obj->length))))
+        printf("M\t%s\n", path);
+    return AFS_OK;
+}
+
+static int cmd_diff(int argc, char **argv) {
+    AcornADFS *old_fs, *new_fs;
+    DiskImgIO *old_dio, *new_dio;
+    afs_status status;
+    diff_ctx dc;
+    ImgDiff diff;
+    FILE *fp;
+    int err, rc = 0;
+
+    if ((old_dio = DiskImgIO::openImg(argv[2], 0, in_memory)) == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", argv[2], strerror(errno));
+        return 2;
+    }
+    if ((new_dio = DiskImgIO::openImg(argv[3], 0, in_memory)) == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", argv[3], strerror(errno));
+        old_dio->close();
+        return 2;
+    }
+    if ((err = diff.compare(old_dio, new_dio)) != 0) {
+        fprintf(stderr, "adfscp: error comparing discs: %s\n", strerror(err));
+        rc = 5;
+    }
+    else if (diff.sectors_changed > 0) {
+        old_fs = new AcornADFS(old_dio);
+        new_fs = new AcornADFS(new_dio);
+        dc.diff = &diff;
+        dc.dio = new_dio;
+        if (diff.changed(0, 2))
+            printf("M\t<free space map>\n");
+        if (diff.changed(2, DIR_SECTORS))
+            printf("M\t$\n");
+        dc.other = old_fs;
+        dc.is_old = 0;
+        status = new_fs->walk("$", diff_obj, &dc);
+        if (status == AFS_OK) {
+            dc.other = new_fs;
+            dc.is_old = 1;
+            status = old_fs->walk("$", diff_obj, &dc);
+        }
+        if (status != AFS_OK) {
+            fprintf(stderr, "adfscp: unable to map changes to files: %s\n", AcornFS::afs_error(status));
+            rc = 4;
+        }
+        delete new_fs;
+        delete old_fs;
+    }
+    if (rc == 0)
+        fprintf(stderr, "adfscp: %u of %u sector(s) differ\n", diff.sectors_changed, diff.sectors);
+    if (rc == 0 && argc == 5) {
+        if ((fp = fopen(argv[4], "wb")) == NULL)
+            err = errno;
+        else {
+            err = diff.write_patch(fp, new_dio);
+            if (fclose(fp) != 0 && err == 0)
+                err = errno;
+        }
+        if (err != 0) {
+            fprintf(stderr, "adfscp: unable to write patch '%s': %s\n", argv[4], strerror(err));
+            rc = 5;
+        }
+    }
+    new_dio->close();
+    old_dio->close();
+    return rc;
+}
+
+static int cmd_patch(int argc, char **argv) {
+    const char *disc = argv[2];
+    FILE *fp;
+    int err, rc = 0;
+
+    if ((fp = fopen(argv[3], "rb")) == NULL) {
+        fprintf(stderr, "adfscp: unable to open patch '%s': %s\n", argv[3], strerror(errno));
+        return 5;
+    }
+    DiskImgIO *dio = DiskImgIO::openImg(disc, 1, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
+        fclose(fp);
+        return 2;
+    }
+    if ((err = ImgDiff::apply(dio, fp)) < 0) {
+        fprintf(stderr, "adfscp: patch '%s' was not made against ADFS disc '%s'\n", argv[3], disc);
+        rc = 4;
+    }
+    else if (err > 0) {
+        fprintf(stderr, "adfscp: error applying patch '%s': %s\n", argv[3], strerror(err));
+        rc = 5;
+    }
+    if (dio->close() != 0 && rc == 0) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", disc, strerror(errno));
+        rc = 5;
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Rename, move and delete only rewrite directory entries and the map,
+ * whatever the size of the file.
+ */
+
+static int cmd_rename(int argc, char **argv) {
+    afs_status status;
+
+    DiskImgIO *dio = DiskImgIO::openImg(argv[2], 1, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", argv[2], strerror(errno));
+        return 2;
+    }
+    AcornADFS *adfs = new AcornADFS(dio);
+    if ((status = adfs->rename(argv[3], argv[4])) != AFS_OK)
+        fprintf(stderr, "adfscp: unable to rename '%s' to '%s': %s\n", argv[3], argv[4], AcornFS::afs_error(status));
+    delete adfs;
+    if (dio->close() != 0 && status == AFS_OK) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", argv[2], strerror(errno));
+        return 4;
+    }
+    return status == AFS_OK ? 0 : 4;
+}
+
+static int cmd_delete(int argc, char **argv) {
+    const char *name = argv[argc - 1];
+    afs_status status;
+    int force = 0;
+
+    if (argc == 5) {
+        if (strcmp(argv[3], "-f") != 0) {
+            fprintf(stderr, "adfscp: unknown option '%s'\n", argv[3]);
+            return 1;
+        }
+        force = 1;
+    }
+    DiskImgIO *dio = DiskImgIO::openImg(argv[2], 1, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", argv[2], strerror(errno));
+        return 2;
+    }
+    AcornADFS *adfs = new AcornADFS(dio);
+    if ((status = adfs->remove(name, force)) != AFS_OK)
+        fprintf(stderr, "adfscp: unable to delete '%s': %s\n", name, AcornFS::afs_error(status));
+    delete adfs;
+    if (dio->close() != 0 && status == AFS_OK) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", argv[2], strerror(errno));
+        return 4;
+    }
+    return status == AFS_OK ? 0 : 4;
+}
+
+/*
+ * Copy a file or a whole subtree straight from one image to another;
+ * the destination's directory and map writes are deferred to the end.
+ * Both names may refer to the same image.
+ */
+
+static int cmd_copy(int argc, char **argv) {
+    const char *from = argv[2], *to = argv[4];
+    DiskImgIO *src_dio, *dst_dio;
+    AcornADFS *src, *dst;
+    struct stat src_st, dst_st;
+    afs_status status, fstatus;
+
+    if ((src_dio = DiskImgIO::openImg(from, 0, in_memory)) == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", from, strerror(errno));
+        return 2;
+    }
+    if ((dst_dio = DiskImgIO::openImg(to, 1, in_memory)) == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", to, strerror(errno));
+        src_dio->close();
+        return 2;
+    }
+    dst = new AcornADFS(dst_dio);
+    if (src_dio->stat(&src_st) == 0 && dst_dio->stat(&dst_st) == 0
+        && src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino)
+        src = dst;
+    else
+        src = new AcornADFS(src_dio);
+    dst->set_deferred(1);
+    status = AcornFS::copy(src, argv[3], dst, argv[5]);
+    if ((fstatus = dst->set_deferred(0)) != AFS_OK && status == AFS_OK)
+        status = fstatus;
+    if (status != AFS_OK)
+        fprintf(stderr, "adfscp: unable to copy '%s' to '%s': %s\n", argv[3], argv[5], AcornFS::afs_error(status));
+    if (src != dst)
+        delete src;
+    delete dst;
+    if (dst_dio->close() != 0 && status == AFS_OK) {
+        fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", to, strerror(errno));
+        status = AFS_WRITE_ERR;
+    }
+    src_dio->close();
+    return status == AFS_OK ? 0 : 4;
+}
+
+/*
+ * Write an image archived with "adfsbatch archive" back out to a file.
+ */
+
+static int cmd_restore(int argc, char **argv) {
+    const char *disc = argv[4];
+    unsigned char *data = NULL;
+    struct stat st;
+    FILE *fp;
+    int rc = 0;
+
+    DiskImgIO *dio = SectorStore::open_image(argv[2], argv[3], 1);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open '%s' in store '%s': %s\n", argv[3], argv[2], strerror(errno));
+        return 2;
+    }
+    if (dio->stat(&st) != 0 || (st.st_size > 0 && (data = dio->read(0, st.st_size)) == NULL)) {
+        fprintf(stderr, "adfscp: error reading '%s' from store '%s': %s\n", argv[3], argv[2], strerror(errno ? errno : EIO));
+        rc = 4;
+    }
+    else if ((fp = fopen(disc, "wb")) == NULL) {
+        fprintf(stderr, "adfscp: unable to create ADFS disc '%s': %s\n", disc, strerror(errno));
+        rc = 5;
+    }
+    else {
+        if (st.st_size > 0 && fwrite(data, st.st_size, 1, fp) != 1)
+            rc = 5;
+        if (fclose(fp) != 0)
+            rc = 5;
+        if (rc)
+            fprintf(stderr, "adfscp: error writing ADFS disc '%s': %s\n", disc, strerror(errno));
+    }
+    dio->dio_free(data);
+    dio->close();
+    delete dio;
+    return rc;
+}
+
+/*
+ * Mirror an image into a host directory, writing and deleting only
+ * what changed since the last sync into the same directory.
+ */
+
+static int cmd_sync(int argc, char **argv) {
+    const char *disc = argv[2], *host_dir = argv[3];
+    afs_status status;
+    char *error = NULL;
+    int err, rc = 0;
+
+    DiskImgIO *dio = DiskImgIO::openImg(disc, 0, in_memory);
+    if (dio == NULL) {
+        fprintf(stderr, "adfscp: unable to open ADFS disc '%s': %s\n", disc, strerror(errno));
+        return 2;
+    }
+    AcornADFS *adfs = new AcornADFS(dio);
+    HostMirror *mirror = new HostMirror(adfs, host_dir);
+    if ((err = mirror->load()) != 0) {
+        fprintf(stderr, "adfscp: unable to read sync state in '%s': %s\n", host_dir, strerror(err));
+        rc = 5;
+    }
+    else if ((status = mirror->run(&error)) != AFS_OK) {
+        fprintf(stderr, "adfscp: unable to sync '%s': %s\n", disc, error ? error : AcornFS::afs_error(status));
+        rc = status == AFS_HOST_ERROR ? 5 : 4;
+    }
+    else if ((err = mirror->finish()) != 0) {
+        fprintf(stderr, "adfscp: unable to write sync state in '%s': %s\n", host_dir, strerror(err));
+        rc = 5;
+    }
+    else
+        fprintf(stderr, "adfscp: %u file(s) written, %u unchanged, %u removed, %u director(ies) unchanged\n",
+                mirror->written, mirror->kept, mirror->deleted, mirror->dirs_skipped);
+    free(error);
+    delete mirror;
+    delete adfs;
+    dio->close();
+    return rc;
+}
+
+static const struct {
+    const char *name;
+    int        argc;
+    int        (*func)(int argc, char **argv);
+} commands[] = {
+    { "in",      5, cmd_in      },
+    { "out",     5, cmd_out     },
+    { "fsck",    3, cmd_fsck    },
+    { "export",  6, cmd_export  },
+    { "catalog", 3, cmd_catalog },
+    { "build",   5, cmd_build   },
+    { "batch",   4, cmd_batch   },
+    { "tar",     3, cmd_tar     },
+    { "diff",    4, cmd_diff    },
+    { "diff",    5, cmd_diff    },
+    { "patch",   4, cmd_patch   },
+    { "rename",  5, cmd_rename  },
+    { "delete",  4, cmd_delete  },
+    { "delete",  5, cmd_delete  },
+    { "copy",    6, cmd_copy    },
+    { "restore", 5, cmd_restore },
+    { "sync",    4, cmd_sync    },
+    { NULL,      0, NULL        }
+};
+
+int main(int argc, char **argv) {
+    int i;
+
+    // -x keeps attributes of extracted files in user.acorn.* xattrs,
+    // -M works on floppy sized images in memory.
+    while (argc >= 2 && (strcmp(argv[1], "-x") == 0 || strcmp(argv[1], "-M") == 0)) {
+        if (argv[1][1] == 'x')
+            AcornFS::host_xattr = 1;
+        else
+            in_memory = 1;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if (argc >= 2) {
+        for (i = 0; commands[i].name; i++)
+            if (strcasecmp(argv[1], commands[i].name) == 0 && argc == commands[i].argc)
+                return commands[i].func(argc, argv);
+    }
+    fputs(usage, stderr);
+    return 1;
+}
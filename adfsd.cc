@@ -0,0 +1,587 @@
+#include "DiskImgIO.h"
+#include "AcornADFS.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char usage[] =
+    "Usage: adfsd [-s socket] [-n max-images] [-t idle-secs] [-j max-conns]\n"
+    "       adfsd [-s socket] -c list <adfs-disc> <adfs-name>\n"
+    "       adfsd [-s socket] -c get <adfs-disc> <adfs-name> <host-file>\n"
+    "       adfsd [-s socket] -c put <adfs-disc> <adfs-dir> <host-file>\n";
+
+/*
+ * Protocol: every message is a frame, a 32 bit big endian length and
+ * that many bytes.  A request is one frame holding NUL separated
+ * fields: the operation, the image path and the ADFS name, followed
+ * for "put" by the file attributes as an .inf line and a second frame
+ * with the file contents.  The reply is one frame starting with an
+ * afs_status byte and then text: a listing, the attributes of a "get"
+ * or an error message.  A successful "get" is followed by a frame with
+ * the file contents.  A connection may carry any number of requests.
+ *
+ * Images are known by device and inode, however the path is spelt, so
+ * there is one AcornADFS instance per image file.  The daemon expects
+ * to own the images it serves: a change made by another process is
+ * noticed on the next request when no put is in progress, and the
+ * image is then reopened, but a change made during a put is lost.
+ */
+
+#define FRAME_MAX (64 * 1024 * 1024)
+
+typedef struct adfsd_image adfsd_image;
+
+struct adfsd_image {
+    adfsd_image *next;
+    char        *path;
+    DiskImgIO   *dio;
+    AcornADFS   *adfs;
+    int         writable;
+    int         stale;
+    unsigned    refs;
+    unsigned    writers;
+    time_t      last_used;
+    struct stat st;
+};
+
+static adfsd_image *images;
+static unsigned nimages, max_images = 32, idle_secs = 300;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned nconns, max_conns = 64;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_cond = PTHREAD_COND_INITIALIZER;
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *ptr = (char *)buf;
+    ssize_t got;
+
+    while (len > 0) {
+        if ((got = read(fd, ptr, len)) <= 0) {
+            if (got < 0 && errno == EINTR)
+                continue;
+            return got == 0 ? EPIPE : errno;
+        }
+        ptr += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *ptr = (const char *)buf;
+    ssize_t done;
+
+    while (len > 0) {
+        if ((done = write(fd, ptr, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        ptr += done;
+        len -= done;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, const void *data, size_t len) {
+    uint32_t hdr = htonl(len);
+    int err;
+
+    if ((err = write_full(fd, &hdr, sizeof(hdr))) == 0)
+        err = write_full(fd, data, len);
+    return err;
+}
+
+/*
+ * Receive a frame into a malloc'd buffer with a NUL appended so text
+ * frames can be used as strings.
+ */
+
+static int recv_frame(int fd, char **data, size_t *len) {
+    uint32_t hdr;
+    char *buf;
+    int err;
+
+    if ((err = read_full(fd, &hdr, sizeof(hdr))) != 0)
+        return err;
+    if ((hdr = ntohl(hdr)) > FRAME_MAX)
+        return EMSGSIZE;
+    if ((buf = (char *)malloc(hdr + 1)) == NULL)
+        return ENOMEM;
+    if ((err = read_full(fd, buf, hdr)) != 0) {
+        free(buf);
+        return err;
+    }
+    buf[hdr] = '\0';
+    *data = buf;
+    *len = hdr;
+    return 0;
+}
+
+static void image_close(adfsd_image *img) {
+    delete img->adfs;
+    img->dio->close();
+    delete img->dio;
+    free(img->path);
+    free(img);
+}
+
+/*
+ * Close unused images that have been idle too long and then, while
+ * over the limit, the least recently used unused ones.  Called with
+ * images_lock held.
+ */
+
+static void images_trim(time_t now) {
+    adfsd_image **prev, *img, **lru;
+
+    for (prev = &images; (img = *prev); ) {
+        if (img->refs == 0 && now - img->last_used >= (time_t)idle_secs) {
+            *prev = img->next;
+            image_close(img);
+            nimages--;
+        }
+        else
+            prev = &img->next;
+    }
+    while (nimages > max_images) {
+        lru = NULL;
+        for (prev = &images; (img = *prev); prev = &img->next)
+            if (img->refs == 0 && (lru == NULL || img->last_used < (*lru)->last_used))
+                lru = prev;
+        if (lru == NULL)
+            break;
+        img = *lru;
+        *lru = img->next;
+        image_close(img);
+        nimages--;
+    }
+}
+
+/*
+ * Find an open image by device and inode, opening it if need be.  An
+ * image changed on disc by someone else since it was opened is
+ * reopened so stale maps and directories are not served; one still in
+ * use is taken out of the table and closed by its last image_put.
+ */
+
+static adfsd_image *image_get(const char *path, int writing, int *err) {
+    adfsd_image **prev, *img;
+    struct stat st;
+    time_t now = time(NULL);
+
+    if (stat(path, &st) != 0) {
+        *err = errno;
+        return NULL;
+    }
+    pthread_mutex_lock(&images_lock);
+    for (prev = &images; (img = *prev); prev = &img->next) {
+        if (img->st.st_dev == st.st_dev && img->st.st_ino == st.st_ino) {
+            if (img->writers > 0 || (img->st.st_mtim.tv_sec == st.st_mtim.tv_sec
+                                     && img->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec && img->st.st_size == st.st_size))
+                break;
+            *prev = img->next;
+            nimages--;
+            if (img->refs > 0)
+                img->stale = 1;
+            else
+                image_close(img);
+            img = NULL;
+            break;
+        }
+    }
+    if (img == NULL) {
+        if ((img = (adfsd_image *)calloc(1, sizeof(adfsd_image))) == NULL || (img->path = strdup(path)) == NULL) {
+            free(img);
+            pthread_mutex_unlock(&images_lock);
+            *err = ENOMEM;
+            return NULL;
+        }
+        img->writable = 1;
+        if ((img->dio = DiskImgIO::openImg(path, 1)) == NULL) {
+            img->writable = 0;
+            img->dio = DiskImgIO::openImg(path, 0);
+        }
+        if (img->dio == NULL) {
+            *err = errno;
+            free(img->path);
+            free(img);
+            pthread_mutex_unlock(&images_lock);
+            return NULL;
+        }
+        img->adfs = new AcornADFS(img->dio);
+        img->dio->stat(&img->st);
+        img->next = images;
+        images = img;
+        nimages++;
+    }
+    img->refs++;
+    if (writing)
+        img->writers++;
+    img->last_used = now;
+    images_trim(now);
+    pthread_mutex_unlock(&images_lock);
+    return img;
+}
+
+static void image_put(adfsd_image *img, int writing) {
+    pthread_mutex_lock(&images_lock);
+    if (writing) {
+        img->dio->stat(&img->st);
+        img->writers--;
+    }
+    img->refs--;
+    img->last_used = time(NULL);
+    if (img->stale && img->refs == 0)
+        image_close(img);
+    pthread_mutex_unlock(&images_lock);
+}
+
+static void images_close_all() {
+    adfsd_image *img;
+
+    pthread_mutex_lock(&images_lock);
+    while ((img = images)) {
+        images = img->next;
+        image_close(img);
+    }
+    nimages = 0;
+    pthread_mutex_unlock(&images_lock);
+}
+
+static int send_reply(int fd, afs_status status, const char *text, size_t len) {
+    char *buf;
+    int err;
+
+    if ((buf = (char *)malloc(len + 1)) == NULL)
+        return ENOMEM;
+    buf[0] = status;
+    memcpy(buf + 1, text, len);
+    err = send_frame(fd, buf, len + 1);
+    free(buf);
+    return err;
+}
+
+static int send_error(int fd, afs_status status, const char *msg) {
+    return send_reply(fd, status, msg, strlen(msg));
+}
+
+static afs_status do_list(AcornADFS *adfs, const char *name, FILE *out) {
+    afs_object obj, *ents;
+    afs_status status;
+    unsigned count, i;
+
+    if ((status = adfs->find(name, &obj)) != AFS_OK)
+        return status;
+    if (!obj.is_dir) {
+        AcornFS::print_attr(&obj, out);
+        return AFS_OK;
+    }
+    if ((status = adfs->list(&obj, &ents, &count)) == AFS_OK) {
+        for (i = 0; i < count; i++)
+            AcornFS::print_attr(ents + i, out);
+        free(ents);
+    }
+    return status;
+}
+
+/*
+ * Serve one request.  A non-zero return means the connection is
+ * unusable and should be dropped.
+ */
+
+static int serve_request(int fd, char *req, size_t len) {
+    const char *op, *image, *name, *attr;
+    afs_status status = AFS_OK;
+    adfsd_image *img;
+    afs_object obj;
+    char *text = NULL, *data = NULL;
+    size_t text_len = 0, data_len;
+    FILE *fp;
+    int err, writing;
+
+    op = req;
+    image = op + strlen(op) + 1;
+    if (image >= req + len)
+        return send_error(fd, AFS_BAD_COMMAND, "malformed request");
+    name = image + strlen(image) + 1;
+    if (name >= req + len)
+        return send_error(fd, AFS_BAD_COMMAND, "malformed request");
+    attr = name + strlen(name) + 1;
+    if (attr > req + len)
+        attr = req + len;
+
+    if (strcmp(op, "put") == 0 && (err = recv_frame(fd, &data, &data_len)) != 0)
+        return err;
+    writing = strcmp(op, "put") == 0;
+    if ((img = image_get(image, writing, &err)) == NULL) {
+        free(data);
+        return send_error(fd, AFS_HOST_ERROR, strerror(err));
+    }
+    if ((fp = open_memstream(&text, &text_len)) == NULL) {
+        image_put(img, writing);
+        free(data);
+        return errno;
+    }
+    if (strcmp(op, "list") == 0)
+        status = do_list(img->adfs, name, fp);
+    else if (strcmp(op, "get") == 0) {
+        if ((status = img->adfs->find(name, &obj)) == AFS_OK && obj.is_dir)
+            status = AFS_IS_DIR;
+        if (status == AFS_OK && (status = img->adfs->load(&obj)) == AFS_OK)
+            AcornFS::print_attr(&obj, fp);
+    }
+    else if (strcmp(op, "put") == 0) {
+        FILE *afp = fmemopen((void *)attr, strlen(attr), "r");
+        if (!img->writable)
+            status = AFS_WRITE_ERR;
+        else if (afp == NULL)
+            status = AFS_NO_MEMORY;
+        else if ((status = AcornFS::parse_attr(&obj, afp)) == AFS_OK) {
+            obj.length = data_len;
+            obj.data = (unsigned char *)data;
+            status = img->adfs->save(&obj, name);
+        }
+        if (afp)
+            fclose(afp);
+    }
+    else
+        status = AFS_BAD_COMMAND;
+    fclose(fp);
+
+    // the reference is held until the data is sent and freed as the
+    // image may otherwise be closed under us.
+    if (status != AFS_OK)
+        err = send_error(fd, status, AcornFS::afs_error(status));
+    else if ((err = send_reply(fd, status, text, text_len)) == 0 && strcmp(op, "get") == 0)
+        err = send_frame(fd, obj.data, obj.length);
+    if (strcmp(op, "get") == 0 && status == AFS_OK)
+        img->adfs->obj_free(&obj);
+    image_put(img, writing);
+    free(text);
+    free(data);
+    return err;
+}
+
+static void *serve_conn(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    size_t len;
+    char *req;
+
+    while (recv_frame(fd, &req, &len) == 0) {
+        if (serve_request(fd, req, len) != 0) {
+            free(req);
+            break;
+        }
+        free(req);
+    }
+    close(fd);
+    pthread_mutex_lock(&conns_lock);
+    nconns--;
+    pthread_cond_signal(&conns_cond);
+    pthread_mutex_unlock(&conns_lock);
+    return NULL;
+}
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static int serve(const char *sock_path) {
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    pthread_attr_t attr;
+    struct timespec until;
+    pthread_t thread;
+    int lfd, cfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "adfsd: socket path '%s' is too long\n", sock_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "adfsd: unable to create socket: %s\n", strerror(errno));
+        return 2;
+    }
+    unlink(sock_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 64) != 0) {
+        fprintf(stderr, "adfsd: unable to listen on '%s': %s\n", sock_path, strerror(errno));
+        close(lfd);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    while (!stop) {
+        // connections beyond max_conns wait in the listen backlog.
+        pthread_mutex_lock(&conns_lock);
+        while (nconns >= max_conns && !stop) {
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec++;
+            pthread_cond_timedwait(&conns_cond, &conns_lock, &until);
+        }
+        pthread_mutex_unlock(&conns_lock);
+        if (!stop && poll(&pfd, 1, 1000) > 0 && (cfd = accept(lfd, NULL, NULL)) >= 0) {
+            pthread_mutex_lock(&conns_lock);
+            nconns++;
+            pthread_mutex_unlock(&conns_lock);
+            if (pthread_create(&thread, &attr, serve_conn, (void *)(intptr_t)cfd) != 0) {
+                close(cfd);
+                pthread_mutex_lock(&conns_lock);
+                nconns--;
+                pthread_mutex_unlock(&conns_lock);
+            }
+        }
+        pthread_mutex_lock(&images_lock);
+        images_trim(time(NULL));
+        pthread_mutex_unlock(&images_lock);
+    }
+    pthread_attr_destroy(&attr);
+    close(lfd);
+    unlink(sock_path);
+    images_close_all();
+    return 0;
+}
+
+static int client(const char *sock_path, int argc, char **argv) {
+    const char *op = argv[0], *aname = argv[2], *hname = argc > 3 ? argv[3] : NULL;
+    char image[PATH_MAX], *req, *reply = NULL, *data = NULL, *attr = NULL;
+    struct sockaddr_un addr;
+    size_t req_len, len, data_len, attr_len = 0;
+    afs_object obj;
+    FILE *fp;
+    int fd, err, rc = 0;
+
+    if (realpath(argv[1], image) == NULL) {
+        fprintf(stderr, "adfsd: unable to find ADFS disc '%s': %s\n", argv[1], strerror(errno));
+        return 2;
+    }
+    memset(&obj, 0, sizeof(obj));
+    if (strcmp(op, "put") == 0) {
+        if ((err = AcornFS::host_load(&obj, hname)) != 0) {
+            fprintf(stderr, "adfsd: error loading host file '%s': %s\n", hname, strerror(err));
+            return 5;
+        }
+        if ((fp = open_memstream(&attr, &attr_len)) != NULL) {
+            AcornFS::print_attr(&obj, fp);
+            fclose(fp);
+        }
+    }
+    req_len = strlen(op) + strlen(image) + strlen(aname) + attr_len + 3;
+    if ((req = (char *)malloc(req_len + 1)) == NULL)
+        return 5;
+    sprintf(req, "%s%c%s%c%s%c", op, 0, image, 0, aname, 0);
+    if (attr_len)
+        memcpy(req + req_len - attr_len, attr, attr_len);
+    free(attr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "adfsd: unable to connect to '%s': %s\n", sock_path, strerror(errno));
+        free(req);
+        free(obj.data);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    err = send_frame(fd, req, req_len);
+    if (err == 0 && strcmp(op, "put") == 0)
+        err = send_frame(fd, obj.data, obj.length);
+    free(req);
+    free(obj.data);
+    if (err == 0)
+        err = recv_frame(fd, &reply, &len);
+    if (err == 0 && len > 0 && reply[0] != AFS_OK) {
+        fprintf(stderr, "adfsd: error on ADFS file '%s': %s\n", aname, reply + 1);
+        rc = 4;
+    }
+    else if (err == 0 && strcmp(op, "get") == 0 && (err = recv_frame(fd, &data, &data_len)) == 0) {
+        if ((fp = fmemopen(reply + 1, len - 1, "r")) && AcornFS::parse_attr(&obj, fp) == AFS_OK) {
+            obj.length = data_len;
+            obj.data = (unsigned char *)data;
+            if ((err = AcornFS::host_save(&obj, hname)) != 0) {
+                fprintf(stderr, "adfsd: error saving host file '%s': %s\n", hname, strerror(err));
+                rc = 5;
+                err = 0;
+            }
+        }
+        if (fp)
+            fclose(fp);
+        free(data);
+    }
+    else if (err == 0 && strcmp(op, "list") == 0)
+        fwrite(reply + 1, len - 1, 1, stdout);
+    if (err) {
+        fprintf(stderr, "adfsd: error talking to '%s': %s\n", sock_path, strerror(err));
+        rc = 2;
+    }
+    free(reply);
+    close(fd);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    const char *sock_path;
+    char def_path[64];
+    int opt, client_mode = 0;
+
+    if ((sock_path = getenv("ADFSD_SOCKET")) == NULL) {
+        snprintf(def_path, sizeof(def_path), "/tmp/adfsd-%u.sock", (unsigned)getuid());
+        sock_path = def_path;
+    }
+    while ((opt = getopt(argc, argv, "s:n:t:j:c")) != -1) {
+        switch (opt) {
+            case 's':
+                sock_path = optarg;
+                break;
+            case 'n':
+                max_images = atoi(optarg);
+                break;
+            case 't':
+                idle_secs = atoi(optarg);
+                break;
+            case 'j':
+                if ((max_conns = atoi(optarg)) == 0)
+                    max_conns = 1;
+                break;
+            case 'c':
+                client_mode = 1;
+                break;
+            default:
+                fputs(usage, stderr);
+                return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (client_mode) {
+        if ((argc == 3 && strcmp(argv[0], "list") == 0)
+            || (argc == 4 && (strcmp(argv[0], "get") == 0 || strcmp(argv[0], "put") == 0)))
+            return client(sock_path, argc, argv);
+    }
+    else if (argc == 0)
+        return serve(sock_path);
+    fputs(usage, stderr);
+    return 1;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Archive an interleaved .adl image into a sector store and check that
+# restoring it gives back the same bytes, and that the store and the
+# restored image both still read as a filesystem.
+
+set -e
+bin=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir -p "$tmp/host/dir"
+echo "first file" > "$tmp/host/one"
+echo "second file" > "$tmp/host/dir/two"
+# big enough to reach past the first track, which reads the same
+# either way.
+seq 1 20000 > "$tmp/host/dir/three"
+"$bin/adfscp" build "$tmp/linear.adf" L "$tmp/host"
+
+# each side of an L image is 80 tracks of 16 sectors; interleaved
+# images store track t of side 0 then track t of side 1.
+t=0
+while [ $t -lt 80 ]; do
+    dd if="$tmp/linear.adf" of="$tmp/disc.adl" bs=4096 count=1 skip=$t seek=$((t * 2)) conv=notrunc 2>/dev/null
+    dd if="$tmp/linear.adf" of="$tmp/disc.adl" bs=4096 count=1 skip=$((t + 80)) seek=$((t * 2 + 1)) conv=notrunc 2>/dev/null
+    t=$((t + 1))
+done
+
+"$bin/adfsbatch" -j 1 archive "$tmp/store" "$tmp/disc.adl" 2>/dev/null
+"$bin/adfscp" restore "$tmp/store" disc.adl "$tmp/restored.adl"
+cmp "$tmp/disc.adl" "$tmp/restored.adl"
+"$bin/adfsbatch" -j 1 list "$tmp/restored.adl" 2>/dev/null | grep -q 'dir.two'
+"$bin/adfsbatch" -j 1 -s "$tmp/store" list disc.adl 2>/dev/null | grep -q 'dir.two'
+echo "archive_adl: ok"